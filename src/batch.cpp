@@ -0,0 +1,260 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "trace.h"
+#include "utils.h"
+
+
+void file_list_init(file_list_t *list) {
+	list->files = NULL;
+	list->size = 0;
+	list->capacity = 0;
+}
+
+
+void file_list_add(file_list_t *list, const char *file) {
+	if (list->size == list->capacity) {
+		uint32_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+		char **new_files = new char*[new_capacity];
+		if (list->size) {
+			memcpy(new_files, list->files, list->size * sizeof(*new_files));
+		}
+		delete[] list->files;
+		list->files = new_files;
+		list->capacity = new_capacity;
+	}
+	size_t length = strlen(file);
+	list->files[list->size] = new char[length + 1];
+	memcpy(list->files[list->size], file, length + 1);
+	list->size++;
+}
+
+
+// Adds every line of a file to the list, "-" reads from stdin. Empty lines are skipped.
+bool file_list_read(file_list_t *list, const char *list_file) {
+	FILE *fp = strcmp(list_file, "-") ? fopen(list_file, "rb") : stdin;
+	if (!fp) {
+		log_perror("Error");
+		return false;
+	}
+
+	char line[4096];
+	while (fgets(line, sizeof(line), fp)) {
+		size_t length = strlen(line);
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			length--;
+		}
+		line[length] = '\0';
+		if (length > 0) {
+			file_list_add(list, line);
+		}
+	}
+
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	return true;
+}
+
+
+void file_list_free(file_list_t *list) {
+	for (uint32_t i = 0; i < list->size; i++) {
+		delete[] list->files[i];
+	}
+	delete[] list->files;
+	file_list_init(list);
+}
+
+
+/*
+	Batch processing:
+
+	Files are sorted by size, largest first, and dealt round-robin to one queue per worker. Each worker takes
+	files from the front of its own queue, and when it's empty, steals from the back of the others', where
+	the smallest files are. This keeps the big files from all ending up at the end of the batch.
+
+	Console output of each file goes to its own log buffer, and the main thread prints them in the
+	original order of the files as soon as they're done.
+*/
+
+// Processes a file, collecting its stats if there's a place for them
+bool batch_process_file(batch_process_t process, const char *file, void *context, file_stats_t *stats) {
+#ifdef TH128_TRACE
+	double start_time = trace_enabled ? get_time_ms() : 0;
+	trace_set_file(file);
+#endif
+	if (stats) {
+		stats_begin_file(stats);
+	}
+	bool result = process(file, context);
+	if (stats) {
+		stats_end_file(result);
+	}
+#ifdef TH128_TRACE
+	if (trace_enabled) {
+		trace_event(file, start_time, get_time_ms());
+	}
+	trace_set_file(NULL);
+#endif
+	return result;
+}
+
+
+struct batch_task_t {
+	const char *file;
+	uint64_t file_size;
+	log_buffer_t log;
+	bool result;
+	bool done;
+};
+
+struct batch_queue_t {
+	std::mutex mutex;
+	std::deque<uint32_t> tasks;
+};
+
+struct batch_t {
+	batch_task_t *tasks;
+	batch_queue_t *queues;
+	uint32_t num_workers;
+	batch_process_t process;
+	void *context;
+	bool verbose;
+	file_stats_t *stats;
+	std::mutex done_mutex;
+	std::condition_variable done_condition;
+};
+
+
+bool batch_next_task(batch_t *batch, uint32_t worker, uint32_t &task) {
+	{
+		batch_queue_t &queue = batch->queues[worker];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+			return true;
+		}
+	}
+	for (uint32_t i = 1; i < batch->num_workers; i++) {
+		batch_queue_t &queue = batch->queues[(worker + i) % batch->num_workers];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void batch_worker(batch_t *batch, uint32_t worker) {
+	uint32_t task_index;
+	while (batch_next_task(batch, worker, task_index)) {
+		batch_task_t &task = batch->tasks[task_index];
+		log_set_buffer(&task.log);
+		if (batch->verbose) {
+			log_printf("Processing %s\n", task.file);
+		}
+		bool result = batch_process_file(batch->process, task.file, batch->context, batch->stats ? &batch->stats[task_index] : NULL);
+		if (batch->verbose) {
+			log_printf("\n");
+		}
+		log_set_buffer(NULL);
+
+		std::lock_guard<std::mutex> lock(batch->done_mutex);
+		task.result = result;
+		task.done = true;
+		batch->done_condition.notify_one();
+	}
+}
+
+
+// Processes every file in the list with num_jobs threads (0 = one per CPU core). Returns the amount of files that succeeded.
+// If verbose, the output of each file is preceded by its name and followed by an empty line.
+// If stats isn't NULL, the stats of each file are collected into it, in the order of the list.
+uint32_t run_batch(const file_list_t *list, uint32_t num_jobs, batch_process_t process, void *context, bool verbose, file_stats_t *stats) {
+	if (num_jobs == 0) {
+		num_jobs = std::thread::hardware_concurrency();
+	}
+	if (num_jobs > list->size) {
+		num_jobs = list->size;
+	}
+
+	uint32_t count = 0;
+	if (num_jobs <= 1) {
+		for (uint32_t i = 0; i < list->size; i++) {
+			if (verbose) {
+				log_printf("Processing %s\n", list->files[i]);
+			}
+			count += batch_process_file(process, list->files[i], context, stats ? &stats[i] : NULL);
+			if (verbose) {
+				log_printf("\n");
+			}
+		}
+		return count;
+	}
+
+	batch_t batch;
+	batch.tasks = new batch_task_t[list->size];
+	batch.queues = new batch_queue_t[num_jobs];
+	batch.num_workers = num_jobs;
+	batch.process = process;
+	batch.context = context;
+	batch.verbose = verbose;
+	batch.stats = stats;
+
+	uint32_t *order = new uint32_t[list->size];
+	for (uint32_t i = 0; i < list->size; i++) {
+		batch_task_t &task = batch.tasks[i];
+		struct stat file_stat;
+		task.file = list->files[i];
+		task.file_size = stat(task.file, &file_stat) == 0 ? file_stat.st_size : 0;
+		task.log = {NULL, 0, 0};
+		task.result = false;
+		task.done = false;
+		order[i] = i;
+	}
+	std::stable_sort(order, order + list->size, [&batch](uint32_t a, uint32_t b) {
+		return batch.tasks[a].file_size > batch.tasks[b].file_size;
+	});
+	for (uint32_t i = 0; i < list->size; i++) {
+		batch.queues[i % num_jobs].tasks.push_back(order[i]);
+	}
+	delete[] order;
+
+	std::thread *threads = new std::thread[num_jobs];
+	for (uint32_t i = 0; i < num_jobs; i++) {
+		threads[i] = std::thread(batch_worker, &batch, i);
+	}
+
+	for (uint32_t i = 0; i < list->size; i++) {
+		batch_task_t &task = batch.tasks[i];
+		{
+			std::unique_lock<std::mutex> lock(batch.done_mutex);
+			batch.done_condition.wait(lock, [&task] { return task.done; });
+		}
+		fwrite(task.log.data, 1, task.log.size, stdout);
+		fflush(stdout);
+		delete[] task.log.data;
+		count += task.result;
+	}
+
+	for (uint32_t i = 0; i < num_jobs; i++) {
+		threads[i].join();
+	}
+	delete[] threads;
+	delete[] batch.queues;
+	delete[] batch.tasks;
+
+	return count;
+}
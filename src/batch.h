@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "stats.h"
+
+
+// Processes a single file, returns whether it succeeded
+typedef bool (*batch_process_t)(const char *file, void *context);
+
+struct file_list_t {
+	char **files;
+	uint32_t size;
+	uint32_t capacity;
+};
+
+
+void file_list_init(file_list_t *list);
+void file_list_add(file_list_t *list, const char *file);
+bool file_list_read(file_list_t *list, const char *list_file);
+void file_list_free(file_list_t *list);
+
+bool batch_process_file(batch_process_t process, const char *file, void *context, file_stats_t *stats);
+uint32_t run_batch(const file_list_t *list, uint32_t num_jobs, batch_process_t process, void *context, bool verbose = true,
+	file_stats_t *stats = NULL);
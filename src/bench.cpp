@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "types.h"
+#include "encryption.h"
+#include "compression.h"
+#include "th128_core.h"
+#include "th128_fix.h"
+#include "th128_parse.h"
+#include "th128_analyze.h"
+#include "utils.h"
+
+
+/*
+	Benchmarks every stage of the tool on synthetic replays, so changes can be measured without a replay collection.
+
+	Replays are generated from a seed: same seed and options, same replays. Their inputs are held for a while and
+	then change, like in real replays, with the entropy being the chance of changing them on each frame.
+	They all have the wrong route, so fixing them does the full work.
+*/
+
+
+struct bench_options_t {
+	uint32_t num_replays = 20;
+	uint32_t seed = 1;
+	uint32_t num_stages = 3;
+	uint32_t num_frames = 0; // per stage, 0 = random between 5000 and 30000
+	double entropy = 0.08;
+	uint32_t comment_size = 64;
+	uint32_t repetitions = 3;
+};
+
+// Output of the tool, which is not wanted here. Emptied after each timed call so it doesn't grow.
+log_buffer_t bench_log = {NULL, 0, 0};
+
+struct bench_replay_t {
+	uint8_t *file_data;
+	uint32_t file_size;
+	uint8_t *decoded_data;
+	uint32_t decoded_size;
+	char file_name[64];
+};
+
+
+// xorshift32, so replays are the same on every platform
+inline uint32_t next_random(uint32_t &state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+
+inline double next_random_double(uint32_t &state) {
+	return (next_random(state) >> 8) / (double)(1 << 24);
+}
+
+
+// Stage ids of each route (Extra only has one stage)
+const uint16_t route_stages[][3] = {
+	{0x1, 0x2, 0x3}, {0x1, 0x4, 0x5},
+	{0x6, 0x7, 0x8}, {0x6, 0x9, 0xa},
+	{0xb, 0xc, 0xd}, {0xb, 0xe, 0xf},
+	{0x10, 0x10, 0x10}
+};
+
+
+// Generates decoded replay data with the wrong route
+uint8_t *generate_replay_data(uint32_t &random, const bench_options_t &options, uint32_t route, uint32_t &size) {
+	uint32_t num_stages = route == 6 ? 1 : options.num_stages;
+	uint32_t stage_frames[TH128_MAX_STAGES];
+	size = sizeof(th128_replay_data_t);
+	for (uint32_t i = 0; i < num_stages; i++) {
+		stage_frames[i] = options.num_frames ? options.num_frames : 5000 + next_random(random) % 25000;
+		size += sizeof(th128_stage_header_t) + stage_frames[i] * sizeof(th128_input_data_t) + (stage_frames[i] + 1) / 2;
+	}
+
+	uint8_t *data = new uint8_t[size]();
+	th128_replay_data_t *replay_data = (th128_replay_data_t *)data;
+	memcpy(replay_data->name, "BENCH   ", 8);
+	replay_data->date = 1600000000 + next_random(random) % 100000000;
+	replay_data->score = next_random(random) % 10000000;
+	replay_data->game_config.version = 0x00128001;
+	replay_data->game_config.screen_mode = 1;
+	replay_data->game_config.input_latency = 1;
+	replay_data->game_config.bgm_vol = 100;
+	replay_data->game_config.sfx_vol = 80;
+	replay_data->num_stages = num_stages;
+	replay_data->route = 7 + next_random(random) % 10; // shows up as Extra+N
+	replay_data->rank = route == 6 ? 4 : next_random(random) % 4;
+	replay_data->last_stage = route_stages[route][num_stages - 1];
+
+	uint8_t *curr_ptr = data + sizeof(th128_replay_data_t);
+	for (uint32_t i = 0; i < num_stages; i++) {
+		th128_stage_header_t *stage = (th128_stage_header_t *)curr_ptr;
+		stage->stage = route_stages[route][i];
+		stage->seed = next_random(random);
+		stage->num_frames = stage_frames[i];
+		stage->size = stage_frames[i] * sizeof(th128_input_data_t) + (stage_frames[i] + 1) / 2;
+		stage->shot_power = next_random(random) % 4;
+		stage->max_piv = 1000000;
+		stage->pos_y = 400 * 128;
+		stage->graze = next_random(random) % 1000;
+		for (int j = 0; j < 21; j++) {
+			stage->unused2[j] = next_random(random);
+		}
+		curr_ptr += sizeof(th128_stage_header_t);
+
+		th128_input_data_t *inputs = (th128_input_data_t *)curr_ptr;
+		uint16_t holding = 0;
+		for (uint32_t j = 0; j < stage_frames[i]; j++) {
+			uint16_t prev_holding = holding;
+			if (next_random_double(random) < options.entropy) {
+				holding = next_random(random) & 0x2fb; // only bits used by actual keys
+			}
+			inputs[j].holding.raw = holding;
+			inputs[j].pressed.raw = holding & ~prev_holding;
+			inputs[j].released.raw = prev_holding & ~holding;
+		}
+		curr_ptr += stage_frames[i] * sizeof(th128_input_data_t);
+
+		for (uint32_t j = 0; j < (stage_frames[i] + 1) / 2; j++) {
+			curr_ptr[j] = next_random(random) % 20 ? 60 : 59;
+		}
+		curr_ptr += (stage_frames[i] + 1) / 2;
+	}
+
+	return data;
+}
+
+
+// Builds a whole replay file: header, encoded data and user data (replay info and comment)
+uint8_t *generate_replay_file(uint32_t &random, const bench_options_t &options, const uint8_t *decoded_data, uint32_t decoded_size, uint32_t route, uint32_t &file_size) {
+	uint32_t encoded_size;
+	uint8_t *encoded_data = th128_encode_replay_data((uint8_t *)decoded_data, decoded_size, encoded_size);
+
+	char replay_info[256];
+	int replay_info_size = snprintf(replay_info, sizeof(replay_info),
+		"T128RPY Ver1.00\r\nName BENCH   \r\nDate 20/09/13 12:00\r\nRoute %s\r\nRank Normal\r\nStage All\r\nScore 1234560\r\nSlow Rate 0.00\r\n",
+		route_strs[route]) + 1;
+	char *comment = new char[options.comment_size + 1];
+	for (uint32_t i = 0; i < options.comment_size; i++) {
+		comment[i] = 'a' + next_random(random) % 26;
+	}
+	comment[options.comment_size] = '\0';
+
+	const th128_user_data_header_t info_header = {TH128_USER_MAGIC, sizeof(th128_user_data_header_t) + (uint64_t)replay_info_size};
+	const th128_user_data_header_t comment_header = {TH128_USER_MAGIC, sizeof(th128_user_data_header_t) + (uint64_t)options.comment_size + 1};
+	file_size = sizeof(th128_replay_header_t) + encoded_size + info_header.size + comment_header.size;
+	uint8_t *file_data = new uint8_t[file_size]();
+
+	th128_replay_header_t *header = (th128_replay_header_t *)file_data;
+	header->magic = TH128_REPLAY_MAGIC;
+	header->rpy_version = 2;
+	header->user_data_offset = sizeof(th128_replay_header_t) + encoded_size;
+	header->game_version = 0x100;
+	header->compressed_data_size = encoded_size;
+	header->uncompressed_data_size = decoded_size;
+
+	uint8_t *curr_ptr = file_data + sizeof(th128_replay_header_t);
+	memcpy(curr_ptr, encoded_data, encoded_size);
+	curr_ptr += encoded_size;
+	memcpy(curr_ptr, &info_header, sizeof(info_header));
+	memcpy(curr_ptr + sizeof(info_header), replay_info, replay_info_size);
+	curr_ptr += info_header.size;
+	memcpy(curr_ptr, &comment_header, sizeof(comment_header));
+	memcpy(curr_ptr + sizeof(comment_header), comment, options.comment_size + 1);
+
+	delete[] encoded_data;
+	delete[] comment;
+	return file_data;
+}
+
+
+/*
+	Results
+*/
+
+struct bench_result_t {
+	const char *name;
+	double *latencies; // ms, one per replay and repetition
+	uint32_t num_samples;
+	uint64_t bytes; // processed bytes, summed over all samples
+	double total_time; // ms
+	uint64_t output_bytes; // for compression ratio, 0 if not applicable
+};
+
+
+void bench_result_init(bench_result_t &result, const char *name, uint32_t max_samples) {
+	result.name = name;
+	result.latencies = new double[max_samples];
+	result.num_samples = 0;
+	result.bytes = 0;
+	result.total_time = 0;
+	result.output_bytes = 0;
+}
+
+
+inline void bench_result_add(bench_result_t &result, double time, uint32_t bytes) {
+	result.latencies[result.num_samples] = time;
+	result.num_samples++;
+	result.bytes += bytes;
+	result.total_time += time;
+}
+
+
+void bench_result_print(bench_result_t &result) {
+	std::sort(result.latencies, result.latencies + result.num_samples);
+	double p50 = result.latencies[(result.num_samples - 1) / 2];
+	double p99 = result.latencies[(uint32_t)((result.num_samples - 1) * 0.99)];
+	double mb_per_s = result.bytes / 1e6 / (result.total_time / 1000.0);
+	double ns_per_byte = result.total_time * 1e6 / result.bytes;
+	printf("%-18s %9.1f %8.2f %9.3f %9.3f", result.name, mb_per_s, ns_per_byte, p50, p99);
+	if (result.output_bytes) {
+		printf(" %7.4f", (double)result.output_bytes / result.bytes);
+	}
+	printf("\n");
+	delete[] result.latencies;
+}
+
+
+/*
+	Benchmarks
+*/
+
+// Only the compression, the records level also finds the input regions like th128_encode_replay_data_to does
+void bench_compress(bench_replay_t *replays, const bench_options_t &options, compression_level_t level, const char *name) {
+	bench_result_t result;
+	bench_result_init(result, name, options.num_replays * options.repetitions);
+	for (uint32_t r = 0; r < options.repetitions; r++) {
+		for (uint32_t i = 0; i < options.num_replays; i++) {
+			uint8_t *compressed_data = new uint8_t[compress_bound(replays[i].decoded_size)];
+			compression_options_t compression_options;
+			compression_options.level = level;
+			compression_record_region_t input_regions[TH128_MAX_STAGES];
+
+			double start_time = get_time_ms();
+			if (level == COMPRESSION_RECORDS) {
+				compression_options.record_regions = input_regions;
+				compression_options.num_record_regions = th128_find_input_regions(replays[i].decoded_data, replays[i].decoded_size, input_regions);
+			}
+			uint32_t compressed_size = compress_to(replays[i].decoded_data, replays[i].decoded_size, compressed_data, compression_options);
+			bench_result_add(result, get_time_ms() - start_time, replays[i].decoded_size);
+			result.output_bytes += compressed_size;
+			delete[] compressed_data;
+		}
+	}
+	bench_result_print(result);
+}
+
+
+void bench_decompress(bench_replay_t *replays, const bench_options_t &options) {
+	cipher_plan_t *plan = new cipher_plan_t;
+	cipher_plan_init(plan, game_th128.decrypt_layers, GAME_CIPHER_LAYERS, false);
+
+	bench_result_t result;
+	bench_result_init(result, "decompress", options.num_replays * options.repetitions);
+	for (uint32_t r = 0; r < options.repetitions; r++) {
+		for (uint32_t i = 0; i < options.num_replays; i++) {
+			const th128_replay_header_t *header = (const th128_replay_header_t *)replays[i].file_data;
+			uint8_t *compressed_data = new uint8_t[header->compressed_data_size];
+			uint8_t *decoded_data = new uint8_t[header->uncompressed_data_size];
+			// decrypted outside of the timed part
+			cipher_plan_apply_to(plan, replays[i].file_data + sizeof(th128_replay_header_t), compressed_data, header->compressed_data_size);
+
+			double start_time = get_time_ms();
+			decompress(compressed_data, decoded_data, header->compressed_data_size, header->uncompressed_data_size);
+			bench_result_add(result, get_time_ms() - start_time, header->uncompressed_data_size);
+
+			delete[] compressed_data;
+			delete[] decoded_data;
+		}
+	}
+	bench_result_print(result);
+	delete plan;
+}
+
+
+void bench_cipher(bench_replay_t *replays, const bench_options_t &options, bool encrypting) {
+	// encrypting undoes the layers in reverse order, like game_encrypt_data
+	cipher_layer_t layers[GAME_CIPHER_LAYERS];
+	for (int i = 0; i < GAME_CIPHER_LAYERS; i++) {
+		layers[i] = game_th128.decrypt_layers[encrypting ? GAME_CIPHER_LAYERS - 1 - i : i];
+	}
+	cipher_plan_t *plan = new cipher_plan_t;
+	cipher_plan_init(plan, layers, GAME_CIPHER_LAYERS, encrypting);
+
+	bench_result_t result;
+	bench_result_init(result, encrypting ? "encrypt" : "decrypt", options.num_replays * options.repetitions);
+	for (uint32_t r = 0; r < options.repetitions; r++) {
+		for (uint32_t i = 0; i < options.num_replays; i++) {
+			const th128_replay_header_t *header = (const th128_replay_header_t *)replays[i].file_data;
+			uint8_t *data = new uint8_t[header->compressed_data_size];
+			memcpy(data, replays[i].file_data + sizeof(th128_replay_header_t), header->compressed_data_size);
+
+			double start_time = get_time_ms();
+			cipher_plan_apply(plan, data, header->compressed_data_size);
+			bench_result_add(result, get_time_ms() - start_time, header->compressed_data_size);
+
+			delete[] data;
+		}
+	}
+	bench_result_print(result);
+	delete plan;
+}
+
+
+void bench_fix(bench_replay_t *replays, const bench_options_t &options, const compression_options_t *compression_options, const char *name) {
+	bench_result_t result;
+	bench_result_init(result, name, options.num_replays * options.repetitions);
+	for (uint32_t r = 0; r < options.repetitions; r++) {
+		for (uint32_t i = 0; i < options.num_replays; i++) {
+			double start_time = get_time_ms();
+			th128_fix_replay_file(replays[i].file_name, compression_options);
+			bench_result_add(result, get_time_ms() - start_time, replays[i].file_size);
+			bench_log.size = 0;
+		}
+	}
+	bench_result_print(result);
+}
+
+
+void bench_parse(bench_replay_t *replays, const bench_options_t &options) {
+	bench_result_t result;
+	bench_result_init(result, "parse (text)", options.num_replays * options.repetitions);
+	for (uint32_t r = 0; r < options.repetitions; r++) {
+		for (uint32_t i = 0; i < options.num_replays; i++) {
+			char out_file[80];
+			snprintf(out_file, sizeof(out_file), "%s.txt", replays[i].file_name);
+			double start_time = get_time_ms();
+			th128_parse_replay_data(replays[i].decoded_data, replays[i].decoded_size, out_file);
+			bench_result_add(result, get_time_ms() - start_time, replays[i].decoded_size);
+			bench_log.size = 0;
+		}
+	}
+	bench_result_print(result);
+}
+
+
+// Returns the frames counted per ms, or 0 if a replay's data is broken
+double bench_analyze(bench_replay_t *replays, const bench_options_t &options) {
+	th128_data_view_t *views = new th128_data_view_t[options.num_replays];
+	for (uint32_t i = 0; i < options.num_replays; i++) {
+		th128_error_t error = th128_view_replay_data(replays[i].decoded_data, replays[i].decoded_size, &views[i]);
+		if (error != TH128_OK) {
+			printf("Error analyzing %s: %s.\n", replays[i].file_name, th128_error_message(error));
+			delete[] views;
+			return 0;
+		}
+	}
+
+	bench_result_t result;
+	bench_result_init(result, "analyze", options.num_replays * options.repetitions);
+	uint64_t num_frames = 0;
+	for (uint32_t r = 0; r < options.repetitions; r++) {
+		for (uint32_t i = 0; i < options.num_replays; i++) {
+			th128_analysis_t analysis;
+			double start_time = get_time_ms();
+			th128_analyze_replay_data(&views[i], &analysis);
+			bench_result_add(result, get_time_ms() - start_time, replays[i].decoded_size);
+			num_frames += analysis.total.num_frames;
+		}
+	}
+	double frames_per_ms = num_frames / result.total_time;
+	bench_result_print(result);
+	delete[] views;
+	return frames_per_ms;
+}
+
+
+void display_usage(const char *filename) {
+	printf("Usage: %s [-n replays] [-s seed] [-g stages] [-f frames] [-e entropy] [-u comment size] [-r repetitions]\n", filename);
+	printf("\n");
+	printf("Generates replays in the current folder, benchmarks each step on them and removes them.\n");
+	printf("\t-f frames\tframes per stage (default: random between 5000 and 30000)\n");
+	printf("\t-e entropy\tchance of the inputs changing on each frame (default: 0.08)\n");
+}
+
+
+int main(int argc, char *argv[]) {
+	bench_options_t options;
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			display_usage(argv[0]);
+			return 1;
+		}
+		if (!strcmp(argv[i], "-n")) {
+			options.num_replays = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-s")) {
+			options.seed = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-g")) {
+			options.num_stages = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-f")) {
+			options.num_frames = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-e")) {
+			options.entropy = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "-u")) {
+			options.comment_size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-r")) {
+			options.repetitions = atoi(argv[++i]);
+		} else {
+			display_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (options.num_replays == 0 || options.repetitions == 0 || options.num_stages == 0 || options.num_stages > TH128_MAX_STAGES) {
+		display_usage(argv[0]);
+		return 1;
+	}
+
+	log_set_buffer(&bench_log);
+
+	// Generate replays
+	uint32_t random = options.seed ? options.seed : 1;
+	bench_replay_t *replays = new bench_replay_t[options.num_replays];
+	uint64_t total_decoded_size = 0;
+	uint64_t total_file_size = 0;
+	for (uint32_t i = 0; i < options.num_replays; i++) {
+		bench_replay_t &replay = replays[i];
+		uint32_t route = next_random(random) % 7;
+		replay.decoded_data = generate_replay_data(random, options, route, replay.decoded_size);
+		replay.file_data = generate_replay_file(random, options, replay.decoded_data, replay.decoded_size, route, replay.file_size);
+		snprintf(replay.file_name, sizeof(replay.file_name), "bench_%u_%03u.rpy", options.seed, i);
+		write_file(replay.file_name, "", replay.file_data, replay.file_size);
+		total_decoded_size += replay.decoded_size;
+		total_file_size += replay.file_size;
+	}
+	bench_log.size = 0;
+	printf("Generated %u replays (seed %u, entropy %.3f): %.1f MB decoded, %.1f MB encoded.\n\n", options.num_replays, options.seed,
+		options.entropy, total_decoded_size / 1e6, total_file_size / 1e6);
+
+	printf("%-18s %9s %8s %9s %9s %7s\n", "benchmark", "MB/s", "ns/byte", "p50 ms", "p99 ms", "ratio");
+	compression_options_t records_options;
+	records_options.level = COMPRESSION_RECORDS;
+	bench_compress(replays, options, COMPRESSION_GREEDY, "compress greedy");
+	bench_compress(replays, options, COMPRESSION_RECORDS, "compress records");
+	bench_decompress(replays, options);
+	bench_cipher(replays, options, false);
+	bench_cipher(replays, options, true);
+	bench_fix(replays, options, NULL, "fix (patch)");
+	bench_fix(replays, options, &records_options, "fix (records)");
+	bench_parse(replays, options);
+	double analyze_frames_per_ms = bench_analyze(replays, options);
+	printf("\nMB/s and ns/byte are per decoded byte, except for the cipher (compressed bytes) and fix (file bytes).\n");
+	if (analyze_frames_per_ms > 0) {
+		printf("analyze counted %.0f frames/ms.\n", analyze_frames_per_ms);
+	}
+
+	// remove the generated replays and what fix and parse wrote for them
+	const char *const suffixes[] = {"", ".fixed.rpy", ".txt"};
+	for (uint32_t i = 0; i < options.num_replays; i++) {
+		for (size_t j = 0; j < sizeof(suffixes) / sizeof(*suffixes); j++) {
+			char path[80];
+			snprintf(path, sizeof(path), "%s%s", replays[i].file_name, suffixes[j]);
+			remove(path);
+		}
+		delete[] replays[i].file_data;
+		delete[] replays[i].decoded_data;
+	}
+	delete[] replays;
+	log_set_buffer(NULL);
+	delete[] bench_log.data;
+
+	return 0;
+}
@@ -2,6 +2,9 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <thread>
+
+#include "utils.h"
 
 
 /*
@@ -20,29 +23,7 @@
 */
 
 
-uint32_t get_bits(uint8_t *buffer, uint32_t max_bytes, uint32_t &curr_byte, uint8_t &curr_mask, int num_bits) {
-	uint32_t result = 0;
-	uint8_t current;
-	current = buffer[curr_byte];
-	for (int i = 0; i < num_bits; i++) {
-		result <<= 1;
-		if (current & curr_mask) {
-			result |= 1;
-		}
-		curr_mask >>= 1;
-		if (curr_mask == 0) {
-			curr_byte++;
-			if (curr_byte == max_bytes) {
-				return result;
-			}
-			current = buffer[curr_byte];
-			curr_mask = 0x80;
-		}
-	}
-	return result;
-}
-
-
+// The current byte must be initialized, each new byte is zeroed before writing to it
 void write_bits(uint8_t *buffer, uint32_t &curr_byte, uint8_t &curr_mask, uint32_t value, int num_bits) {
     int value_mask = 1 << (num_bits - 1);
 	for (int i = 0; i < num_bits; i++) {
@@ -54,121 +35,843 @@ void write_bits(uint8_t *buffer, uint32_t &curr_byte, uint8_t &curr_mask, uint32
         if (curr_mask == 0) {
             curr_mask = 0x80;
             curr_byte++;
+            buffer[curr_byte] = 0;
         }
     }
 }
 
 
-uint32_t decompress(uint8_t *compressed_data, uint8_t *decompressed_data, uint32_t length) {
-	uint8_t history[HISTORY_SIZE];
-	uint8_t curr_mask = 0x80;
-	uint32_t curr_src_byte = 0;
+/*
+	Decoder:
+
+	The output buffer doubles as the history, a match copies from the latest position with the same
+	history index. Positions before the start of the data read as zeros.
+
+	Tokens are at most 18 bits, so a single unaligned 64-bit load is enough to decode any of them.
+	While there are at least 8 bytes of input and DECODE_HEADROOM bytes of output left, tokens are
+	decoded without any bounds checks and matches are copied 8 bytes at a time when they don't overlap
+	(the extra bytes are overwritten by later tokens). The rest of the data goes through a checked path.
+*/
+const uint32_t DECODE_HEADROOM = 24;
+
+inline uint64_t peek_bits(const uint8_t *buffer, uint64_t curr_bit) {
+	uint64_t value;
+	memcpy(&value, buffer + curr_bit / 8, sizeof(value));
+	return __builtin_bswap64(value) << (curr_bit % 8);
+}
+
+
+// Same as peek_bits, but bytes past the end of the buffer read as zeros
+inline uint64_t peek_bits_checked(const uint8_t *buffer, uint32_t length, uint64_t curr_bit) {
+	uint64_t value = 0;
+	for (uint64_t i = curr_bit / 8; i < curr_bit / 8 + 8; i++) {
+		value = (value << 8) | (i < length ? buffer[i] : 0);
+	}
+	return value << (curr_bit % 8);
+}
+
+
+// Copies a match byte by byte, reading zeros before the start of the data
+inline void copy_match_checked(uint8_t *data, uint32_t curr_byte, uint32_t distance, uint32_t length) {
+	for (uint32_t i = 0; i < length; i++) {
+		data[curr_byte + i] = curr_byte + i >= distance ? data[curr_byte + i - distance] : 0;
+	}
+}
+
+
+// Returns the size of the decompressed data, or DECOMPRESS_OVERFLOW. The data can end without a terminator, which
+// is only told through terminated when given.
+uint32_t decompress(const uint8_t *compressed_data, uint8_t *decompressed_data, uint32_t length, uint32_t capacity, bool *terminated) {
+	if (terminated) {
+		*terminated = false;
+	}
+	const uint64_t end_bit = (uint64_t)length * 8;
+	const uint64_t fast_end_bit = length >= sizeof(uint64_t) ? end_bit - sizeof(uint64_t) * 8 : 0;
+	const uint32_t fast_capacity = capacity >= DECODE_HEADROOM ? capacity - DECODE_HEADROOM : 0;
+	uint64_t curr_bit = 0;
 	uint32_t curr_dst_byte = 0;
-	while (curr_src_byte < length) {
-		bool control_bit = get_bits(compressed_data, length, curr_src_byte, curr_mask, 1);
-		if (control_bit) {
-			uint8_t data_byte = get_bits(compressed_data, length, curr_src_byte, curr_mask, 8);
-			decompressed_data[curr_dst_byte] = data_byte;
-			history[curr_dst_byte % HISTORY_SIZE] = data_byte;
+
+	// fast path
+	while (curr_bit < fast_end_bit && curr_dst_byte < fast_capacity) {
+		uint64_t bits = peek_bits(compressed_data, curr_bit);
+		if (bits >> 63) {
+			decompressed_data[curr_dst_byte] = bits >> 55;
 			curr_dst_byte++;
+			curr_bit += 9;
+			continue;
+		}
+
+		uint32_t history_index = (bits >> 50) & (HISTORY_SIZE - 1);
+		// check for data terminator
+		if (history_index == 0) {
+			if (terminated) {
+				*terminated = true;
+			}
+			return curr_dst_byte;
+		}
+		uint32_t data_length = ((bits >> 46) & ((1 << MATCH_LENGTH_BITS) - 1)) + MIN_MATCH_LENGTH;
+		uint32_t distance = ((curr_dst_byte - history_index) % HISTORY_SIZE) + 1;
+		curr_bit += 1 + HISTORY_INDEX_BITS + MATCH_LENGTH_BITS;
+
+		uint8_t *dst = decompressed_data + curr_dst_byte;
+		const uint8_t *src = dst - distance;
+		if (distance >= 8 && distance <= curr_dst_byte) {
+			// each chunk only reads bytes that have already been written
+			memcpy(dst, src, 8);
+			memcpy(dst + 8, src + 8, 8);
+			memcpy(dst + 16, src + 16, 8);
+		} else if (distance <= curr_dst_byte) {
+			for (uint32_t i = 0; i < data_length; i++) {
+				dst[i] = src[i];
+			}
+		} else {
+			copy_match_checked(decompressed_data, curr_dst_byte, distance, data_length);
+		}
+		curr_dst_byte += data_length;
+	}
+
+	// checked path
+	while (curr_bit < end_bit) {
+		uint64_t bits = peek_bits_checked(compressed_data, length, curr_bit);
+		if (bits >> 63) {
+			if (curr_dst_byte >= capacity) {
+				return DECOMPRESS_OVERFLOW;
+			}
+			decompressed_data[curr_dst_byte] = bits >> 55;
+			curr_dst_byte++;
+			curr_bit += 9;
+			continue;
+		}
+
+		uint32_t history_index = (bits >> 50) & (HISTORY_SIZE - 1);
+		if (history_index == 0) {
+			if (terminated) {
+				*terminated = true;
+			}
+			return curr_dst_byte;
+		}
+		uint32_t data_length = ((bits >> 46) & ((1 << MATCH_LENGTH_BITS) - 1)) + MIN_MATCH_LENGTH;
+		uint32_t distance = ((curr_dst_byte - history_index) % HISTORY_SIZE) + 1;
+		curr_bit += 1 + HISTORY_INDEX_BITS + MATCH_LENGTH_BITS;
+
+		if (data_length > capacity - curr_dst_byte) {
+			return DECOMPRESS_OVERFLOW;
+		}
+		copy_match_checked(decompressed_data, curr_dst_byte, distance, data_length);
+		curr_dst_byte += data_length;
+	}
+	return curr_dst_byte;
+}
+
+
+// Adds up the tokens of the compressed data, up to the data terminator
+void count_tokens(const uint8_t *compressed_data, uint32_t length, compression_token_counts_t &counts) {
+	uint64_t curr_bit = 0;
+	uint64_t end_bit = (uint64_t)length * 8;
+	while (curr_bit < end_bit) {
+		uint64_t bits = peek_bits_checked(compressed_data, length, curr_bit);
+		if (bits >> 63) {
+			counts.literals++;
+			curr_bit += 9;
+			continue;
+		}
+		if (((bits >> 50) & (HISTORY_SIZE - 1)) == 0) {
+			return;
+		}
+		counts.matches++;
+		counts.match_bytes += ((bits >> 46) & ((1 << MATCH_LENGTH_BITS) - 1)) + MIN_MATCH_LENGTH;
+		curr_bit += 1 + HISTORY_INDEX_BITS + MATCH_LENGTH_BITS;
+	}
+}
+
+
+/*
+	Streaming decoder:
+
+	Same output as decompress, but the compressed data can be given in pieces of any size and the decoded
+	data is handed out in pieces as well, so memory use doesn't depend on the size of the data.
+
+	Decoded bytes go into a ring of HISTORY_SIZE bytes, indexed by position % HISTORY_SIZE. A match copies
+	from the ring position of its history index minus one. Since the ring starts zeroed and a match never
+	reaches further back than HISTORY_SIZE bytes, positions before the start of the data read as zeros.
+	Pending bytes are handed out whenever the ring wraps around and at the end of each piece.
+
+	Input bits go through a 64-bit buffer. A token is only decoded when it's fully buffered, except after
+	the last piece, where missing bits read as zeros like in decompress.
+*/
+
+const uint32_t MAX_TOKEN_BITS = 1 + HISTORY_INDEX_BITS + MATCH_LENGTH_BITS;
+
+
+void decompress_stream_init(decompress_stream_t *stream, uint32_t capacity, decompress_output_t output, void *user_data) {
+	memset(stream->history, 0, sizeof(stream->history));
+	stream->bits = 0;
+	stream->num_bits = 0;
+	stream->curr_dst_byte = 0;
+	stream->flushed_byte = 0;
+	stream->capacity = capacity;
+	stream->output = output;
+	stream->user_data = user_data;
+	stream->status = DECOMPRESS_MORE;
+	stream->terminated = false;
+}
+
+
+// Hands out decoded bytes that haven't been handed out yet
+inline bool decompress_stream_flush(decompress_stream_t *stream) {
+	uint32_t size = stream->curr_dst_byte - stream->flushed_byte;
+	if (size == 0) {
+		return true;
+	}
+	const uint8_t *data = stream->history + stream->flushed_byte % HISTORY_SIZE;
+	stream->flushed_byte = stream->curr_dst_byte;
+	return stream->output(data, size, stream->user_data);
+}
+
+
+inline bool decompress_stream_put(decompress_stream_t *stream, uint8_t value) {
+	stream->history[stream->curr_dst_byte % HISTORY_SIZE] = value;
+	stream->curr_dst_byte++;
+	if (stream->curr_dst_byte % HISTORY_SIZE == 0) {
+		return decompress_stream_flush(stream);
+	}
+	return true;
+}
+
+
+decompress_status_t decompress_stream_push(decompress_stream_t *stream, const uint8_t *data, uint32_t size, bool last) {
+	uint32_t curr_byte = 0;
+
+	while (stream->status == DECOMPRESS_MORE) {
+		while (stream->num_bits <= 56 && curr_byte < size) {
+			stream->bits |= (uint64_t)data[curr_byte] << (56 - stream->num_bits);
+			stream->num_bits += 8;
+			curr_byte++;
+		}
+		if (stream->num_bits < MAX_TOKEN_BITS && !last) {
+			// wait for the next piece, unless this one is enough for a literal
+			if (stream->num_bits < 9 || !(stream->bits >> 63)) {
+				break;
+			}
+		}
+		if (stream->num_bits == 0) {
+			stream->status = DECOMPRESS_DONE;
+			break;
+		}
+
+		uint64_t bits = stream->bits;
+		uint32_t token_bits;
+		if (bits >> 63) {
+			if (stream->curr_dst_byte >= stream->capacity) {
+				stream->status = DECOMPRESS_ERROR;
+				break;
+			}
+			token_bits = 9;
+			if (!decompress_stream_put(stream, bits >> 55)) {
+				stream->status = DECOMPRESS_STOPPED;
+				break;
+			}
 		} else {
-			uint32_t history_index = get_bits(compressed_data, length, curr_src_byte, curr_mask, HISTORY_INDEX_BITS);
-			// check for data terminator
+			uint32_t history_index = (bits >> 50) & (HISTORY_SIZE - 1);
 			if (history_index == 0) {
-				return curr_dst_byte;
-			} else {
-				history_index -= 1;
+				stream->terminated = true;
+				stream->status = DECOMPRESS_DONE;
+				break;
 			}
-			uint32_t data_length = get_bits(compressed_data, length, curr_src_byte, curr_mask, MATCH_LENGTH_BITS) + MIN_MATCH_LENGTH;
+			uint32_t data_length = ((bits >> 46) & ((1 << MATCH_LENGTH_BITS) - 1)) + MIN_MATCH_LENGTH;
+			if (data_length > stream->capacity - stream->curr_dst_byte) {
+				stream->status = DECOMPRESS_ERROR;
+				break;
+			}
+			token_bits = MAX_TOKEN_BITS;
 			for (uint32_t i = 0; i < data_length; i++) {
-				history[curr_dst_byte % HISTORY_SIZE] = history[(history_index + i) % HISTORY_SIZE];
-				decompressed_data[curr_dst_byte] = history[(history_index + i) % HISTORY_SIZE];
-				curr_dst_byte++;
+				if (!decompress_stream_put(stream, stream->history[(history_index - 1 + i) % HISTORY_SIZE])) {
+					stream->status = DECOMPRESS_STOPPED;
+					break;
+				}
 			}
 		}
+
+		if (token_bits >= stream->num_bits) {
+			// past the end of the last piece, the missing bits were zeros
+			stream->bits = 0;
+			stream->num_bits = 0;
+		} else {
+			stream->bits <<= token_bits;
+			stream->num_bits -= token_bits;
+		}
 	}
-	printf("WARNING: reached end of data but didn't find data terminator! ");
-	return curr_dst_byte;
+
+	if ((stream->status == DECOMPRESS_MORE || stream->status == DECOMPRESS_DONE) && !decompress_stream_flush(stream)) {
+		stream->status = DECOMPRESS_STOPPED;
+	}
+	return stream->status;
 }
 
 
-inline int min(int a, int b) {
+/*
+	Match finder:
+
+	Positions are chained by the hash of their first MIN_MATCH_LENGTH bytes.
+	head[hash] holds the most recent position with that hash, and prev[pos % HISTORY_SIZE] holds the
+	previous position with the same hash as pos, so walking a chain visits candidates from nearest to furthest.
+	Positions older than HISTORY_SIZE bytes can no longer be referenced, which is also when their prev[] slot
+	gets reused, so chains are cut there.
+
+	Matches are read straight from the input buffer: a match may overlap the current position, the decoder
+	reproduces that since it copies byte by byte.
+
+	The finder can work on a segment of the data: the HISTORY_SIZE bytes before the start of the segment
+	are added to the chains first, so matches can reference them just like in a single pass.
+*/
+const uint32_t HASH_BITS = 15;
+const uint32_t HASH_SIZE = 1 << HASH_BITS;
+const uint32_t NO_POSITION = 0xffffffff;
+
+struct match_finder_t {
+	const uint8_t *data;
+	uint32_t start; // first position to encode
+	uint32_t size; // end of the segment to encode
+	uint32_t max_chain_depth;
+	uint32_t next_insert; // first position not yet added to the chains
+	uint32_t head[HASH_SIZE];
+	uint32_t prev[HISTORY_SIZE];
+};
+
+
+inline uint32_t min(uint32_t a, uint32_t b) {
 	return a < b ? a : b;
 }
 
-uint8_t *compress(uint8_t *data, uint32_t size, uint32_t &compressed_data_size) {
-	uint8_t history[HISTORY_SIZE];
-	uint8_t curr_mask = 0x80;
+
+inline uint32_t hash3(const uint8_t *data) {
+	uint32_t value = data[0] | (data[1] << 8) | (data[2] << 16);
+	return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+
+void match_finder_init(match_finder_t *finder, const uint8_t *data, uint32_t start, uint32_t end, uint32_t max_chain_depth) {
+	finder->data = data;
+	finder->start = start;
+	finder->size = end;
+	finder->max_chain_depth = max_chain_depth ? max_chain_depth : HISTORY_SIZE;
+	finder->next_insert = start > HISTORY_SIZE ? start - HISTORY_SIZE : 0;
+	memset(finder->head, 0xff, sizeof(finder->head));
+}
+
+
+// Adds all positions before pos to the hash chains
+inline void match_finder_insert(match_finder_t *finder, uint32_t pos) {
+	const uint32_t last_pos = min(pos, finder->size - min(finder->size, MIN_MATCH_LENGTH - 1));
+	for (; finder->next_insert < last_pos; finder->next_insert++) {
+		uint32_t hash = hash3(finder->data + finder->next_insert);
+		finder->prev[finder->next_insert % HISTORY_SIZE] = finder->head[hash];
+		finder->head[hash] = finder->next_insert;
+	}
+}
+
+
+// Moves past positions without adding them to the hash chains
+inline void match_finder_skip(match_finder_t *finder, uint32_t pos) {
+	if (finder->next_insert < pos) {
+		finder->next_insert = pos;
+	}
+}
+
+
+// Finds the longest match for the data at pos. Returns its length, or 0 if there's no match.
+// Positions must be searched in increasing order.
+uint32_t match_finder_find(match_finder_t *finder, uint32_t pos, uint32_t &match_pos) {
+	match_finder_insert(finder, pos);
+
+	const uint8_t *data = finder->data;
+	const uint8_t *curr = data + pos;
+	const uint32_t max_length = min(MAX_MATCH_LENGTH, finder->size - pos);
+	if (max_length < MIN_MATCH_LENGTH) {
+		return 0;
+	}
+	const uint32_t min_pos = pos > HISTORY_SIZE ? pos - HISTORY_SIZE : 0;
+
+	uint32_t longest_match_length = 0;
+	uint32_t candidate = finder->head[hash3(curr)];
+	for (uint32_t depth = finder->max_chain_depth; depth > 0; depth--) {
+		if (candidate == NO_POSITION || candidate < min_pos) {
+			break;
+		}
+		// we cannot store this index since it would be confused with the data terminator
+		// also skip early if the candidate can't beat the current best match
+		if (candidate % HISTORY_SIZE != HISTORY_SIZE - 1 && data[candidate + longest_match_length] == curr[longest_match_length]) {
+			uint32_t length = 0;
+			while (length < max_length && data[candidate + length] == curr[length]) {
+				length++;
+			}
+			// on ties keep the nearest match
+			if (length > longest_match_length) {
+				longest_match_length = length;
+				match_pos = candidate;
+				// if best match is max length, we're done
+				if (length == max_length) {
+					break;
+				}
+			}
+		}
+		candidate = finder->prev[candidate % HISTORY_SIZE];
+	}
+
+	return longest_match_length >= MIN_MATCH_LENGTH ? longest_match_length : 0;
+}
+
+
+// Bits after curr_mask in the current byte are always zero, bytes after it are not initialized
+struct lzss_writer_t {
+	uint8_t *buffer;
+	uint32_t curr_byte;
+	uint8_t curr_mask;
+};
+
+
+inline lzss_writer_t lzss_writer(uint8_t *buffer) {
+	buffer[0] = 0;
+	return {buffer, 0, 0x80};
+}
+
+
+inline void write_literal(lzss_writer_t &writer, uint8_t value) {
+	write_bits(writer.buffer, writer.curr_byte, writer.curr_mask, 1, 1);
+	write_bits(writer.buffer, writer.curr_byte, writer.curr_mask, value, 8);
+}
+
+
+inline void write_match(lzss_writer_t &writer, uint32_t match_pos, uint32_t match_length) {
+	write_bits(writer.buffer, writer.curr_byte, writer.curr_mask, 0, 1);
+	write_bits(writer.buffer, writer.curr_byte, writer.curr_mask, match_pos % HISTORY_SIZE + 1, HISTORY_INDEX_BITS);
+	write_bits(writer.buffer, writer.curr_byte, writer.curr_mask, match_length - MIN_MATCH_LENGTH, MATCH_LENGTH_BITS);
+}
+
+
+// Takes the longest match at each position
+void parse_greedy(match_finder_t *finder, lzss_writer_t &writer) {
+	const uint8_t *data = finder->data;
+	uint32_t curr_src_byte = finder->start;
+	while (curr_src_byte < finder->size) {
+		uint32_t match_pos;
+		uint32_t match_length = match_finder_find(finder, curr_src_byte, match_pos);
+		if (match_length == 0) {
+			write_literal(writer, data[curr_src_byte]);
+			curr_src_byte++;
+		} else {
+			write_match(writer, match_pos, match_length);
+			curr_src_byte += match_length;
+		}
+	}
+}
+
+
+// Before taking a match, checks whether the next position has a longer one.
+// If so, emits a literal instead and considers the next match.
+// Since a literal costs half as much as a match, it's only worth it if the next match is a few bytes longer.
+const uint32_t LAZY_MIN_GAIN = 3;
+
+void parse_lazy(match_finder_t *finder, lzss_writer_t &writer) {
+	const uint8_t *data = finder->data;
+	uint32_t curr_src_byte = finder->start;
+	uint32_t match_pos;
+	uint32_t match_length = match_finder_find(finder, curr_src_byte, match_pos);
+	while (curr_src_byte < finder->size) {
+		if (match_length == 0) {
+			write_literal(writer, data[curr_src_byte]);
+			curr_src_byte++;
+			match_length = match_finder_find(finder, curr_src_byte, match_pos);
+			continue;
+		}
+
+		uint32_t next_match_pos = 0;
+		uint32_t next_match_length = 0;
+		if (match_length < MAX_MATCH_LENGTH) {
+			next_match_length = match_finder_find(finder, curr_src_byte + 1, next_match_pos);
+		}
+		if (next_match_length >= match_length + LAZY_MIN_GAIN) {
+			write_literal(writer, data[curr_src_byte]);
+			curr_src_byte++;
+			match_pos = next_match_pos;
+			match_length = next_match_length;
+		} else {
+			write_match(writer, match_pos, match_length);
+			curr_src_byte += match_length;
+			match_length = match_finder_find(finder, curr_src_byte, match_pos);
+		}
+	}
+}
+
+
+/*
+	Finds the parse with the fewest bits.
+
+	Literals always cost 9 bits and matches 18 bits regardless of their index and length, and any prefix
+	of a match is also a match. So only the longest match at each position is needed, and the cost of
+	encoding data[i...] is the minimum of:
+	- 9 + cost(i + 1)
+	- 18 + cost(i + length), for every length in [MIN_MATCH_LENGTH, longest match at i]
+*/
+void parse_optimal(match_finder_t *finder, lzss_writer_t &writer) {
+	// arrays are indexed relative to the start of the segment
+	const uint8_t *data = finder->data + finder->start;
+	const uint32_t size = finder->size - finder->start;
+	static thread_local grow_buffer_t buffer;
+	uint32_t *match_pos = (uint32_t *)buffer.reserve((size_t)size * 9 + 4);
+	uint32_t *cost = match_pos + size;
+	uint8_t *match_length = (uint8_t *)(cost + size + 1);
+
+	for (uint32_t i = 0; i < size; i++) {
+		match_length[i] = match_finder_find(finder, finder->start + i, match_pos[i]);
+	}
+
+	// find the cheapest choice at each position, from the end
+	// match_length is overwritten with the chosen length (0 for a literal)
+	cost[size] = 0;
+	for (uint32_t i = size; i-- > 0;) {
+		uint32_t best_cost = 9 + cost[i + 1];
+		uint32_t best_length = 0;
+		for (uint32_t length = MIN_MATCH_LENGTH; length <= match_length[i]; length++) {
+			// on ties prefer longer matches, they decode faster
+			if (18 + cost[i + length] <= best_cost) {
+				best_cost = 18 + cost[i + length];
+				best_length = length;
+			}
+		}
+		cost[i] = best_cost;
+		match_length[i] = best_length;
+	}
+
 	uint32_t curr_src_byte = 0;
-	uint32_t curr_dst_byte = 0;
+	while (curr_src_byte < size) {
+		if (match_length[curr_src_byte] == 0) {
+			write_literal(writer, data[curr_src_byte]);
+			curr_src_byte++;
+		} else {
+			write_match(writer, match_pos[curr_src_byte], match_length[curr_src_byte]);
+			curr_src_byte += match_length[curr_src_byte];
+		}
+	}
+}
 
-	// allocate memory for worst case scenario (none of the bytes is compressed)
-	uint32_t max_compressed_size = (uint32_t)(size * 1.125) + 2;
-	uint8_t *compressed_data = new uint8_t[max_compressed_size];
-	memset(compressed_data, 0, max_compressed_size);
-	
+
+/*
+	Record-aware parsing, for data made of fixed-size records that often repeat (e.g. per-frame inputs).
+
+	Inside record regions, the best match is very likely a whole number of records back, so those distances
+	are probed first. The hash chains are only searched if none of them gives a max length match, and the
+	positions covered by record matches are not added to the chains, which makes this mode very fast.
+	Outside record regions, this is the same as greedy parsing.
+*/
+const uint32_t RECORD_DISTANCES[] = {1, 2, 3, 4, 5, 6, 10, 15, 20, 30, 60}; // in records, must be increasing
+const uint32_t RECORDS_MAX_CHAIN_DEPTH = 128;
+
+void parse_records(match_finder_t *finder, lzss_writer_t &writer, const compression_record_region_t *regions, uint32_t num_regions) {
+	const uint8_t *data = finder->data;
+	const uint32_t size = finder->size;
+	uint32_t curr_src_byte = finder->start;
+	uint32_t curr_region = 0;
 	while (curr_src_byte < size) {
-		// find longest match in history
-		uint32_t longest_match_index = 0;
-		uint32_t longest_match_length = 0;
-		const int curr_history_size = min(curr_src_byte, HISTORY_SIZE);
-		const int start_index = curr_src_byte - 1;
-		for (int curr_index = start_index; curr_index > start_index - curr_history_size; curr_index--) {
-			// we cannot store this index since it would be confused with the data terminator
-			if (curr_index % HISTORY_SIZE == HISTORY_SIZE - 1) {
-				continue;
+		while (curr_region < num_regions && regions[curr_region].offset + regions[curr_region].size <= curr_src_byte) {
+			curr_region++;
+		}
+
+		uint32_t match_pos = 0;
+		uint32_t match_length = 0;
+		const uint32_t max_length = min(MAX_MATCH_LENGTH, size - curr_src_byte);
+		if (curr_region < num_regions && regions[curr_region].offset <= curr_src_byte && max_length >= MIN_MATCH_LENGTH) {
+			for (uint32_t num_records : RECORD_DISTANCES) {
+				uint32_t distance = num_records * regions[curr_region].record_size;
+				if (distance > curr_src_byte || distance > HISTORY_SIZE) {
+					break;
+				}
+				uint32_t candidate = curr_src_byte - distance;
+				// we cannot store this index since it would be confused with the data terminator
+				if (candidate % HISTORY_SIZE == HISTORY_SIZE - 1) {
+					continue;
+				}
+				uint32_t length = 0;
+				while (length < max_length && data[candidate + length] == data[curr_src_byte + length]) {
+					length++;
+				}
+				if (length > match_length) {
+					match_length = length;
+					match_pos = candidate;
+					if (length == max_length) {
+						break;
+					}
+				}
 			}
-			// try to match as many bytes as possible from current index
-			uint32_t curr_offset = 0;
-			while (
-				// compare history data with source data
-				// if we go past the newest history index, read from source data instead
-				// (history will be updated at the end after the best match is found)
-				(
-					curr_index + curr_offset < curr_src_byte ?
-					history[(curr_index + curr_offset) % HISTORY_SIZE] :
-					data[curr_index + curr_offset]
-				) == data[curr_src_byte + curr_offset]
-				// don't go over max match length
-				&& curr_offset < MAX_MATCH_LENGTH
-				// don't go over data buffer
-				&& curr_src_byte + curr_offset < size
-			) {
-				curr_offset++;
-			}
-			// update best match
-			if (curr_offset > longest_match_length) {
-				longest_match_length = curr_offset;
-				longest_match_index = curr_index % HISTORY_SIZE;
-			}
-			// if best match is max length, we're done
-			if (longest_match_length == MAX_MATCH_LENGTH) {
-				break;
+
+			if (match_length == max_length) {
+				write_match(writer, match_pos, match_length);
+				curr_src_byte += match_length;
+				match_finder_skip(finder, curr_src_byte);
+				continue;
 			}
 		}
 
-		if (longest_match_length < 3) {
-			// do not compress
-			write_bits(compressed_data, curr_dst_byte, curr_mask, 1, 1);
-			write_bits(compressed_data, curr_dst_byte, curr_mask, data[curr_src_byte], 8);
-			history[curr_src_byte % HISTORY_SIZE] = data[curr_src_byte];
+		uint32_t chain_match_pos;
+		uint32_t chain_match_length = match_finder_find(finder, curr_src_byte, chain_match_pos);
+		if (chain_match_length > match_length) {
+			match_length = chain_match_length;
+			match_pos = chain_match_pos;
+		}
+
+		if (match_length < MIN_MATCH_LENGTH) {
+			write_literal(writer, data[curr_src_byte]);
 			curr_src_byte++;
 		} else {
-			// compress
-			write_bits(compressed_data, curr_dst_byte, curr_mask, 0, 1);
-			write_bits(compressed_data, curr_dst_byte, curr_mask, longest_match_index + 1, HISTORY_INDEX_BITS);
-			write_bits(compressed_data, curr_dst_byte, curr_mask, longest_match_length - MIN_MATCH_LENGTH, MATCH_LENGTH_BITS);
-			for (uint32_t i = 0; i < longest_match_length; i++) {
-				history[curr_src_byte % HISTORY_SIZE] = data[curr_src_byte];
-				curr_src_byte++;
-			}
+			write_match(writer, match_pos, match_length);
+			curr_src_byte += match_length;
 		}
 	}
+}
+
+
+// Encodes data[start...end) as a sequence of tokens, without terminator
+void compress_segment(const uint8_t *data, uint32_t start, uint32_t end, lzss_writer_t &writer, const compression_options_t &options) {
+	static thread_local grow_buffer_t finder_buffer;
+	match_finder_t *finder = (match_finder_t *)finder_buffer.reserve(sizeof(match_finder_t));
+	uint32_t max_chain_depth = options.max_chain_depth;
+	if (options.level == COMPRESSION_RECORDS && max_chain_depth == 0) {
+		max_chain_depth = RECORDS_MAX_CHAIN_DEPTH;
+	}
+	match_finder_init(finder, data, start, end, max_chain_depth);
+
+	switch (options.level) {
+		case COMPRESSION_GREEDY:
+			parse_greedy(finder, writer);
+			break;
+		case COMPRESSION_LAZY:
+			parse_lazy(finder, writer);
+			break;
+		case COMPRESSION_RECORDS:
+			parse_records(finder, writer, options.record_regions, options.num_record_regions);
+			break;
+		default:
+			parse_optimal(finder, writer);
+			break;
+	}
+}
+
+
+// Amount of bits written so far
+inline uint64_t writer_num_bits(const lzss_writer_t &writer) {
+	uint32_t curr_bit = 0;
+	for (uint8_t mask = 0x80; mask != writer.curr_mask; mask >>= 1) {
+		curr_bit++;
+	}
+	return (uint64_t)writer.curr_byte * 8 + curr_bit;
+}
+
+
+// Appends the first num_bits bits of a buffer
+void write_bit_buffer(lzss_writer_t &writer, const uint8_t *buffer, uint64_t num_bits) {
+	uint64_t num_bytes = num_bits / 8;
+	if (writer.curr_mask == 0x80) {
+		memcpy(writer.buffer + writer.curr_byte, buffer, num_bytes);
+		writer.curr_byte += num_bytes;
+		writer.buffer[writer.curr_byte] = 0;
+	} else {
+		// every byte is split between the current byte and the next one
+		uint32_t shift = writer_num_bits(writer) % 8;
+		for (uint64_t i = 0; i < num_bytes; i++) {
+			writer.buffer[writer.curr_byte] |= buffer[i] >> shift;
+			writer.curr_byte++;
+			writer.buffer[writer.curr_byte] = buffer[i] << (8 - shift);
+		}
+	}
+	if (num_bits % 8) {
+		write_bits(writer.buffer, writer.curr_byte, writer.curr_mask, buffer[num_bytes] >> (8 - num_bits % 8), num_bits % 8);
+	}
+}
+
+
+/*
+	Multithreaded compression:
+
+	The data is split into segments that are compressed in parallel. The match finder of each segment is
+	primed with the history before it, so matches can cross segment boundaries backwards and the result is
+	a single valid bitstream. Tokens can't span two segments, which costs a few bytes per segment.
+	The bitstreams of all segments are then concatenated bit by bit.
+*/
+const uint32_t MIN_SEGMENT_SIZE = 0x10000;
+
+// Max size of the compressed data (every byte as a literal, plus the terminator)
+uint32_t compress_bound(uint32_t size) {
+	return (uint32_t)(((uint64_t)size * 9 + 7) / 8) + 2;
+}
+
+
+// Compresses into a buffer of at least compress_bound(size) bytes, returns the compressed size
+uint32_t compress_to(uint8_t *data, uint32_t size, uint8_t *compressed_data, const compression_options_t &options) {
+	lzss_writer_t writer = lzss_writer(compressed_data);
+
+	uint32_t num_threads = options.num_threads ? options.num_threads : std::thread::hardware_concurrency();
+	uint32_t num_segments = min(num_threads, size / MIN_SEGMENT_SIZE);
+
+	if (num_segments <= 1) {
+		compress_segment(data, 0, size, writer, options);
+	} else {
+		// the first segment is written straight to the output, the others are appended once done
+		uint32_t segment_size = size / num_segments;
+		lzss_writer_t *segment_writers = new lzss_writer_t[num_segments];
+		std::thread *threads = new std::thread[num_segments];
+		for (uint32_t i = 0; i < num_segments; i++) {
+			uint32_t start = i * segment_size;
+			uint32_t end = i == num_segments - 1 ? size : start + segment_size;
+			segment_writers[i] = i == 0 ? writer : lzss_writer(new uint8_t[compress_bound(end - start)]);
+			threads[i] = std::thread(compress_segment, data, start, end, std::ref(segment_writers[i]), std::cref(options));
+		}
+		threads[0].join();
+		writer = segment_writers[0];
+		for (uint32_t i = 1; i < num_segments; i++) {
+			threads[i].join();
+			write_bit_buffer(writer, segment_writers[i].buffer, writer_num_bits(segment_writers[i]));
+			delete[] segment_writers[i].buffer;
+		}
+		delete[] threads;
+		delete[] segment_writers;
+	}
 
 	// write data terminator (technically not needed, but just to be safe)
-	write_bits(compressed_data, curr_dst_byte, curr_mask, 0, 2);
+	write_bits(compressed_data, writer.curr_byte, writer.curr_mask, 0, 2);
 	
-	compressed_data_size = curr_dst_byte + 1;
+	return writer.curr_byte + 1;
+}
+
 
+uint8_t *compress(uint8_t *data, uint32_t size, uint32_t &compressed_data_size, const compression_options_t &options) {
+	uint8_t *compressed_data = new uint8_t[compress_bound(size)];
+	compressed_data_size = compress_to(data, size, compressed_data, options);
 	return compressed_data;
 }
+
+
+// Writes a match that may no longer be valid: bytes that don't match are written as literals,
+// and the runs of bytes that still match are written as shorter matches
+void write_checked_match(lzss_writer_t &writer, const uint8_t *data, uint32_t pos, uint32_t distance, uint32_t length) {
+	uint32_t run_start = 0;
+	for (uint32_t i = 0; i <= length; i++) {
+		if (i < length && data[pos + i] == (pos + i >= distance ? data[pos + i - distance] : 0)) {
+			continue;
+		}
+		// the index of the run's source wraps around like in the original match
+		uint32_t run_length = i - run_start;
+		uint32_t run_source = pos + run_start - distance;
+		if (run_length >= MIN_MATCH_LENGTH && run_source % HISTORY_SIZE != HISTORY_SIZE - 1) {
+			write_match(writer, run_source, run_length);
+		} else {
+			for (uint32_t j = run_start; j < i; j++) {
+				write_literal(writer, data[pos + j]);
+			}
+		}
+		if (i < length) {
+			write_literal(writer, data[pos + i]);
+		}
+		run_start = i + 1;
+	}
+}
+
+
+/*
+	Re-encodes data that was modified after decompressing it, reusing the tokens of its original compressed
+	data. This is much faster than compressing again, and keeps the original size unless some matches break.
+
+	Literals take the new value of their byte. Matches are checked against the new data, and the bytes that
+	no longer match are written as literals (see write_checked_match). Since every token is checked against
+	the final data, matches that copy from a modified byte are caught too. Everything after the terminator is
+	copied as is, so unmodified data gives back the original compressed data.
+
+	If the compressed data doesn't decompress to size bytes, the data is compressed again instead.
+*/
+// Max size of the recompressed data (a match can turn into literals, and the padding is kept)
+uint32_t recompress_bound(uint32_t compressed_size, uint32_t size) {
+	return compress_bound(size) + compressed_size;
+}
+
+
+// Recompresses into a buffer of at least recompress_bound(compressed_size, size) bytes, returns the recompressed size
+uint32_t recompress_to(const uint8_t *compressed_data, uint32_t compressed_size, uint8_t *data, uint32_t size, uint8_t *recompressed_data) {
+	const uint64_t end_bit = (uint64_t)compressed_size * 8;
+	lzss_writer_t writer = lzss_writer(recompressed_data);
+
+	uint64_t curr_bit = 0;
+	uint32_t curr_src_byte = 0;
+	bool valid = true;
+	while (curr_bit < end_bit) {
+		uint64_t bits = peek_bits_checked(compressed_data, compressed_size, curr_bit);
+		if (bits >> 63) {
+			if (curr_src_byte >= size) {
+				valid = false;
+				break;
+			}
+			write_literal(writer, data[curr_src_byte]);
+			curr_src_byte++;
+			curr_bit += 9;
+			continue;
+		}
+
+		uint32_t history_index = (bits >> 50) & (HISTORY_SIZE - 1);
+		if (history_index == 0) {
+			break;
+		}
+		uint32_t data_length = ((bits >> 46) & ((1 << MATCH_LENGTH_BITS) - 1)) + MIN_MATCH_LENGTH;
+		uint32_t distance = ((curr_src_byte - history_index) % HISTORY_SIZE) + 1;
+		if (data_length > size - curr_src_byte) {
+			valid = false;
+			break;
+		}
+		write_checked_match(writer, data, curr_src_byte, distance, data_length);
+		curr_src_byte += data_length;
+		curr_bit += 1 + HISTORY_INDEX_BITS + MATCH_LENGTH_BITS;
+	}
+
+	if (!valid || curr_src_byte != size) {
+		return compress_to(data, size, recompressed_data);
+	}
+
+	// copy the terminator and padding
+	for (; curr_bit < end_bit; curr_bit += 8) {
+		uint32_t num_bits = end_bit - curr_bit < 8 ? end_bit - curr_bit : 8;
+		write_bits(writer.buffer, writer.curr_byte, writer.curr_mask, peek_bits_checked(compressed_data, compressed_size, curr_bit) >> (64 - num_bits), num_bits);
+	}
+
+	return (writer_num_bits(writer) + 7) / 8;
+}
+
+
+uint8_t *recompress(const uint8_t *compressed_data, uint32_t compressed_size, uint8_t *data, uint32_t size, uint32_t &recompressed_size) {
+	uint8_t *recompressed_data = new uint8_t[recompress_bound(compressed_size, size)];
+	recompressed_size = recompress_to(compressed_data, compressed_size, data, size, recompressed_data);
+	return recompressed_data;
+}
+
+
+const char *compression_level_name(compression_level_t level) {
+	switch (level) {
+		case COMPRESSION_GREEDY:
+			return "greedy";
+		case COMPRESSION_LAZY:
+			return "lazy";
+		case COMPRESSION_OPTIMAL:
+			return "optimal";
+		case COMPRESSION_RECORDS:
+			return "records";
+		default:
+			return NULL;
+	}
+}
+
+
+bool parse_compression_level(const char *name, compression_level_t &level) {
+	for (int i = 0; i < NUM_COMPRESSION_LEVELS; i++) {
+		if (!strcmp(name, compression_level_name((compression_level_t)i))) {
+			level = (compression_level_t)i;
+			return true;
+		}
+	}
+	return false;
+}
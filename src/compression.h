@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 // ZUN's LZSS parameters
 const uint32_t HISTORY_INDEX_BITS = 13;
@@ -9,6 +10,84 @@ const uint32_t MATCH_LENGTH_BITS = 4;
 const uint32_t MIN_MATCH_LENGTH = 3;
 const uint32_t MAX_MATCH_LENGTH = MIN_MATCH_LENGTH + (1 << MATCH_LENGTH_BITS) - 1;
 
+// Max amount of candidates the encoder checks per position (0 = whole history)
+const uint32_t DEFAULT_MAX_CHAIN_DEPTH = 0;
 
-uint32_t decompress(uint8_t *compressed_data, uint8_t *decompressed_data, uint32_t length);
-uint8_t *compress(uint8_t *data, uint32_t size, uint32_t &compressed_data_size);
+
+enum compression_level_t {
+	COMPRESSION_GREEDY, // longest match at each position, fastest
+	COMPRESSION_LAZY, // defers a match when the next position has a longer one
+	COMPRESSION_OPTIMAL, // fewest total bits, slowest
+	COMPRESSION_RECORDS, // probes whole-record distances first in record regions, fastest
+	NUM_COMPRESSION_LEVELS
+};
+
+// Part of the data made of fixed-size records, e.g. per-frame inputs
+struct compression_record_region_t {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t record_size;
+};
+
+struct compression_options_t {
+	compression_level_t level = COMPRESSION_GREEDY;
+	uint32_t max_chain_depth = DEFAULT_MAX_CHAIN_DEPTH;
+	// used by COMPRESSION_RECORDS, must be sorted by offset and not overlap
+	const compression_record_region_t *record_regions = NULL;
+	uint32_t num_record_regions = 0;
+	// amount of threads to compress with (0 = one per CPU core), only used for big enough data
+	uint32_t num_threads = 1;
+};
+
+
+// Returned by decompress if the data doesn't fit in the output buffer
+const uint32_t DECOMPRESS_OVERFLOW = 0xffffffff;
+
+
+// Amount of each kind of token in some compressed data
+struct compression_token_counts_t {
+	uint64_t literals;
+	uint64_t matches;
+	uint64_t match_bytes; // total length of the matches
+};
+
+
+// Streaming decoder, gets the decoded data in order through a callback that returns false to stop decoding
+typedef bool (*decompress_output_t)(const uint8_t *data, uint32_t size, void *user_data);
+
+enum decompress_status_t {
+	DECOMPRESS_MORE, // waiting for more compressed data
+	DECOMPRESS_DONE, // found the data terminator or reached the end of the last piece (see terminated)
+	DECOMPRESS_ERROR, // output exceeded the capacity
+	DECOMPRESS_STOPPED // the output callback returned false
+};
+
+struct decompress_stream_t {
+	uint8_t history[HISTORY_SIZE];
+	uint64_t bits;
+	uint32_t num_bits;
+	uint32_t curr_dst_byte;
+	uint32_t flushed_byte;
+	uint32_t capacity;
+	decompress_output_t output;
+	void *user_data;
+	decompress_status_t status;
+	bool terminated; // found the data terminator, the data can also be done by reaching the end of the last piece
+};
+
+
+uint32_t decompress(const uint8_t *compressed_data, uint8_t *decompressed_data, uint32_t length, uint32_t capacity, bool *terminated = NULL);
+void count_tokens(const uint8_t *compressed_data, uint32_t length, compression_token_counts_t &counts);
+void decompress_stream_init(decompress_stream_t *stream, uint32_t capacity, decompress_output_t output, void *user_data);
+decompress_status_t decompress_stream_push(decompress_stream_t *stream, const uint8_t *data, uint32_t size, bool last);
+uint8_t *compress(uint8_t *data, uint32_t size, uint32_t &compressed_data_size, const compression_options_t &options = compression_options_t());
+uint8_t *recompress(const uint8_t *compressed_data, uint32_t compressed_size, uint8_t *data, uint32_t size, uint32_t &recompressed_size);
+
+// Same as compress and recompress, but write to a caller buffer of at least the bound's size
+uint32_t compress_bound(uint32_t size);
+uint32_t compress_to(uint8_t *data, uint32_t size, uint8_t *compressed_data, const compression_options_t &options = compression_options_t());
+uint32_t recompress_bound(uint32_t compressed_size, uint32_t size);
+uint32_t recompress_to(const uint8_t *compressed_data, uint32_t compressed_size, uint8_t *data, uint32_t size, uint8_t *recompressed_data);
+
+const char *compression_level_name(compression_level_t level);
+bool parse_compression_level(const char *name, compression_level_t &level);
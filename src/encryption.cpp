@@ -1,6 +1,9 @@
 #include "encryption.h"
 
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /*
@@ -109,3 +112,174 @@ void encrypt(uint8_t *data, int length, int block_size, uint8_t base_mask, uint8
 	}
 	delete[] decoded_data;
 }
+
+
+/*
+	Cipher plans:
+
+	Every layer only moves bytes within its blocks, and the mask of each byte only depends on its position
+	modulo 256. So when all block sizes divide the biggest one, which is a multiple of 256, every full block
+	of the biggest size goes through exactly the same permutation and masks, no matter how many layers are
+	applied. A plan precomputes them once, as a source index and a combined mask for each byte of the result,
+	so all layers are applied in a single pass.
+
+	Only the end of the data is different (shorter last blocks, ignored bytes), so it gets its own tables,
+	computed for the last one or two blocks whenever the data length changes.
+*/
+
+// Computes where each processed byte goes and its mask, following the same steps as decrypt
+// Returns the amount of processed bytes
+int cipher_layer_map(int length, int block_size, uint8_t base_mask, uint8_t mask_inc, uint16_t *positions, uint8_t *masks) {
+	int bytes_left = length;
+	if ((bytes_left % block_size) < (block_size / 4)) {
+		bytes_left -= bytes_left % block_size;
+	}
+	bytes_left -= length & 1;
+
+	int curr_byte = 0;
+	uint8_t curr_mask = base_mask;
+	while (bytes_left) {
+		if (bytes_left < block_size) {
+			block_size = bytes_left;
+		}
+		int tp1 = curr_byte + block_size - 1;
+		int tp2 = curr_byte + block_size - 2;
+		int hf = (block_size + (block_size & 0x1)) / 2;
+		for (int i = 0; i < hf; i++) {
+			positions[curr_byte] = tp1;
+			masks[curr_byte] = curr_mask;
+			curr_mask += mask_inc;
+			tp1 -= 2;
+			curr_byte++;
+		}
+		hf = block_size / 2;
+		for (int i = 0; i < hf; i++) {
+			positions[curr_byte] = tp2;
+			masks[curr_byte] = curr_mask;
+			curr_mask += mask_inc;
+			tp2 -= 2;
+			curr_byte++;
+		}
+		bytes_left -= block_size;
+	}
+	return curr_byte;
+}
+
+
+// Computes the source index and mask of each byte of the result of applying all layers to length bytes
+void cipher_plan_build_tables(const cipher_plan_t *plan, int length, uint16_t *sources, uint8_t *masks) {
+	uint16_t positions[CIPHER_PLAN_MAX_BLOCK_SIZE * 2];
+	uint8_t layer_masks[CIPHER_PLAN_MAX_BLOCK_SIZE * 2];
+	uint16_t prev_sources[CIPHER_PLAN_MAX_BLOCK_SIZE * 2];
+	uint8_t prev_masks[CIPHER_PLAN_MAX_BLOCK_SIZE * 2];
+
+	for (int i = 0; i < length; i++) {
+		sources[i] = i;
+		masks[i] = 0;
+	}
+	for (int i = 0; i < plan->num_layers; i++) {
+		const cipher_layer_t &layer = plan->layers[i];
+		int num_bytes = cipher_layer_map(length, layer.block_size, layer.base_mask, layer.mask_inc, positions, layer_masks);
+		memcpy(prev_sources, sources, length * sizeof(*sources));
+		memcpy(prev_masks, masks, length);
+		for (int j = 0; j < num_bytes; j++) {
+			if (plan->encrypting) {
+				// byte j comes from byte positions[j]
+				sources[j] = prev_sources[positions[j]];
+				masks[j] = prev_masks[positions[j]] ^ layer_masks[j];
+			} else {
+				// byte j goes to byte positions[j]
+				sources[positions[j]] = prev_sources[j];
+				masks[positions[j]] = prev_masks[j] ^ layer_masks[j];
+			}
+		}
+	}
+}
+
+
+void cipher_plan_init(cipher_plan_t *plan, const cipher_layer_t *layers, int num_layers, bool encrypting) {
+	plan->num_layers = num_layers;
+	plan->block_size = 0;
+	for (int i = 0; i < num_layers; i++) {
+		plan->layers[i] = layers[i];
+		if (layers[i].block_size > plan->block_size) {
+			plan->block_size = layers[i].block_size;
+		}
+	}
+	plan->encrypting = encrypting;
+	cipher_plan_build_tables(plan, plan->block_size, plan->block_sources, plan->block_masks);
+	plan->length = 0;
+	plan->tail_start = 0;
+	plan->tail_length = 0;
+}
+
+
+inline void xor_bytes(uint8_t *data, const uint8_t *masks, int length) {
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= length; i += 16) {
+		__m128i value = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i mask = _mm_loadu_si128((const __m128i *)(masks + i));
+		_mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(value, mask));
+	}
+#endif
+	for (; i < length; i++) {
+		data[i] ^= masks[i];
+	}
+}
+
+
+// Permutes a block and applies its masks, src and dst can be the same
+inline void cipher_apply_tables(const uint8_t *src, uint8_t *dst, uint32_t length, const uint16_t *sources, const uint8_t *masks) {
+	uint8_t block[CIPHER_PLAN_MAX_BLOCK_SIZE * 2];
+	if (src == dst) {
+		memcpy(block, src, length);
+		src = block;
+	}
+	for (uint32_t i = 0; i < length; i++) {
+		dst[i] = src[sources[i]];
+	}
+	xor_bytes(dst, masks, length);
+}
+
+
+// Prepares the tables for the end of the data, only does something if the length changed
+void cipher_plan_set_length(cipher_plan_t *plan, uint32_t length) {
+	if (length == plan->length) {
+		return;
+	}
+	// the tail starts one block before the last full block, so it includes all blocks affected by the length
+	uint32_t num_blocks = length / plan->block_size;
+	plan->length = length;
+	plan->tail_start = num_blocks >= 2 ? (num_blocks - 1) * plan->block_size : 0;
+	plan->tail_length = length - plan->tail_start;
+	cipher_plan_build_tables(plan, plan->tail_length, plan->tail_sources, plan->tail_masks);
+}
+
+
+// Applies the plan to one of the full blocks before tail_start
+void cipher_plan_apply_block(const cipher_plan_t *plan, uint8_t *block) {
+	cipher_apply_tables(block, block, plan->block_size, plan->block_sources, plan->block_masks);
+}
+
+
+// Applies the plan to the last tail_length bytes of the data
+void cipher_plan_apply_tail(const cipher_plan_t *plan, uint8_t *tail) {
+	cipher_apply_tables(tail, tail, plan->tail_length, plan->tail_sources, plan->tail_masks);
+}
+
+
+// Same as cipher_plan_apply, but leaves the input untouched and writes the result to another buffer
+void cipher_plan_apply_to(cipher_plan_t *plan, const uint8_t *src, uint8_t *dst, uint32_t length) {
+	cipher_plan_set_length(plan, length);
+	for (uint32_t pos = 0; pos < plan->tail_start; pos += plan->block_size) {
+		cipher_apply_tables(src + pos, dst + pos, plan->block_size, plan->block_sources, plan->block_masks);
+	}
+	cipher_apply_tables(src + plan->tail_start, dst + plan->tail_start, plan->tail_length, plan->tail_sources, plan->tail_masks);
+}
+
+
+// Same as calling decrypt or encrypt with each layer in order
+void cipher_plan_apply(cipher_plan_t *plan, uint8_t *data, uint32_t length) {
+	cipher_plan_apply_to(plan, data, data, length);
+}
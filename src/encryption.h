@@ -4,3 +4,41 @@
 
 void decrypt(uint8_t *data, int length, int block_size, uint8_t base_mask, uint8_t mask_inc);
 void encrypt(uint8_t *data, int length, int block_size, uint8_t base_mask, uint8_t mask_inc);
+
+
+// Parameters of one call to decrypt or encrypt
+struct cipher_layer_t {
+	int block_size;
+	uint8_t base_mask;
+	uint8_t mask_inc;
+};
+
+// Block sizes must divide the biggest one, which must be a multiple of 256 and at most this
+const int CIPHER_PLAN_MAX_BLOCK_SIZE = 0x800;
+const int CIPHER_PLAN_MAX_LAYERS = 4;
+
+struct cipher_plan_t {
+	cipher_layer_t layers[CIPHER_PLAN_MAX_LAYERS];
+	int num_layers;
+	int block_size;
+	bool encrypting;
+	// tables for every full block
+	uint16_t block_sources[CIPHER_PLAN_MAX_BLOCK_SIZE];
+	uint8_t block_masks[CIPHER_PLAN_MAX_BLOCK_SIZE];
+	// tables for the end of the data, depend on its length
+	uint32_t length;
+	uint32_t tail_start;
+	uint32_t tail_length;
+	uint16_t tail_sources[CIPHER_PLAN_MAX_BLOCK_SIZE * 2];
+	uint8_t tail_masks[CIPHER_PLAN_MAX_BLOCK_SIZE * 2];
+};
+
+void cipher_plan_init(cipher_plan_t *plan, const cipher_layer_t *layers, int num_layers, bool encrypting);
+void cipher_plan_apply(cipher_plan_t *plan, uint8_t *data, uint32_t length);
+void cipher_plan_apply_to(cipher_plan_t *plan, const uint8_t *src, uint8_t *dst, uint32_t length);
+
+// To process the data in pieces: set the length, then apply the plan to each full block before
+// tail_start and to the tail
+void cipher_plan_set_length(cipher_plan_t *plan, uint32_t length);
+void cipher_plan_apply_block(const cipher_plan_t *plan, uint8_t *block);
+void cipher_plan_apply_tail(const cipher_plan_t *plan, uint8_t *tail);
@@ -0,0 +1,65 @@
+#include "games.h"
+
+#include "compression.h"
+#include "th128_core.h"
+#include "stats.h"
+#include "utils.h"
+
+
+// Decrypt functions of each game, in the same order as games
+typedef void (*game_decrypt_t)(const uint8_t *encoded_data, uint8_t *decrypted_data, uint32_t length);
+const game_decrypt_t game_decrypt_functions[] = {game_decrypt_data<game_th10>, game_decrypt_data<game_th128>};
+static_assert(sizeof(game_decrypt_functions) / sizeof(*game_decrypt_functions) == NUM_GAMES, "every game needs a decrypt function");
+
+
+uint32_t game_header_field(const uint8_t *file_data, uint32_t offset) {
+	uint32_t value;
+	memcpy(&value, file_data + offset, sizeof(value));
+	return value;
+}
+
+
+// Decodes a replay of any known game and saves its decoded data to a RAW file
+bool game_decode_replay_file(const game_descriptor_t *game, const char *file, const uint8_t *file_data, uint64_t size) {
+	uint32_t game_index = 0;
+	while (game_index < NUM_GAMES && games[game_index] != game) {
+		game_index++;
+	}
+	if (game_index == NUM_GAMES) {
+		log_printf("Not a known replay.\n");
+		return false;
+	}
+
+	if (size < game->header_size) {
+		log_printf("Error: replay file is truncated.\n");
+		return false;
+	}
+	uint32_t compressed_size = game_header_field(file_data, game->compressed_size_field);
+	uint32_t uncompressed_size = game_header_field(file_data, game->uncompressed_size_field);
+	if (compressed_size > size - game->header_size) {
+		log_printf("Error: replay file is truncated.\n");
+		return false;
+	}
+
+	th128_workspace_t &workspace = th128_thread_workspace();
+	uint8_t *decrypted_data = workspace.decrypted_data.reserve(compressed_size);
+	uint8_t *decoded_data = workspace.decoded_data.reserve(uncompressed_size);
+	double start_time = stats_start();
+	game_decrypt_functions[game_index](file_data + game->header_size, decrypted_data, compressed_size);
+	stats_stop(STATS_DECRYPT, start_time);
+
+	start_time = stats_start();
+	bool terminated;
+	uint32_t decompressed_size = decompress(decrypted_data, decoded_data, compressed_size, uncompressed_size, &terminated);
+	stats_stop(STATS_DECOMPRESS, start_time);
+	if (decompressed_size != DECOMPRESS_OVERFLOW && !terminated) {
+		log_printf("WARNING: reached end of data but didn't find data terminator!\n");
+	}
+	if (decompressed_size != uncompressed_size) {
+		log_printf("Error decompressing replay data: expected %u bytes.\n", uncompressed_size);
+		return false;
+	}
+
+	const file_part_t part = {decoded_data, uncompressed_size};
+	return write_file_parts(file, ".raw", &part, 1);
+}
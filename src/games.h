@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "encryption.h"
+
+
+/*
+	Games:
+
+	Replays of the Windows games since th10 have the same structure as th12.8 replays (see th128_parse.cpp):
+	a 0x24 byte header, LZSS compressed data encrypted with two cipher layers, and the user sections. What
+	changes between games is the magic, the cipher parameters and the layout of the decoded data, which are
+	described here. Only th12.8 replays can be fixed and parsed, the others can only be decoded.
+*/
+
+const int GAME_CIPHER_LAYERS = 2;
+
+struct game_descriptor_t {
+	const char *name;
+	uint32_t magic;
+	uint32_t header_size;
+	// offsets of the uint32 fields in the header
+	uint32_t user_data_offset_field;
+	uint32_t compressed_size_field;
+	uint32_t uncompressed_size_field;
+	cipher_layer_t decrypt_layers[GAME_CIPHER_LAYERS]; // encrypting applies them in reverse order
+	uint32_t stage_header_size; // 0 if the decoded data can't be parsed
+	uint32_t input_record_size;
+};
+
+inline constexpr game_descriptor_t game_th10 = {
+	"th10", 0x72303174 /* 't10r' */, 0x24, 0xc, 0x1c, 0x20,
+	{{0x400, 0xaa, 0xe1}, {0x80, 0x3d, 0x7a}},
+	0, 0
+};
+inline constexpr game_descriptor_t game_th128 = {
+	"th128", 0x72383231 /* '128r' */, 0x24, 0xc, 0x1c, 0x20,
+	{{0x800, 0x5e, 0xe7}, {0x80, 0x7d, 0x36}},
+	0x90, 0x6
+};
+
+inline constexpr const game_descriptor_t *games[] = {&game_th10, &game_th128};
+const uint32_t NUM_GAMES = sizeof(games) / sizeof(*games);
+
+
+// Finds the game of a replay from its magic, only the first 4 bytes are read. NULL if it's not a known replay.
+inline const game_descriptor_t *sniff_game(const uint8_t *data, uint64_t size) {
+	if (size < sizeof(uint32_t)) {
+		return NULL;
+	}
+	uint32_t magic;
+	memcpy(&magic, data, sizeof(magic));
+	for (uint32_t i = 0; i < NUM_GAMES; i++) {
+		if (games[i]->magic == magic) {
+			return games[i];
+		}
+	}
+	return NULL;
+}
+
+
+// Each game gets its own cipher plans, built the first time a thread uses them
+template <const game_descriptor_t &GAME>
+void game_decrypt_data(const uint8_t *encoded_data, uint8_t *decrypted_data, uint32_t length) {
+	static thread_local cipher_plan_t plan;
+	static thread_local bool initialized = false;
+	if (!initialized) {
+		cipher_plan_init(&plan, GAME.decrypt_layers, GAME_CIPHER_LAYERS, false);
+		initialized = true;
+	}
+	cipher_plan_apply_to(&plan, encoded_data, decrypted_data, length);
+}
+
+
+template <const game_descriptor_t &GAME>
+void game_encrypt_data(uint8_t *data, uint32_t length) {
+	static thread_local cipher_plan_t plan;
+	static thread_local bool initialized = false;
+	if (!initialized) {
+		cipher_layer_t layers[GAME_CIPHER_LAYERS];
+		for (int i = 0; i < GAME_CIPHER_LAYERS; i++) {
+			layers[i] = GAME.decrypt_layers[GAME_CIPHER_LAYERS - 1 - i];
+		}
+		cipher_plan_init(&plan, layers, GAME_CIPHER_LAYERS, true);
+		initialized = true;
+	}
+	cipher_plan_apply(&plan, data, length);
+}
+
+
+bool game_decode_replay_file(const game_descriptor_t *game, const char *file, const uint8_t *file_data, uint64_t size);
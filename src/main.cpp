@@ -3,24 +3,271 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <atomic>
+#include <mutex>
+#include <sys/stat.h>
 
+#include "batch.h"
+#include "compression.h"
+#include "th128_analyze.h"
 #include "th128_fix.h"
+#include "th128_index.h"
 #include "th128_parse.h"
+#include "tar.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+#include "watch.h"
 
 
-enum mode_t {
+enum run_mode_t {
     DRAGNDROP,
     FIX,
     DECODE,
     USER,
+    SCAN,
+    INDEX,
+    WATCH,
+    ANALYZE,
 };
 
 
+// Index used when none is given to the index command
+const char *const DEFAULT_INDEX_FILE = "replays.idx";
+
+// Time a replay must go without writes before watch processes it, and the most -d accepts
+const uint32_t DEFAULT_DEBOUNCE_MS = 20;
+const uint32_t MAX_DEBOUNCE_MS = 60 * 1000;
+
+// Most threads -j and -t can ask for
+const uint32_t MAX_THREADS = 1024;
+
+
 void display_usage(const char *filename) {
     printf("Usage:\n");
-    printf("\t%s fix file1.rpy file2.rpy ...\n", filename);
-    printf("\t%s decode file1.rpy file2.rpy ...\n", filename);
-    printf("\t%s user file1.rpy file2.rpy ...\n", filename);
+    printf("\t%s fix [-j jobs] [--stats[=format]] [--index file] [-l level] [-t threads] files...\n", filename);
+    printf("\t%s fix|decode|scan [options] --tar archive [--out archive] [--pass-through]\n", filename);
+    printf("\t%s decode [-j jobs] [--stats[=format]] [--format=text|columnar|raw] files...\n", filename);
+    printf("\t%s user [-j jobs] [--stats[=format]] files...\n", filename);
+    printf("\t%s scan [-j jobs] [--stats[=format]] [--index file] files...\n", filename);
+    printf("\t%s index [-j jobs] [--stats[=format]] [--index file] files...\n", filename);
+    printf("\t%s analyze [-j jobs] [--stats[=format]] [--tar archive] files...\n", filename);
+    printf("\t%s watch [-j jobs] [-d ms] [-l level] [-t threads] folder\n", filename);
+    printf("\n");
+    printf("Files can be replays or @listfile to read a list of replays from a file, one per line (@- for stdin).\n");
+    printf("fix - and decode - read one replay from stdin and write the fixed replay or decoded data to stdout.\n");
+    printf("fix - exits with 0 if the replay was fixed, 1 if its route was already correct (it's written unchanged)\n");
+    printf("and 2 if it's invalid. - must be the only file.\n");
+    printf("\n");
+    printf("scan only checks whether replays are bugged, its exit code is 0 if all are clean, 1 if some are bugged\n");
+    printf("and 2 if some couldn't be read.\n");
+    printf("\n");
+    printf("decode also reads th10 replays, but only writes their decoded data (.raw). Other commands skip them.\n");
+    printf("\n");
+    printf("index saves the info of each replay to an index file (%s by default), decoding only the replays\n", DEFAULT_INDEX_FILE);
+    printf("that changed since the last time and keeping the entries of the other replays. fix and scan skip\n");
+    printf("the replays the index already knows about (not with --tar).\n");
+    printf("\n");
+    printf("--tar reads the replays from a tar archive (- for stdin) instead of files, and --out writes the\n");
+    printf("fixed replays or decoded data to another tar archive (- for stdout) as they're done, in archive order.\n");
+    printf("--pass-through also copies the entries that didn't produce any output (other files, clean replays).\n");
+    printf("\n");
+    printf("analyze counts the inputs of each stage: key presses, bombs, actions per minute, frames with focus\n");
+    printf("or no key held and the time spent moving in each direction, and sums them over all replays.\n");
+    printf("\n");
+    printf("watch waits for replays to be saved to a folder (Linux only) and fixes the bugged ones right away,\n");
+    printf("until stopped with Ctrl+C.\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("\t-j jobs\t\tamount of replays processed in parallel, 0 = one per CPU core (default: 1)\n");
+    printf("\t--stats\t\tat the end, print the time of each step and other counters for each replay and in total,\n");
+    printf("\t\t\tas a table (--stats or --stats=text) or as one JSON object per line (--stats=json)\n");
+    printf("\t--index file\treplay index made by the index command\n");
+#ifdef TH128_TRACE
+    printf("\t--trace file\twrite a timeline of the steps of each replay on each thread to file, in the Chrome\n");
+    printf("\t\t\ttrace event format (open it in chrome://tracing or ui.perfetto.dev)\n");
+#endif
+    printf("\t-d ms\t\ttime a replay must go without writes before watch processes it, up to %u (default: %u)\n", MAX_DEBOUNCE_MS,
+        DEFAULT_DEBOUNCE_MS);
+    printf("\t-l level\tcompress fixed replays again: greedy, lazy, optimal or records\n");
+    printf("\t\t\t(by default the original compressed data is patched, keeping its size)\n");
+    printf("\t-t threads\tthreads used to compress each replay, 0 = one per CPU core (default: 1)\n");
+    printf("\t--format\tdecode replays to text (.txt, default), to a binary file with one column per input\n");
+    printf("\t\t\tfield and stage (.cols), or only to the raw decoded data (.raw)\n");
+}
+
+
+// Parses a whole decimal number from 0 to max, returns false if arg is anything else
+bool parse_number(const char *arg, uint32_t max, uint32_t &value) {
+    // strtoul skips spaces and accepts a minus sign, which would wrap around
+    if (arg[0] < '0' || arg[0] > '9') {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long number = strtoul(arg, &end, 10);
+    if (*end != '\0' || errno == ERANGE || number > max) {
+        return false;
+    }
+    value = number;
+    return true;
+}
+
+
+struct fix_context_t {
+    const compression_options_t *options; // NULL to patch replays
+    const th128_index_t *index; // NULL if not using an index
+};
+
+
+bool fix_file(const char *file, void *context) {
+    const fix_context_t *fix_context = (const fix_context_t *)context;
+    if (fix_context && fix_context->index) {
+        const th128_index_entry_t *entry = th128_index_lookup(fix_context->index, file);
+        if (entry && entry->status == TH128_SCAN_CLEAN) {
+            log_printf("Replay is clean according to the index, skipped.\n");
+            stats_skip_file();
+            return false;
+        }
+        if (entry && entry->status == TH128_SCAN_BUGGED && th128_fixed_file_exists(file)) {
+            log_printf("Replay was already fixed, skipped.\n");
+            stats_skip_file();
+            return false;
+        }
+    }
+    // a replay with the correct route isn't counted as fixed, nor as failed
+    th128_fix_result_t result = th128_fix_replay_file(file, fix_context ? fix_context->options : NULL);
+    if (result == TH128_FIX_CORRECT) {
+        stats_skip_file();
+    }
+    return result == TH128_FIX_FIXED;
+}
+
+
+bool decode_file(const char *file, void *context) {
+    return th128_decode_replay_file(file, *(const th128_decode_format_t *)context);
+}
+
+
+bool user_file(const char *file, void *) {
+    return th128_parse_user_data(file);
+}
+
+
+// Buffers are reused between replays, so this is the most memory used for them at any point
+void print_peak_memory() {
+    log_printf("Peak buffer memory: %.1f KiB.\n", grow_buffer_peak_size() / 1024.0);
+}
+
+
+void write_trace(const char *trace_file) {
+#ifdef TH128_TRACE
+    if (trace_file && trace_write(trace_file)) {
+        printf("Trace written to %s.\n", trace_file);
+    }
+#else
+    (void)trace_file;
+#endif
+}
+
+
+void print_file_stats(const file_stats_t *stats, const file_list_t *files, stats_format_t format) {
+    if (stats) {
+        print_stats(stats, files->files, files->size, format);
+    }
+}
+
+
+// Processes the files, or the replays in the tar archive if there's one. exit_code is set to 1 if the archive is broken.
+uint32_t run_replays(const file_list_t *files, const tar_options_t &tar_options, batch_process_t process, void *context, bool verbose,
+    file_stats_t *stats, int &exit_code) {
+    if (!tar_options.input_path) {
+        return run_batch(files, tar_options.num_jobs, process, context, verbose, stats);
+    }
+    bool ok;
+    uint32_t count = run_tar(tar_options, process, context, verbose, ok);
+    if (!ok) {
+        exit_code = 1;
+    }
+    return count;
+}
+
+
+struct analyze_context_t {
+    std::mutex mutex;
+    th128_input_counts_t total; // of all replays
+};
+
+
+bool analyze_file(const char *file, void *context) {
+    analyze_context_t *analyze_context = (analyze_context_t *)context;
+    th128_analysis_t analysis;
+    if (!th128_analyze_replay_file(file, &analysis)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(analyze_context->mutex);
+    th128_add_input_counts(analyze_context->total, analysis.total);
+    return true;
+}
+
+
+struct scan_counts_t {
+    std::atomic<uint32_t> counts[3]; // indexed by th128_scan_result_t
+    const th128_index_t *index; // NULL if not using an index
+};
+
+
+bool scan_file(const char *file, void *context) {
+    scan_counts_t *scan_counts = (scan_counts_t *)context;
+    int correct_route;
+    th128_scan_result_t result;
+    const th128_index_entry_t *entry = scan_counts->index ? th128_index_lookup(scan_counts->index, file) : NULL;
+    if (entry && entry->status != TH128_SCAN_ERROR) {
+        result = (th128_scan_result_t)entry->status;
+        correct_route = entry->correct_route;
+    } else {
+        result = th128_scan_replay_file(file, correct_route);
+    }
+    switch (result) {
+        case TH128_SCAN_CLEAN:
+            log_printf("%s: clean\n", file);
+            break;
+        case TH128_SCAN_BUGGED:
+            log_printf("%s: bugged (correct route: %s)\n", file, routes[correct_route]);
+            break;
+        case TH128_SCAN_ERROR:
+            log_printf("%s: error\n", file);
+            break;
+    }
+    scan_counts->counts[result]++;
+    return result != TH128_SCAN_ERROR;
+}
+
+
+struct index_context_t {
+    const th128_index_t *old_index; // NULL if there's none yet
+    th128_index_entry_t *entries;
+    char **paths;
+    std::atomic<uint32_t> num_entries;
+    std::atomic<uint32_t> num_changed;
+};
+
+
+bool index_file(const char *file, void *context) {
+    index_context_t *index_context = (index_context_t *)context;
+    th128_index_entry_t entry;
+    char full_path[TH128_INDEX_MAX_PATH];
+    bool changed;
+    if (!th128_index_replay_file(file, index_context->old_index, entry, full_path, changed)) {
+        return false;
+    }
+    uint32_t slot = index_context->num_entries++;
+    index_context->entries[slot] = entry;
+    index_context->paths[slot] = new char[strlen(full_path) + 1];
+    strcpy(index_context->paths[slot], full_path);
+    index_context->num_changed += changed;
+    return true;
 }
 
 
@@ -31,74 +278,311 @@ int main(int argc, char *argv[]) {
 		return 0;
 	}
 
-    mode_t mode;
+    run_mode_t mode;
     if (!strcmp(argv[1], "fix")) {
-        if (argc < 3) {
-            display_usage(argv[0]);
-            return 1;
-        }
         mode = FIX;
     } else if (!strcmp(argv[1], "decode")) {
-        if (argc < 3) {
+        mode = DECODE;
+    } else if (!strcmp(argv[1], "user")) {
+        mode = USER;
+    } else if (!strcmp(argv[1], "scan")) {
+        mode = SCAN;
+    } else if (!strcmp(argv[1], "index")) {
+        mode = INDEX;
+    } else if (!strcmp(argv[1], "watch")) {
+        mode = WATCH;
+    } else if (!strcmp(argv[1], "analyze")) {
+        mode = ANALYZE;
+    } else {
+        mode = DRAGNDROP;
+    }
+
+    int first_file = mode == DRAGNDROP ? 1 : 2;
+    uint32_t num_jobs = 1;
+    compression_options_t compression_options;
+    bool recompress = false; // compress replays again instead of patching them
+    bool collect_stats = false;
+    stats_format_t stats_format = STATS_TEXT;
+    const char *trace_file = NULL;
+    th128_decode_format_t decode_format = TH128_DECODE_TEXT;
+    const char *index_path = NULL;
+    tar_options_t tar_options = {NULL, NULL, false, 1};
+    uint32_t debounce_ms = DEFAULT_DEBOUNCE_MS;
+    for (; mode != DRAGNDROP && first_file < argc && argv[first_file][0] == '-' && strcmp(argv[first_file], STDIO_PATH); first_file++) {
+        if (!strcmp(argv[first_file], "-j") && first_file + 1 < argc) {
+            first_file++;
+            if (!parse_number(argv[first_file], MAX_THREADS, num_jobs)) {
+                display_usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[first_file], "--stats")) {
+            collect_stats = true;
+        } else if (!strncmp(argv[first_file], "--stats=", 8)) {
+            if (!parse_stats_format(argv[first_file] + 8, stats_format)) {
+                printf("Unknown stats format: %s\n", argv[first_file] + 8);
+                return 1;
+            }
+            collect_stats = true;
+#ifdef TH128_TRACE
+        } else if (!strcmp(argv[first_file], "--trace") && first_file + 1 < argc) {
+            first_file++;
+            trace_file = argv[first_file];
+#endif
+        } else if ((mode == FIX || mode == SCAN || mode == INDEX) && !strcmp(argv[first_file], "--index") && first_file + 1 < argc) {
+            first_file++;
+            index_path = argv[first_file];
+        } else if ((mode == FIX || mode == SCAN || mode == DECODE || mode == ANALYZE) && !strcmp(argv[first_file], "--tar") && first_file + 1 < argc) {
+            first_file++;
+            tar_options.input_path = argv[first_file];
+        } else if ((mode == FIX || mode == SCAN || mode == DECODE) && !strcmp(argv[first_file], "--out") && first_file + 1 < argc) {
+            first_file++;
+            tar_options.output_path = argv[first_file];
+        } else if ((mode == FIX || mode == SCAN || mode == DECODE) && !strcmp(argv[first_file], "--pass-through")) {
+            tar_options.pass_through = true;
+        } else if (mode == DECODE && !strncmp(argv[first_file], "--format=", 9)) {
+            const char *format = argv[first_file] + 9;
+            if (!strcmp(format, "text")) {
+                decode_format = TH128_DECODE_TEXT;
+            } else if (!strcmp(format, "columnar")) {
+                decode_format = TH128_DECODE_COLUMNAR;
+            } else if (!strcmp(format, "raw")) {
+                decode_format = TH128_DECODE_RAW;
+            } else {
+                printf("Unknown decode format: %s\n", format);
+                return 1;
+            }
+        } else if (mode == WATCH && !strcmp(argv[first_file], "-d") && first_file + 1 < argc) {
+            first_file++;
+            if (!parse_number(argv[first_file], MAX_DEBOUNCE_MS, debounce_ms)) {
+                display_usage(argv[0]);
+                return 1;
+            }
+        } else if ((mode == FIX || mode == WATCH) && !strcmp(argv[first_file], "-l") && first_file + 1 < argc) {
+            first_file++;
+            if (!parse_compression_level(argv[first_file], compression_options.level)) {
+                printf("Unknown compression level: %s\n", argv[first_file]);
+                return 1;
+            }
+            recompress = true;
+        } else if ((mode == FIX || mode == WATCH) && !strcmp(argv[first_file], "-t") && first_file + 1 < argc) {
+            first_file++;
+            if (!parse_number(argv[first_file], MAX_THREADS, compression_options.num_threads)) {
+                display_usage(argv[0]);
+                return 1;
+            }
+            recompress = true;
+        } else {
             display_usage(argv[0]);
             return 1;
         }
-        mode = DECODE;
-    } else if (!strcmp(argv[1], "user")) {
-        if (argc < 3) {
+    }
+
+    // fix - and decode - read a single replay from stdin and write the result to stdout, logging to stderr
+    if ((mode == FIX || mode == DECODE) && argc == first_file + 1 && !strcmp(argv[first_file], STDIO_PATH)) {
+        if (collect_stats) {
+            fprintf(stderr, "--stats can't be used when writing to stdout.\n");
+            return TH128_FIX_ERROR;
+        }
+        log_set_stream(stderr);
+        if (mode == FIX) {
+            return th128_fix_replay_file(STDIO_PATH, recompress ? &compression_options : NULL);
+        }
+        return th128_decode_replay_file(STDIO_PATH, decode_format) ? 0 : TH128_FIX_ERROR;
+    }
+
+    // with --tar, the replays come from the archive instead of the command line
+    if (tar_options.input_path) {
+        if (argc > first_file) {
             display_usage(argv[0]);
             return 1;
         }
-        mode = USER;
-    } else {
-        mode = DRAGNDROP;
+        if (collect_stats) {
+            printf("--stats can't be used with --tar.\n");
+            return 1;
+        }
+        // the index is keyed by the paths of files on disk, which the entries of the archive aren't
+        if (index_path) {
+            printf("--index can't be used with --tar.\n");
+            return 1;
+        }
+        if (tar_options.output_path && !strcmp(tar_options.output_path, STDIO_PATH)) {
+            log_set_stream(stderr);
+        }
+        tar_options.num_jobs = num_jobs;
+    }
+
+    file_list_t files;
+    file_list_init(&files);
+    for (int i = first_file; i < argc; i++) {
+        if (mode != DRAGNDROP && argv[i][0] == '@') {
+            if (!file_list_read(&files, argv[i] + 1)) {
+                file_list_free(&files);
+                return 1;
+            }
+        } else {
+            file_list_add(&files, argv[i]);
+        }
+    }
+    if ((mode != DRAGNDROP && argc <= first_file && !tar_options.input_path) || (mode == WATCH && files.size != 1)) {
+        display_usage(argv[0]);
+        return 1;
+    }
+    // stdin can only be read once and stdout would get several files in a row
+    for (uint32_t i = 0; i < files.size && files.size > 1; i++) {
+        if (!strcmp(files.files[i], STDIO_PATH)) {
+            printf("- must be the only file.\n");
+            file_list_free(&files);
+            return 1;
+        }
+    }
+
+    // open the index, the index command makes a new one if there's none
+    th128_index_t index;
+    bool has_index = false;
+    if (mode == INDEX && !index_path) {
+        index_path = DEFAULT_INDEX_FILE;
+    }
+    struct stat index_stat;
+    if (index_path && (mode != INDEX || stat(index_path, &index_stat) == 0)) {
+        has_index = th128_open_index(index_path, &index);
+        if (!has_index && mode != INDEX) {
+            file_list_free(&files);
+            return 1;
+        }
     }
 
     // run in specified mode
     int count = 0;    
+    int exit_code = 0;
+    file_stats_t *stats = collect_stats ? new file_stats_t[files.size] : NULL;
+    if (collect_stats || trace_file) {
+        set_utils_hooks(&stats_utils_hooks);
+    }
+#ifdef TH128_TRACE
+    if (trace_file) {
+        trace_start();
+    }
+#endif
     switch (mode) {
         case DRAGNDROP:
-            for (int i = 1; i < argc; i++) {
-                printf("Processing %s\n", argv[i]);
-                count += th128_fix_replay_file(argv[i]);
-                printf("\n");
-            }
+            count = run_batch(&files, 1, fix_file, NULL);
 
             printf("All done! Fixed %d replays.\n", count);
             system("pause"); // make the terminal stay open so user can read the output
 
             break;
-        case FIX:
-            for (int i = 2; i < argc; i++) {
-                printf("Processing %s\n", argv[i]);
-                count += th128_fix_replay_file(argv[i]);
-                printf("\n");
-            }
+        case FIX: {
+            fix_context_t fix_context = {recompress ? &compression_options : NULL, has_index ? &index : NULL};
+            count = run_replays(&files, tar_options, fix_file, &fix_context, true, stats, exit_code);
 
-            printf("All done! Fixed %d replays.\n", count);
+            log_printf("All done! Fixed %d replays.\n", count);
+            print_peak_memory();
+            print_file_stats(stats, &files, stats_format);
+            write_trace(trace_file);
 
             break;
+        }
         case DECODE:
-            for (int i = 2; i < argc; i++) {
-                printf("Processing %s\n", argv[i]);
-                count += th128_decode_replay_file(argv[i]);
-                printf("\n");
-            }
+            count = run_replays(&files, tar_options, decode_file, &decode_format, true, stats, exit_code);
 
-            printf("All done! Decoded %d replays.\n", count);
+            log_printf("All done! Decoded %d replays.\n", count);
+            print_peak_memory();
+            print_file_stats(stats, &files, stats_format);
+            write_trace(trace_file);
 
             break;
         case USER:
-            for (int i = 2; i < argc; i++) {
-                printf("Processing %s\n", argv[i]);
-                count += th128_parse_user_data(argv[i]);
-                printf("\n");
-            }
+            count = run_batch(&files, num_jobs, user_file, NULL, true, stats);
 
             printf("All done! Parsed %d replays.\n", count);
+            print_peak_memory();
+            print_file_stats(stats, &files, stats_format);
+            write_trace(trace_file);
 
             break;
+        case ANALYZE: {
+            analyze_context_t analyze_context;
+            analyze_context.total = {};
+            count = run_replays(&files, tar_options, analyze_file, &analyze_context, true, stats, exit_code);
+
+            log_printf("All done! Analyzed %d replays.\n", count);
+            if (count > 1) {
+                th128_print_input_counts_header();
+                th128_print_input_counts("All", analyze_context.total);
+                th128_print_movement(analyze_context.total);
+            }
+            print_file_stats(stats, &files, stats_format);
+            write_trace(trace_file);
+
+            break;
+        }
+        case SCAN: {
+            scan_counts_t scan_counts = {};
+            scan_counts.index = has_index ? &index : NULL;
+            run_replays(&files, tar_options, scan_file, &scan_counts, false, stats, exit_code);
+
+            uint32_t num_bugged = scan_counts.counts[TH128_SCAN_BUGGED];
+            uint32_t num_clean = scan_counts.counts[TH128_SCAN_CLEAN];
+            uint32_t num_errors = scan_counts.counts[TH128_SCAN_ERROR];
+            log_printf("\nAll done! Scanned %u replays: %u bugged, %u clean, %u errors.\n", num_bugged + num_clean + num_errors,
+                num_bugged, num_clean, num_errors);
+            print_file_stats(stats, &files, stats_format);
+            write_trace(trace_file);
+
+            // a broken archive counts as an error
+            exit_code = (num_errors || exit_code) ? 2 : num_bugged ? 1 : 0;
+            break;
+        }
+        case INDEX: {
+            // room for the replays given and for the entries of the old index that are kept
+            uint32_t max_entries = files.size + (has_index ? index.num_entries : 0);
+            index_context_t index_context;
+            index_context.old_index = has_index ? &index : NULL;
+            index_context.entries = new th128_index_entry_t[max_entries];
+            index_context.paths = new char *[max_entries];
+            index_context.num_entries = 0;
+            index_context.num_changed = 0;
+            count = run_batch(&files, num_jobs, index_file, &index_context, true, stats);
+
+            // the replays that weren't given keep their entries, the old index is still mapped until it's replaced
+            uint32_t num_indexed = index_context.num_entries;
+            uint32_t num_entries = num_indexed;
+            if (has_index) {
+                num_entries = th128_index_add_old_entries(&index, index_context.entries, index_context.paths, num_indexed);
+                th128_close_index(&index);
+                has_index = false;
+            }
+            if (!th128_write_index(index_path, index_context.entries, index_context.paths, num_entries)) {
+                exit_code = 1;
+            }
+
+            printf("All done! Indexed %d replays (%u decoded, %u unchanged, %u other entries kept) into %s.\n", count,
+                (uint32_t)index_context.num_changed, num_indexed - index_context.num_changed, num_entries - num_indexed, index_path);
+            print_peak_memory();
+            print_file_stats(stats, &files, stats_format);
+            write_trace(trace_file);
+
+            for (uint32_t i = 0; i < num_entries; i++) {
+                delete[] index_context.paths[i];
+            }
+            delete[] index_context.paths;
+            delete[] index_context.entries;
+            break;
+        }
+        case WATCH: {
+            watch_options_t watch_options = {num_jobs, recompress ? &compression_options : NULL, debounce_ms};
+            if (!watch_directory(files.files[0], watch_options)) {
+                exit_code = 1;
+            }
+            break;
+        }
+    }
+
+    if (has_index) {
+        th128_close_index(&index);
     }
+    delete[] stats;
+    file_list_free(&files);
 
-	return 0;
+	return exit_code;
 }
@@ -0,0 +1,228 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+/*
+	Stats:
+
+	Each file processed gets its own file_stats_t, which becomes the current one of the thread processing it.
+	The code of each phase adds its time and counters to the current stats, doing nothing when there aren't any,
+	so collecting them costs nothing unless asked for. Token counts take a separate pass over the compressed data,
+	which is only done when collecting stats and isn't part of any phase.
+
+	Reading and writing files and allocating buffers is done by utils, which reports them through the hooks in
+	stats_utils_hooks once they're set. The memory allocated only counts the reusable buffers, each time one
+	is allocated or grows, so it's mostly the first files of each thread that allocate anything.
+
+	Files are memory-mapped when possible, so the read phase only covers mapping them and the actual reading
+	happens as the data is used, mostly during decryption.
+*/
+
+const char *const stats_phase_names[] = {"read", "decrypt", "decompress", "route", "compress", "encrypt", "parse", "analyze", "write"};
+
+thread_local file_stats_t *curr_file_stats = NULL;
+thread_local double curr_file_start_time;
+
+
+bool parse_stats_format(const char *name, stats_format_t &format) {
+	if (!strcmp(name, "text")) {
+		format = STATS_TEXT;
+	} else if (!strcmp(name, "json")) {
+		format = STATS_JSON;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+
+// Makes stats the current stats of this thread, and starts timing the file
+void stats_begin_file(file_stats_t *stats) {
+	memset(stats, 0, sizeof(file_stats_t));
+	curr_file_stats = stats;
+	curr_file_start_time = get_time_ms();
+}
+
+
+// Marks the file being processed as skipped, so returning false for it doesn't count as a failure
+void stats_skip_file() {
+	if (curr_file_stats) {
+		curr_file_stats->num_skipped = 1;
+	}
+}
+
+
+void stats_end_file(bool result) {
+	curr_file_stats->total_time = get_time_ms() - curr_file_start_time;
+	curr_file_stats->num_files = 1;
+	curr_file_stats->num_failed = !result && !curr_file_stats->num_skipped;
+	curr_file_stats = NULL;
+}
+
+
+void stats_add_bytes_in(uint64_t size) {
+	if (curr_file_stats) {
+		curr_file_stats->bytes_in += size;
+	}
+}
+
+
+void stats_add_bytes_out(uint64_t size) {
+	if (curr_file_stats) {
+		curr_file_stats->bytes_out += size;
+	}
+}
+
+
+void stats_add_allocated(uint64_t size) {
+	if (curr_file_stats) {
+		curr_file_stats->allocated += size;
+	}
+}
+
+
+double stats_io_start() {
+	return stats_start();
+}
+
+
+void stats_read_done(double start_time, uint64_t size) {
+	stats_stop(STATS_READ, start_time);
+	stats_add_bytes_in(size);
+}
+
+
+void stats_write_done(double start_time, uint64_t size) {
+	stats_stop(STATS_WRITE, start_time);
+	stats_add_bytes_out(size);
+}
+
+
+void stats_buffer_allocated(size_t size) {
+	stats_add_allocated(size);
+}
+
+
+const utils_hooks_t stats_utils_hooks = {stats_io_start, stats_read_done, stats_write_done, stats_buffer_allocated};
+
+
+// Takes the decrypted data
+void stats_count_decoded_tokens(const uint8_t *compressed_data, uint32_t size) {
+	if (curr_file_stats) {
+		count_tokens(compressed_data, size, curr_file_stats->decoded_tokens);
+	}
+}
+
+
+void stats_count_encoded_tokens(const uint8_t *compressed_data, uint32_t size) {
+	if (curr_file_stats) {
+		count_tokens(compressed_data, size, curr_file_stats->encoded_tokens);
+	}
+}
+
+
+void add_token_counts(compression_token_counts_t &total, const compression_token_counts_t &counts) {
+	total.literals += counts.literals;
+	total.matches += counts.matches;
+	total.match_bytes += counts.match_bytes;
+}
+
+
+inline double average_match_length(const compression_token_counts_t &counts) {
+	return counts.matches ? (double)counts.match_bytes / counts.matches : 0;
+}
+
+
+void print_json_tokens(const char *name, const compression_token_counts_t &counts) {
+	printf(",\"%s_literals\":%llu,\"%s_matches\":%llu,\"%s_avg_match_length\":%.3f", name, (unsigned long long)counts.literals,
+		name, (unsigned long long)counts.matches, name, average_match_length(counts));
+}
+
+
+// file is NULL for the totals
+void print_stats_json(const file_stats_t &stats, const char *file) {
+	printf("{");
+	if (file) {
+		printf("\"file\":");
+		print_json_string(stdout, file);
+		printf(",\"ok\":%s,\"skipped\":%s", stats.num_failed ? "false" : "true", stats.num_skipped ? "true" : "false");
+	} else {
+		printf("\"summary\":true,\"files\":%u,\"failed\":%u,\"skipped\":%u", stats.num_files, stats.num_failed, stats.num_skipped);
+	}
+	printf(",\"total_ms\":%.3f", stats.total_time);
+	for (int i = 0; i < NUM_STATS_PHASES; i++) {
+		printf(",\"%s_ms\":%.3f", stats_phase_names[i], stats.phase_times[i]);
+	}
+	printf(",\"bytes_in\":%llu,\"bytes_out\":%llu", (unsigned long long)stats.bytes_in, (unsigned long long)stats.bytes_out);
+	print_json_tokens("decoded", stats.decoded_tokens);
+	print_json_tokens("encoded", stats.encoded_tokens);
+	printf(",\"allocated_bytes\":%llu}\n", (unsigned long long)stats.allocated);
+}
+
+
+void print_stats_row(const file_stats_t &stats, const char *name) {
+	printf("%10.3f", stats.total_time);
+	for (int i = 0; i < NUM_STATS_PHASES; i++) {
+		printf(" %10.3f", stats.phase_times[i]);
+	}
+	printf("  %s\n", name);
+}
+
+
+void print_tokens_text(const char *name, const compression_token_counts_t &counts) {
+	uint64_t num_tokens = counts.literals + counts.matches;
+	if (num_tokens == 0) {
+		return;
+	}
+	printf("%s tokens: %llu literals (%.1f%%), %llu matches, average match length %.2f\n", name,
+		(unsigned long long)counts.literals, 100.0 * counts.literals / num_tokens,
+		(unsigned long long)counts.matches, average_match_length(counts));
+}
+
+
+// Prints the stats of each file, then their totals
+void print_stats(const file_stats_t *stats, char *const *files, uint32_t num_files, stats_format_t format) {
+	file_stats_t total;
+	memset(&total, 0, sizeof(total));
+	for (uint32_t i = 0; i < num_files; i++) {
+		for (int j = 0; j < NUM_STATS_PHASES; j++) {
+			total.phase_times[j] += stats[i].phase_times[j];
+		}
+		total.total_time += stats[i].total_time;
+		total.bytes_in += stats[i].bytes_in;
+		total.bytes_out += stats[i].bytes_out;
+		add_token_counts(total.decoded_tokens, stats[i].decoded_tokens);
+		add_token_counts(total.encoded_tokens, stats[i].encoded_tokens);
+		total.allocated += stats[i].allocated;
+		total.num_files += stats[i].num_files;
+		total.num_failed += stats[i].num_failed;
+		total.num_skipped += stats[i].num_skipped;
+	}
+
+	if (format == STATS_JSON) {
+		for (uint32_t i = 0; i < num_files; i++) {
+			print_stats_json(stats[i], files[i]);
+		}
+		print_stats_json(total, NULL);
+		return;
+	}
+
+	printf("\nTimes in ms, the total row adds up all files (more than the elapsed time when running in parallel):\n");
+	printf("%10s", "total");
+	for (int i = 0; i < NUM_STATS_PHASES; i++) {
+		printf(" %10s", stats_phase_names[i]);
+	}
+	printf("  file\n");
+	for (uint32_t i = 0; i < num_files; i++) {
+		print_stats_row(stats[i], files[i]);
+	}
+	print_stats_row(total, "(total)");
+
+	printf("\nFiles: %u (%u failed, %u skipped)\n", total.num_files, total.num_failed, total.num_skipped);
+	printf("Bytes read: %llu, written: %llu\n", (unsigned long long)total.bytes_in, (unsigned long long)total.bytes_out);
+	print_tokens_text("Decoded", total.decoded_tokens);
+	print_tokens_text("Encoded", total.encoded_tokens);
+	printf("Reusable buffer memory allocated or grown: %.1f KiB\n", total.allocated / 1024.0);
+}
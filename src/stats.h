@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "compression.h"
+#include "trace.h"
+#include "utils.h"
+
+
+// Steps of processing a replay, timed separately
+enum stats_phase_t {
+	STATS_READ,
+	STATS_DECRYPT,
+	STATS_DECOMPRESS,
+	STATS_ROUTE,
+	STATS_COMPRESS,
+	STATS_ENCRYPT,
+	STATS_PARSE,
+	STATS_ANALYZE,
+	STATS_WRITE,
+	NUM_STATS_PHASES
+};
+
+enum stats_format_t {
+	STATS_TEXT, // table
+	STATS_JSON // one JSON object per line
+};
+
+// Measurements of a single file, or the sum of many
+struct file_stats_t {
+	double phase_times[NUM_STATS_PHASES]; // ms
+	double total_time; // ms, includes the time outside of the phases
+	uint64_t bytes_in; // read from files
+	uint64_t bytes_out; // written to files
+	compression_token_counts_t decoded_tokens; // of the compressed data read
+	compression_token_counts_t encoded_tokens; // of the compressed data written
+	uint64_t allocated; // bytes of the reusable buffers allocated or grown while processing the file
+	uint32_t num_files;
+	uint32_t num_failed;
+	uint32_t num_skipped; // needed nothing done, not counted as failed
+};
+
+
+extern const char *const stats_phase_names[NUM_STATS_PHASES];
+
+// Stats of the file being processed by the current thread, NULL if not collecting them
+extern thread_local file_stats_t *curr_file_stats;
+
+// Counts file reads and writes and buffer allocations, to be given to set_utils_hooks
+extern const utils_hooks_t stats_utils_hooks;
+
+
+// Start time of a phase, to be given to stats_stop
+inline double stats_start() {
+#ifdef TH128_TRACE
+	if (trace_enabled) {
+		return get_time_ms();
+	}
+#endif
+	return curr_file_stats ? get_time_ms() : 0;
+}
+
+
+// Also records the phase in the trace, when tracing
+inline void stats_stop(stats_phase_t phase, double start_time) {
+#ifdef TH128_TRACE
+	if (trace_enabled) {
+		double end_time = get_time_ms();
+		trace_event(stats_phase_names[phase], start_time, end_time);
+		if (curr_file_stats) {
+			curr_file_stats->phase_times[phase] += end_time - start_time;
+		}
+		return;
+	}
+#endif
+	if (curr_file_stats) {
+		curr_file_stats->phase_times[phase] += get_time_ms() - start_time;
+	}
+}
+
+
+bool parse_stats_format(const char *name, stats_format_t &format);
+void stats_begin_file(file_stats_t *stats);
+void stats_skip_file();
+void stats_end_file(bool result);
+void stats_add_bytes_in(uint64_t size);
+void stats_add_bytes_out(uint64_t size);
+void stats_add_allocated(uint64_t size);
+void stats_count_decoded_tokens(const uint8_t *compressed_data, uint32_t size);
+void stats_count_encoded_tokens(const uint8_t *compressed_data, uint32_t size);
+void print_stats(const file_stats_t *stats, char *const *files, uint32_t num_files, stats_format_t format);
@@ -0,0 +1,578 @@
+#include "tar.h"
+
+#include <limits.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "utils.h"
+
+
+/*
+	Tar archives:
+
+	Entries are read one after the other from the input, which doesn't need to be seekable. Each one is a
+	512 byte header followed by the data, padded to a multiple of 512 bytes, and the archive ends with two
+	zero blocks. Names longer than the header allows come in a GNU long name entry ('L') or a pax extended
+	header ('x') just before their entry. Ustar header fields:
+
+	0x000	name[100]
+	0x064	mode[8]		octal
+	0x06c	uid[8]		octal
+	0x074	gid[8]		octal
+	0x07c	size[12]	octal, or base-256 if the first byte has its top bit set
+	0x088	mtime[12]	octal
+	0x094	chksum[8]	octal, sum of the header bytes with this field as spaces
+	0x09c	typeflag	'0' or '\0' for regular files
+	0x09d	linkname[100]
+	0x101	magic[6]	"ustar"
+	0x107	version[2]
+	0x109	uname[32]
+	0x129	gname[32]
+	0x149	devmajor[8]
+	0x151	devminor[8]
+	0x159	prefix[155]	joined to name with a '/'
+*/
+
+const uint32_t TAR_SIZE_OFFSET = 0x7c;
+const uint32_t TAR_CHECKSUM_OFFSET = 0x94;
+const uint32_t TAR_TYPE_OFFSET = 0x9c;
+const uint32_t TAR_LINKNAME_OFFSET = 0x9d;
+const uint32_t TAR_MAGIC_OFFSET = 0x101;
+const uint32_t TAR_PREFIX_OFFSET = 0x159;
+const uint32_t TAR_NAME_SIZE = 100;
+const uint32_t TAR_PREFIX_SIZE = 155;
+
+
+uint64_t tar_parse_number(const uint8_t *field, uint32_t length) {
+	uint64_t value = 0;
+	if (field[0] & 0x80) {
+		for (uint32_t i = 1; i < length; i++) {
+			value = (value << 8) | field[i];
+		}
+		return value;
+	}
+	for (uint32_t i = 0; i < length && field[i] != '\0'; i++) {
+		if (field[i] >= '0' && field[i] <= '7') {
+			value = (value << 3) | (field[i] - '0');
+		}
+	}
+	return value;
+}
+
+
+uint32_t tar_checksum(const uint8_t *header) {
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+		sum += i >= TAR_CHECKSUM_OFFSET && i < TAR_CHECKSUM_OFFSET + 8 ? ' ' : header[i];
+	}
+	return sum;
+}
+
+
+uint64_t tar_padded_size(uint64_t size) {
+	return (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+}
+
+
+// Appends the next size bytes of the input (a multiple of the block size) to the header blocks of the entry
+bool tar_read_header_blocks(FILE *fp, tar_entry_t *entry, uint64_t size) {
+	if (size > 0x100000) {
+		log_printf("Error: tar header is too big.\n");
+		return false;
+	}
+	uint8_t *header_blocks = new uint8_t[entry->header_size + size];
+	memcpy(header_blocks, entry->header_blocks, entry->header_size);
+	delete[] entry->header_blocks;
+	entry->header_blocks = header_blocks;
+	if (fread(header_blocks + entry->header_size, 1, size, fp) != size) {
+		log_printf("Error: tar archive is truncated.\n");
+		return false;
+	}
+	entry->header_size += size;
+	return true;
+}
+
+
+char *tar_copy_string(const char *string, size_t length) {
+	char *copy = new char[length + 1];
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+	return copy;
+}
+
+
+// Finds the path in the records of a pax header ("<length> <key>=<value>\n")
+char *tar_pax_path(const uint8_t *data, uint64_t size) {
+	uint64_t curr_offset = 0;
+	while (curr_offset < size) {
+		uint64_t length = 0;
+		uint64_t i = curr_offset;
+		while (i < size && data[i] >= '0' && data[i] <= '9') {
+			length = length * 10 + (data[i++] - '0');
+		}
+		// the length counts its own digits, the space and the newline
+		if (length < i - curr_offset + 2 || length > size - curr_offset || data[i] != ' ') {
+			return NULL;
+		}
+		const char *record = (const char *)data + i + 1;
+		size_t record_length = curr_offset + length - (i + 1) - 1; // without the newline
+		if (record_length > 5 && !strncmp(record, "path=", 5)) {
+			return tar_copy_string(record + 5, record_length - 5);
+		}
+		curr_offset += length;
+	}
+	return NULL;
+}
+
+
+// Reads the headers of the next entry, its data must then be read, skipped or copied. At the end of the archive,
+// end is set and the entry is left empty.
+bool tar_read_header(FILE *fp, tar_entry_t *entry, bool &end) {
+	entry->header_blocks = NULL;
+	entry->header_size = 0;
+	entry->name = NULL;
+	entry->type = '0';
+	entry->data = NULL;
+	entry->size = 0;
+	end = false;
+
+	char *long_name = NULL;
+	while (true) {
+		uint32_t header_offset = entry->header_size;
+		// an archive can also just stop without the end blocks
+		uint8_t block[TAR_BLOCK_SIZE];
+		size_t block_size = fread(block, 1, TAR_BLOCK_SIZE, fp);
+		if (block_size == 0 && header_offset == 0) {
+			end = true;
+			return true;
+		}
+		if (block_size != TAR_BLOCK_SIZE) {
+			log_printf("Error: tar archive is truncated.\n");
+			break;
+		}
+		bool is_zero = true;
+		for (uint32_t i = 0; i < TAR_BLOCK_SIZE && is_zero; i++) {
+			is_zero = block[i] == 0;
+		}
+		if (is_zero && header_offset == 0) {
+			end = true;
+			return true;
+		}
+		if (tar_parse_number(block + TAR_CHECKSUM_OFFSET, 8) != tar_checksum(block)) {
+			log_printf("Error: not a tar archive, or it's corrupted.\n");
+			break;
+		}
+
+		uint8_t *header_blocks = new uint8_t[header_offset + TAR_BLOCK_SIZE];
+		memcpy(header_blocks, entry->header_blocks, header_offset);
+		memcpy(header_blocks + header_offset, block, TAR_BLOCK_SIZE);
+		delete[] entry->header_blocks;
+		entry->header_blocks = header_blocks;
+		entry->header_size += TAR_BLOCK_SIZE;
+
+		char type = block[TAR_TYPE_OFFSET] ? block[TAR_TYPE_OFFSET] : '0';
+		uint64_t size = tar_parse_number(block + TAR_SIZE_OFFSET, 12);
+		if (type == 'L' || type == 'x') {
+			uint32_t data_offset = entry->header_size;
+			if (!tar_read_header_blocks(fp, entry, tar_padded_size(size))) {
+				break;
+			}
+			const uint8_t *data = entry->header_blocks + data_offset;
+			char *name = type == 'L' ? tar_copy_string((const char *)data, strnlen((const char *)data, size)) : tar_pax_path(data, size);
+			if (name) {
+				delete[] long_name;
+				long_name = name;
+			}
+			continue;
+		}
+
+		if (long_name) {
+			entry->name = long_name;
+			long_name = NULL;
+		} else {
+			const char *name = (const char *)block;
+			const char *prefix = (const char *)block + TAR_PREFIX_OFFSET;
+			size_t name_length = strnlen(name, TAR_NAME_SIZE);
+			// the prefix field is only there in ustar headers
+			size_t prefix_length = memcmp(block + TAR_MAGIC_OFFSET, "ustar\0", 6) ? 0 : strnlen(prefix, TAR_PREFIX_SIZE);
+			entry->name = new char[prefix_length + 1 + name_length + 1];
+			sprintf(entry->name, "%.*s%s%.*s", (int)prefix_length, prefix, prefix_length ? "/" : "", (int)name_length, name);
+		}
+		entry->type = type;
+		entry->size = size;
+		return true;
+	}
+
+	delete[] long_name;
+	tar_free_entry(entry);
+	return false;
+}
+
+
+// Reads the data of an entry whose headers were just read, the caller checks that it's not too big
+bool tar_read_data(FILE *fp, tar_entry_t *entry) {
+	uint64_t padded_size = tar_padded_size(entry->size);
+	entry->data = new uint8_t[padded_size ? padded_size : 1];
+	if (fread(entry->data, 1, padded_size, fp) != padded_size) {
+		log_printf("Error: tar archive is truncated.\n");
+		return false;
+	}
+	return true;
+}
+
+
+// Copies the next size bytes of the input to the output in small pieces, or only reads them if out_fp is NULL.
+// Returns false if the input is truncated, written is cleared if the output couldn't be written.
+bool tar_copy_data(FILE *in_fp, FILE *out_fp, uint64_t size, bool &written) {
+	uint8_t buffer[TAR_BLOCK_SIZE * 16];
+	while (size > 0) {
+		size_t piece_size = size < sizeof(buffer) ? (size_t)size : sizeof(buffer);
+		if (fread(buffer, 1, piece_size, in_fp) != piece_size) {
+			log_printf("Error: tar archive is truncated.\n");
+			return false;
+		}
+		if (out_fp && written) {
+			written = fwrite(buffer, 1, piece_size, out_fp) == piece_size;
+		}
+		size -= piece_size;
+	}
+	return true;
+}
+
+
+// Skips the data of an entry whose headers were just read, seeking when the input allows it. The last byte is
+// still read to find truncated archives.
+bool tar_skip_data(FILE *fp, const tar_entry_t *entry) {
+	uint64_t padded_size = tar_padded_size(entry->size);
+	bool written = true;
+	if (padded_size > 1 && padded_size - 1 <= LONG_MAX && fseek(fp, (long)(padded_size - 1), SEEK_CUR) == 0) {
+		return tar_copy_data(fp, NULL, 1, written);
+	}
+	return tar_copy_data(fp, NULL, padded_size, written);
+}
+
+
+void tar_free_entry(tar_entry_t *entry) {
+	delete[] entry->header_blocks;
+	delete[] entry->name;
+	delete[] entry->data;
+	entry->header_blocks = NULL;
+	entry->name = NULL;
+	entry->data = NULL;
+}
+
+
+bool tar_write_data(FILE *fp, const uint8_t *data, uint64_t size) {
+	static const uint8_t padding[TAR_BLOCK_SIZE] = {};
+	uint64_t padding_size = tar_padded_size(size) - size;
+	return fwrite(data, 1, size, fp) == size && fwrite(padding, 1, padding_size, fp) == padding_size;
+}
+
+
+// Writes a header based on the ustar header of original, only changing the name, type and size
+bool tar_write_header(FILE *fp, const tar_entry_t *original, const char *name, char type, uint64_t size) {
+	uint8_t header[TAR_BLOCK_SIZE];
+	memcpy(header, original->header_blocks + original->header_size - TAR_BLOCK_SIZE, TAR_BLOCK_SIZE);
+	memset(header, 0, TAR_NAME_SIZE);
+	memset(header + TAR_LINKNAME_OFFSET, 0, TAR_NAME_SIZE);
+	if (!memcmp(header + TAR_MAGIC_OFFSET, "ustar\0", 6)) {
+		memset(header + TAR_PREFIX_OFFSET, 0, TAR_PREFIX_SIZE);
+	}
+	size_t name_length = strlen(name);
+	memcpy(header, name, name_length < TAR_NAME_SIZE ? name_length : TAR_NAME_SIZE);
+	header[TAR_TYPE_OFFSET] = type;
+	snprintf((char *)header + TAR_SIZE_OFFSET, 12, "%011llo", (unsigned long long)size);
+	snprintf((char *)header + TAR_CHECKSUM_OFFSET, 8, "%06o", tar_checksum(header));
+	header[TAR_CHECKSUM_OFFSET + 7] = ' ';
+	return fwrite(header, 1, TAR_BLOCK_SIZE, fp) == TAR_BLOCK_SIZE;
+}
+
+
+// Writes a new file entry, with the owner, permissions and time of original. Long names get a GNU long name entry.
+bool tar_write_file(FILE *fp, const tar_entry_t *original, const char *name, const uint8_t *data, uint64_t size) {
+	size_t name_length = strlen(name);
+	if (name_length > TAR_NAME_SIZE) {
+		if (!tar_write_header(fp, original, "././@LongLink", 'L', name_length + 1) || !tar_write_data(fp, (const uint8_t *)name, name_length + 1)) {
+			return false;
+		}
+	}
+	return tar_write_header(fp, original, name, '0', size) && tar_write_data(fp, data, size);
+}
+
+
+// Copies an entry as it was read
+bool tar_write_entry(FILE *fp, const tar_entry_t *entry) {
+	return fwrite(entry->header_blocks, 1, entry->header_size, fp) == entry->header_size && tar_write_data(fp, entry->data, entry->size);
+}
+
+
+// Copies an entry whose headers were just read along with its data, without holding the data in memory.
+// Returns false if the input is truncated, written is cleared if the output couldn't be written.
+bool tar_copy_entry(FILE *in_fp, FILE *out_fp, const tar_entry_t *entry, bool &written) {
+	written = fwrite(entry->header_blocks, 1, entry->header_size, out_fp) == entry->header_size;
+	return tar_copy_data(in_fp, out_fp, tar_padded_size(entry->size), written);
+}
+
+
+bool tar_write_end(FILE *fp) {
+	static const uint8_t end_blocks[TAR_BLOCK_SIZE * 2] = {};
+	return fwrite(end_blocks, 1, sizeof(end_blocks), fp) == sizeof(end_blocks);
+}
+
+
+/*
+	Processing archives:
+
+	The main thread reads the entries and hands the replays to the workers, which process them in memory: the
+	replay is the only file they can open, and the files they write are kept in memory (see memory_files_t).
+	The main thread then writes the results of each entry to the output archive in the original order, which
+	also bounds how many entries are in memory at once. The data of other entries is never held in memory: it's
+	skipped, or with --pass-through copied to the output in small pieces once the entries before it are written.
+	Replays bigger than TAR_MAX_REPLAY_SIZE are treated like other entries.
+*/
+
+struct tar_task_t {
+	tar_entry_t entry;
+	memory_files_t files;
+	log_buffer_t log;
+	bool result;
+	bool done;
+};
+
+struct tar_batch_t {
+	const tar_options_t *options;
+	batch_process_t process;
+	void *context;
+	bool verbose;
+	std::mutex mutex;
+	std::condition_variable work_condition;
+	std::condition_variable done_condition;
+	std::deque<tar_task_t *> queue;
+	bool reading_done;
+};
+
+
+void tar_worker(tar_batch_t *batch) {
+	while (true) {
+		tar_task_t *task;
+		{
+			std::unique_lock<std::mutex> lock(batch->mutex);
+			batch->work_condition.wait(lock, [batch] { return batch->reading_done || !batch->queue.empty(); });
+			if (batch->queue.empty()) {
+				break;
+			}
+			task = batch->queue.front();
+			batch->queue.pop_front();
+		}
+
+		log_set_buffer(&task->log);
+		set_memory_files(&task->files);
+		if (batch->verbose) {
+			log_printf("Processing %s\n", task->entry.name);
+		}
+		bool result = batch_process_file(batch->process, task->entry.name, batch->context, NULL);
+		if (batch->verbose) {
+			log_printf("\n");
+		}
+		set_memory_files(NULL);
+		log_set_buffer(NULL);
+
+		std::lock_guard<std::mutex> lock(batch->mutex);
+		task->result = result;
+		task->done = true;
+		batch->done_condition.notify_all();
+	}
+}
+
+
+bool tar_is_replay(const tar_entry_t *entry) {
+	size_t length = strlen(entry->name);
+	return entry->type == '0' && length > 4 && !strcmp(entry->name + length - 4, ".rpy");
+}
+
+
+// Waits for the oldest entry and writes its results, returns false if the output couldn't be written
+bool tar_finish_task(tar_batch_t *batch, tar_task_t *task, FILE *out_fp) {
+	{
+		std::unique_lock<std::mutex> lock(batch->mutex);
+		batch->done_condition.wait(lock, [task] { return task->done; });
+	}
+	if (task->log.size) {
+		log_printf("%.*s", (int)task->log.size, task->log.data);
+	}
+	bool written = true;
+	if (out_fp) {
+		for (uint32_t i = 0; i < task->files.num_outputs && written; i++) {
+			const memory_file_t &output = task->files.outputs[i];
+			written = tar_write_file(out_fp, &task->entry, output.path, output.data, output.size);
+		}
+		if (task->files.num_outputs == 0 && batch->options->pass_through && written) {
+			written = tar_write_entry(out_fp, &task->entry);
+		}
+		if (!written) {
+			log_perror("Error writing the tar archive");
+		}
+	}
+	return written;
+}
+
+
+bool tar_task_done(tar_batch_t *batch, const tar_task_t *task) {
+	std::lock_guard<std::mutex> lock(batch->mutex);
+	return task->done;
+}
+
+
+void tar_free_task(tar_task_t *task) {
+	free_memory_outputs(&task->files);
+	tar_free_entry(&task->entry);
+	delete[] task->log.data;
+	delete task;
+}
+
+
+// Writes the results of the oldest entries that are done, and waits for more of them while there are more than
+// max_tasks left
+void tar_finish_tasks(tar_batch_t *batch, std::deque<tar_task_t *> &tasks, size_t max_tasks, FILE *out_fp, bool &write_ok, uint32_t &count) {
+	while (tasks.size() > max_tasks || (!tasks.empty() && tar_task_done(batch, tasks.front()))) {
+		tar_task_t *oldest = tasks.front();
+		tasks.pop_front();
+		write_ok = tar_finish_task(batch, oldest, write_ok ? out_fp : NULL) && write_ok;
+		count += oldest->result;
+		tar_free_task(oldest);
+	}
+}
+
+
+// Processes every replay in a tar archive with num_jobs threads, writing the files they produce to another archive.
+// Returns the amount of replays that succeeded, ok is false if an archive couldn't be read or written.
+uint32_t run_tar(const tar_options_t &options, batch_process_t process, void *context, bool verbose, bool &ok) {
+	ok = false;
+	bool in_stdin = !strcmp(options.input_path, STDIO_PATH);
+	bool out_stdout = options.output_path && !strcmp(options.output_path, STDIO_PATH);
+#ifdef _WIN32
+	if (in_stdin) {
+		_setmode(_fileno(stdin), _O_BINARY);
+	}
+	if (out_stdout) {
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
+	FILE *in_fp = in_stdin ? stdin : fopen(options.input_path, "rb");
+	if (!in_fp) {
+		log_perror("Error");
+		return 0;
+	}
+	FILE *out_fp = NULL;
+	if (options.output_path) {
+		out_fp = out_stdout ? stdout : fopen(options.output_path, "wb");
+		if (!out_fp) {
+			log_perror("Error");
+			if (!in_stdin) {
+				fclose(in_fp);
+			}
+			return 0;
+		}
+	}
+
+	tar_batch_t batch;
+	batch.options = &options;
+	batch.process = process;
+	batch.context = context;
+	batch.verbose = verbose;
+	batch.reading_done = false;
+	uint32_t num_workers = options.num_jobs ? options.num_jobs : std::thread::hardware_concurrency();
+	if (num_workers == 0) {
+		num_workers = 1;
+	}
+	std::thread *workers = new std::thread[num_workers];
+	for (uint32_t i = 0; i < num_workers; i++) {
+		workers[i] = std::thread(tar_worker, &batch);
+	}
+
+	// entries being processed or waiting to be written, in order
+	std::deque<tar_task_t *> tasks;
+	const size_t max_tasks = num_workers * 4;
+	uint32_t count = 0;
+	bool read_ok = true;
+	bool write_ok = true;
+	while (true) {
+		tar_entry_t entry;
+		bool end;
+		if (!tar_read_header(in_fp, &entry, end) || end) {
+			read_ok = end;
+			break;
+		}
+		bool is_replay = tar_is_replay(&entry);
+		if (is_replay && entry.size > TAR_MAX_REPLAY_SIZE) {
+			log_printf("Skipping %s: too big for a replay.\n", entry.name);
+			is_replay = false;
+		}
+		if (!is_replay) {
+			if (out_fp && options.pass_through && write_ok) {
+				tar_finish_tasks(&batch, tasks, 0, out_fp, write_ok, count);
+				bool written = write_ok;
+				read_ok = write_ok ? tar_copy_entry(in_fp, out_fp, &entry, written) : tar_skip_data(in_fp, &entry);
+				if (!written) {
+					log_perror("Error writing the tar archive");
+					write_ok = false;
+				}
+			} else {
+				read_ok = tar_skip_data(in_fp, &entry);
+			}
+			tar_free_entry(&entry);
+			if (!read_ok) {
+				break;
+			}
+			continue;
+		}
+		if (!tar_read_data(in_fp, &entry)) {
+			read_ok = false;
+			tar_free_entry(&entry);
+			break;
+		}
+
+		tar_task_t *task = new tar_task_t;
+		task->entry = entry;
+		task->files = {task->entry.name, task->entry.data, task->entry.size, {}, 0};
+		task->log = {NULL, 0, 0};
+		task->result = false;
+		task->done = false;
+		tasks.push_back(task);
+		{
+			std::lock_guard<std::mutex> lock(batch.mutex);
+			batch.queue.push_back(task);
+			batch.work_condition.notify_one();
+		}
+
+		tar_finish_tasks(&batch, tasks, max_tasks - 1, out_fp, write_ok, count);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(batch.mutex);
+		batch.reading_done = true;
+		batch.work_condition.notify_all();
+	}
+	tar_finish_tasks(&batch, tasks, 0, out_fp, write_ok, count);
+	for (uint32_t i = 0; i < num_workers; i++) {
+		workers[i].join();
+	}
+	delete[] workers;
+
+	if (!in_stdin) {
+		fclose(in_fp);
+	}
+	if (out_fp) {
+		write_ok = tar_write_end(out_fp) && write_ok;
+		write_ok = (out_stdout ? fflush(out_fp) : fclose(out_fp)) == 0 && write_ok;
+	}
+	ok = read_ok && write_ok;
+	return count;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "batch.h"
+
+
+const uint32_t TAR_BLOCK_SIZE = 512;
+
+// Replay entries bigger than this aren't read, real replays are well under 1 MiB
+const uint64_t TAR_MAX_REPLAY_SIZE = 64 << 20;
+
+// Entry of a tar archive, with all the header blocks that come before its data (long name or pax headers)
+struct tar_entry_t {
+	uint8_t *header_blocks;
+	uint32_t header_size; // multiple of TAR_BLOCK_SIZE, the last block is the ustar header of the entry
+	char *name;
+	char type;
+	uint8_t *data; // NULL until read with tar_read_data
+	uint64_t size;
+};
+
+struct tar_options_t {
+	const char *input_path; // "-" for stdin
+	const char *output_path; // "-" for stdout, NULL to not write an archive
+	bool pass_through; // copy the entries without output (not replays, clean or broken replays) to the output
+	uint32_t num_jobs; // 0 = one per CPU core
+};
+
+
+bool tar_read_header(FILE *fp, tar_entry_t *entry, bool &end);
+bool tar_read_data(FILE *fp, tar_entry_t *entry);
+bool tar_skip_data(FILE *fp, const tar_entry_t *entry);
+void tar_free_entry(tar_entry_t *entry);
+bool tar_write_file(FILE *fp, const tar_entry_t *original, const char *name, const uint8_t *data, uint64_t size);
+bool tar_write_entry(FILE *fp, const tar_entry_t *entry);
+bool tar_copy_entry(FILE *in_fp, FILE *out_fp, const tar_entry_t *entry, bool &written);
+bool tar_write_end(FILE *fp);
+uint32_t run_tar(const tar_options_t &options, batch_process_t process, void *context, bool verbose, bool &ok);
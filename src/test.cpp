@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #include "types.h"
 #include "encryption.h"
@@ -8,7 +9,13 @@
 #include "th128_core.h"
 #include "th128_parse.h"
 #include "th128_fix.h"
+#include "th128_index.h"
+#include "th128_view.h"
+#include "th128_analyze.h"
+#include "stats.h"
+#include "tar.h"
 #include "utils.h"
+#include "watch.h"
 
 
 // Test that compressing and decompressing yields the same data
@@ -17,7 +24,7 @@ uint8_t *test_compress(uint8_t *data, uint32_t size) {
 	uint8_t *compressed_data = compress(data, size, compressed_size);
 
 	uint8_t *decompressed_data = new uint8_t[size];
-	uint32_t decompressed_size = decompress(compressed_data, decompressed_data, compressed_size);
+	uint32_t decompressed_size = decompress(compressed_data, decompressed_data, compressed_size, size);
 	
 	if (decompressed_size != size) {
 		printf("Unexpected data size: got %d, expected %d.\n", decompressed_size, size);
@@ -45,33 +52,543 @@ uint8_t *test_compress(uint8_t *data, uint32_t size) {
 }
 
 
+// Compress data with every compression level and report size, ratio and time of each
+void test_compression_levels(uint8_t *data, uint32_t size, uint32_t num_threads) {
+	compression_record_region_t input_regions[TH128_MAX_STAGES];
+	uint32_t num_input_regions = th128_find_input_regions(data, size, input_regions);
+
+	for (int i = 0; i < NUM_COMPRESSION_LEVELS; i++) {
+		compression_options_t options;
+		options.level = (compression_level_t)i;
+		options.record_regions = input_regions;
+		options.num_record_regions = num_input_regions;
+		options.num_threads = num_threads;
+
+		uint32_t compressed_size;
+		double start_time = get_time_ms();
+		uint8_t *compressed_data = compress(data, size, compressed_size, options);
+		double elapsed_time = get_time_ms() - start_time;
+
+		uint8_t *decompressed_data = new uint8_t[size];
+		uint32_t decompressed_size = decompress(compressed_data, decompressed_data, compressed_size, size);
+		bool matches = decompressed_size == size && !memcmp(decompressed_data, data, size);
+
+		printf("  %-8s x%u %7u bytes, ratio %.4f, %8.2f ms%s\n", compression_level_name(options.level), num_threads, compressed_size,
+			(double)compressed_size / size, elapsed_time, matches ? "" : " !! DATA DIFFERS !!");
+
+		delete[] compressed_data;
+		delete[] decompressed_data;
+	}
+}
+
+
+// Test that cipher plans give the same result as applying each layer separately, for many lengths
+bool test_cipher_plans() {
+	const cipher_layer_t decrypt_layers[] = {{0x800, 0x5e, 0xe7}, {0x80, 0x7d, 0x36}};
+	const cipher_layer_t encrypt_layers[] = {{0x80, 0x7d, 0x36}, {0x800, 0x5e, 0xe7}};
+	cipher_plan_t *decrypt_plan = new cipher_plan_t;
+	cipher_plan_t *encrypt_plan = new cipher_plan_t;
+	cipher_plan_init(decrypt_plan, decrypt_layers, 2, false);
+	cipher_plan_init(encrypt_plan, encrypt_layers, 2, true);
+
+	const uint32_t max_length = 0x3000;
+	uint8_t *data = new uint8_t[max_length];
+	uint8_t *expected = new uint8_t[max_length];
+	uint32_t seed = 1;
+	for (uint32_t i = 0; i < max_length; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+
+	bool ok = true;
+	for (uint32_t length = 0; length <= max_length && ok; length++) {
+		uint8_t *result = new uint8_t[length + 1];
+
+		memcpy(expected, data, length);
+		decrypt(expected, length, 0x800, 0x5e, 0xe7);
+		decrypt(expected, length, 0x80, 0x7d, 0x36);
+		cipher_plan_apply_to(decrypt_plan, data, result, length);
+		if (memcmp(result, expected, length)) {
+			printf("Cipher plan mismatch when decrypting %u bytes.\n", length);
+			ok = false;
+		}
+
+		memcpy(expected, data, length);
+		encrypt(expected, length, 0x80, 0x7d, 0x36);
+		encrypt(expected, length, 0x800, 0x5e, 0xe7);
+		memcpy(result, data, length);
+		cipher_plan_apply(encrypt_plan, result, length);
+		if (memcmp(result, expected, length)) {
+			printf("Cipher plan mismatch when encrypting %u bytes.\n", length);
+			ok = false;
+		}
+
+		delete[] result;
+	}
+
+	if (ok) {
+		// compare speed on a replay-sized buffer
+		const uint32_t size = 0x100000;
+		uint8_t *buffer = new uint8_t[size];
+		memset(buffer, 0x55, size);
+		double start_time = get_time_ms();
+		decrypt(buffer, size, 0x800, 0x5e, 0xe7);
+		decrypt(buffer, size, 0x80, 0x7d, 0x36);
+		double separate_time = get_time_ms() - start_time;
+		start_time = get_time_ms();
+		cipher_plan_apply(decrypt_plan, buffer, size);
+		double plan_time = get_time_ms() - start_time;
+		printf("Cipher plans match for all lengths up to %u (1 MB: %.2f ms separate, %.2f ms fused).\n", max_length, separate_time, plan_time);
+		delete[] buffer;
+	}
+
+	delete[] data;
+	delete[] expected;
+	delete decrypt_plan;
+	delete encrypt_plan;
+	return ok;
+}
+
+
+struct stream_output_t {
+	uint8_t *data;
+	uint32_t size;
+	uint32_t capacity;
+};
+
+bool test_stream_output(const uint8_t *data, uint32_t size, void *user_data) {
+	stream_output_t *output = (stream_output_t *)user_data;
+	if (size > output->capacity - output->size) {
+		return false;
+	}
+	memcpy(output->data + output->size, data, size);
+	output->size += size;
+	return true;
+}
+
+
+// Test that the streaming decoder gives the same data as decoding all at once, for several piece sizes
+void test_decode_stream(const uint8_t *encoded_data, uint32_t compressed_size, const uint8_t *decoded_data, uint32_t uncompressed_size) {
+	const uint32_t piece_sizes[] = {1, 7, 0x80, 0x7ff, 0x800, 0x1001, compressed_size};
+	th128_decode_stream_t *stream = new th128_decode_stream_t;
+	stream_output_t output;
+	output.data = new uint8_t[uncompressed_size];
+	output.capacity = uncompressed_size;
+
+	for (size_t i = 0; i < sizeof(piece_sizes) / sizeof(*piece_sizes); i++) {
+		output.size = 0;
+		th128_decode_stream_init(stream, compressed_size, uncompressed_size, test_stream_output, &output);
+		decompress_status_t status = DECOMPRESS_MORE;
+		for (uint32_t pos = 0; pos < compressed_size && status == DECOMPRESS_MORE; pos += piece_sizes[i]) {
+			uint32_t piece_size = compressed_size - pos < piece_sizes[i] ? compressed_size - pos : piece_sizes[i];
+			status = th128_decode_stream_push(stream, encoded_data + pos, piece_size);
+		}
+		if (status != DECOMPRESS_DONE || output.size != uncompressed_size || memcmp(output.data, decoded_data, uncompressed_size)) {
+			printf("!! STREAM DECODED DATA DIFFERS (pieces of %u bytes) !!\n", piece_sizes[i]);
+		}
+	}
+
+	delete[] output.data;
+	delete stream;
+}
+
+
+// Test that the library views find the same data as the rest of the code, and that small buffers are rejected
+void test_replay_view(const uint8_t *file_data, uint64_t file_size, const uint8_t *decoded_data) {
+	th128_replay_view_t view;
+	th128_data_view_t data_view;
+	if (sniff_game(file_data, file_size) != &game_th128) {
+		printf("!! REPLAY NOT DETECTED AS TH128 !!\n");
+	}
+	if (th128_view_replay(file_data, file_size, &view) != TH128_OK || view.num_user_sections != TH128_MAX_USER_SECTIONS) {
+		printf("!! REPLAY VIEW FAILED !!\n");
+		return;
+	}
+	uint32_t compressed_size = view.encoded_data.size;
+	uint32_t uncompressed_size = view.header->uncompressed_data_size;
+	uint8_t *decrypted_data = new uint8_t[compressed_size];
+	uint8_t *view_decoded_data = new uint8_t[uncompressed_size];
+	if (th128_view_decode(&view, decrypted_data, compressed_size, view_decoded_data, uncompressed_size - 1) != TH128_ERROR_BUFFER_TOO_SMALL) {
+		printf("!! VIEW DECODED INTO A SMALL BUFFER !!\n");
+	}
+	if (th128_view_decode(&view, decrypted_data, compressed_size, view_decoded_data, uncompressed_size) != TH128_OK
+		|| memcmp(view_decoded_data, decoded_data, uncompressed_size)) {
+		printf("!! VIEW DECODED DATA DIFFERS !!\n");
+	} else if (th128_view_replay_data(view_decoded_data, uncompressed_size, &data_view) != TH128_OK) {
+		printf("!! DATA VIEW FAILED !!\n");
+	} else {
+		th128_stage_header_t *stages[TH128_MAX_STAGES];
+		uint32_t num_stages = th128_find_stages(view_decoded_data, uncompressed_size, stages, TH128_MAX_STAGES);
+		for (uint32_t i = 0; i < num_stages; i++) {
+			const th128_stage_view_t &stage = data_view.stages[i];
+			if (data_view.num_stages != num_stages || stage.header != stages[i] || stage.num_inputs != stages[i]->num_frames
+				|| stage.fps_data.data + stage.fps_data.size != (const uint8_t *)(stages[i] + 1) + stages[i]->size) {
+				printf("!! DATA VIEW STAGES DIFFER !!\n");
+				break;
+			}
+		}
+	}
+
+	// broken replays get an error code without anything being printed
+	log_buffer_t log = {NULL, 0, 0};
+	log_set_buffer(&log);
+	th128_replay_view_t truncated_view = view;
+	truncated_view.encoded_data.size = 0;
+	if (th128_view_decode(&truncated_view, decrypted_data, compressed_size, view_decoded_data, uncompressed_size) != TH128_ERROR_TRUNCATED) {
+		printf("!! VIEW DECODED DATA WITHOUT A TERMINATOR !!\n");
+	}
+	// the bits past the end read as zeros, which can look like a terminator, then the size is wrong
+	truncated_view.encoded_data.size = compressed_size / 2;
+	th128_error_t error = th128_view_decode(&truncated_view, decrypted_data, compressed_size, view_decoded_data, uncompressed_size);
+	if (error != TH128_ERROR_TRUNCATED && error != TH128_ERROR_BAD_COMPRESSED_DATA) {
+		printf("!! VIEW DECODED TRUNCATED DATA !!\n");
+	}
+	uint8_t *overlapping_file = new uint8_t[file_size];
+	memcpy(overlapping_file, file_data, file_size);
+	((th128_replay_header_t *)overlapping_file)->user_data_offset = sizeof(th128_replay_header_t) + compressed_size - 1;
+	if (th128_view_replay(overlapping_file, file_size, &view) != TH128_ERROR_OVERLAPPING_DATA) {
+		printf("!! VIEW ACCEPTED OVERLAPPING USER DATA !!\n");
+	}
+	// the replay file functions don't print either, the commands do
+	th128_replay_file_t replay;
+	replay.file = {overlapping_file, file_size, false, true};
+	if (th128_load_replay_file(&replay) != TH128_ERROR_OVERLAPPING_DATA) {
+		printf("!! OVERLAPPING USER DATA LOADED !!\n");
+	}
+	if (th128_decode_replay_data_to(file_data + sizeof(th128_replay_header_t), decrypted_data, 0, view_decoded_data, uncompressed_size) != TH128_ERROR_TRUNCATED) {
+		printf("!! DECODED DATA WITHOUT A TERMINATOR !!\n");
+	}
+	log_set_buffer(NULL);
+	if (log.size > 0) {
+		printf("!! VIEW PRINTED: %.*s !!\n", (int)log.size, log.data);
+	}
+	delete[] log.data;
+	delete[] overlapping_file;
+	delete[] decrypted_data;
+	delete[] view_decoded_data;
+}
+
+
+// Test that the vector input counts match counting one frame at a time, for every amount of inputs left over
+// after the vectors, and that the quit marker at the end is only counted as such
+void test_input_counts(const uint8_t *decoded_data, uint32_t size) {
+	th128_data_view_t view;
+	if (th128_view_replay_data(decoded_data, size, &view) != TH128_OK) {
+		return;
+	}
+	for (uint32_t i = 0; i < view.num_stages; i++) {
+		const th128_stage_view_t &stage = view.stages[i];
+		for (uint32_t cut = 0; cut < 16 && cut <= stage.num_inputs; cut++) {
+			th128_input_counts_t counts = {};
+			th128_input_counts_t scalar_counts = {};
+			th128_count_inputs(stage.inputs, stage.num_inputs - cut, counts);
+			th128_count_inputs_scalar(stage.inputs, stage.num_inputs - cut, scalar_counts);
+			if (memcmp(&counts, &scalar_counts, sizeof(th128_input_counts_t)) || counts.num_frames + counts.quit_frames != stage.num_inputs - cut) {
+				printf("!! INPUT COUNTS DIFFER !!\n");
+				return;
+			}
+		}
+	}
+
+	if (view.num_stages > 0 && view.stages[0].num_inputs > 2) {
+		uint32_t num_inputs = view.stages[0].num_inputs;
+		th128_input_data_t *inputs = new th128_input_data_t[num_inputs];
+		memcpy(inputs, view.stages[0].inputs, num_inputs * sizeof(th128_input_data_t));
+		memset(inputs + num_inputs - 2, 0xff, 2 * sizeof(th128_input_data_t));
+		th128_input_counts_t counts = {};
+		th128_input_counts_t before_quit = {};
+		th128_count_inputs(inputs, num_inputs, counts);
+		th128_count_inputs_scalar(inputs, num_inputs - 2, before_quit);
+		before_quit.quit_frames = 2;
+		if (memcmp(&counts, &before_quit, sizeof(th128_input_counts_t))) {
+			printf("!! QUIT MARKER COUNTED AS INPUTS !!\n");
+		}
+		delete[] inputs;
+	}
+}
+
+
+// Character of a frame in the text output, the way it was chosen before the lookup table
+const uint8_t *reference_action_char(th128_input_data_t input_data) {
+	if (input_data.holding.raw == 0xffff) {
+		return char_codes::quit;
+	}
+	if (input_data.pressed.bits.bomb) {
+		return char_codes::bomb;
+	}
+	if (input_data.pressed.bits.autoshoot) {
+		return char_codes::autoshoot_press;
+	}
+	if (input_data.released.bits.autoshoot) {
+		return char_codes::autoshoot_release;
+	}
+	if (input_data.pressed.bits.focus) {
+		return char_codes::focus_press;
+	}
+	if (input_data.released.bits.focus) {
+		return char_codes::focus_release;
+	}
+	if (input_data.pressed.bits.shoot) {
+		return char_codes::shoot_press;
+	}
+	if (input_data.released.bits.shoot) {
+		return char_codes::shoot_release;
+	}
+	return char_codes::movement[(input_data.holding.raw >> 4) & 0xf];
+}
+
+
+// Text output of th128_parse_replay_data, written with fprintf one piece at a time like before it used a single
+// buffer. Only for replays whose input data fits in their stages.
+void reference_parse_replay_data(uint8_t *decoded_data, uint32_t size, FILE *fp) {
+	th128_replay_data_t *replay_data = (th128_replay_data_t *)decoded_data;
+	th128_stage_header_t *stage_data[TH128_MAX_STAGES];
+	uint32_t num_stages = th128_find_stages(decoded_data, size, stage_data, TH128_MAX_STAGES);
+
+	fprintf(fp, "Replay data\n");
+	fprintf(fp, "-----------\n");
+	fprintf(fp, "Name: %.*s\n", 8, replay_data->name);
+	time_t time = replay_data->date;
+	tm utc_time;
+#ifdef _WIN32
+	gmtime_s(&utc_time, &time);
+#else
+	gmtime_r(&time, &utc_time);
+#endif
+	char date_str[256];
+	strftime(date_str, sizeof(date_str), "%Y-%m-%d %H:%M:%S (UTC)", &utc_time);
+	fprintf(fp, "Date: %s\n", date_str);
+	fprintf(fp, "Score: %u\n", replay_data->score * 10);
+	fprintf(fp, "Slowdown rate: %.2f%%\n", replay_data->slowdown);
+	fprintf(fp, "Number of stages: %u\n", replay_data->num_stages);
+	fprintf(fp, "Route: ");
+	if (replay_data->route > 6) {
+		fprintf(fp, "Extra+%u (bugged)", replay_data->route - 6);
+	} else {
+		fprintf(fp, "%s", routes[replay_data->route]);
+	}
+	fprintf(fp, "\n");
+	fprintf(fp, "Rank: %s\n", ranks[replay_data->rank]);
+	fprintf(fp, "Last stage: %s\n", stages[replay_data->last_stage]);
+	fprintf(fp, "\n\n");
+
+	fprintf(fp, "Game settings\n");
+	fprintf(fp, "-------------\n");
+	fprintf(fp, "Shot button: %02hu\n", replay_data->game_config.shot_button);
+	fprintf(fp, "Bomb button: %02hu\n", replay_data->game_config.bomb_button);
+	fprintf(fp, "Rapid button: %02hu\n", replay_data->game_config.rapid_button);
+	fprintf(fp, "Slow button: %02hu\n", replay_data->game_config.slow_button);
+	fprintf(fp, "Pause button: %02hu\n", replay_data->game_config.pause_button);
+	fprintf(fp, "Joypad sensitivity: %hu\n", replay_data->game_config.joypad_sensitivity);
+	fprintf(fp, "Color mode: %s\n", color_modes[replay_data->game_config.color_mode]);
+	fprintf(fp, "Screen mode: %s\n", screen_modes[replay_data->game_config.screen_mode]);
+	fprintf(fp, "Frameskip: %s\n", frameskip_modes[replay_data->game_config.frameskip]);
+	fprintf(fp, "BGM volume: %hu%%\n", replay_data->game_config.bgm_vol);
+	fprintf(fp, "SFX volume: %hu%%\n", replay_data->game_config.sfx_vol);
+	fprintf(fp, "Input latency: %s\n", input_latency_modes[replay_data->game_config.input_latency]);
+	fprintf(fp, "Initial window X position: %u\n", replay_data->game_config.window_x);
+	fprintf(fp, "Initial window Y position: %u\n", replay_data->game_config.window_y);
+	fprintf(fp, "Always ask screen mode: %s\n", replay_data->game_config.flags.always_ask ? "enabled" : "disabled");
+	fprintf(fp, "Focus when firing: %s\n", replay_data->game_config.flags.focus_when_firing ? "enabled" : "disabled");
+	fprintf(fp, "Don't use DirectInput: %s\n", replay_data->game_config.flags.not_direct_input ? "enabled" : "disabled");
+	fprintf(fp, "\n\n");
+
+	for (uint32_t i = 0; i < num_stages; i++) {
+		fprintf(fp, "Stage %u data\n", i + 1);
+		fprintf(fp, "------------\n");
+		fprintf(fp, "Stage: %s\n", stages[stage_data[i]->stage]);
+		fprintf(fp, "RNG seed: %hu\n", stage_data[i]->seed);
+		fprintf(fp, "Number of frames: %u\n", stage_data[i]->num_frames);
+		fprintf(fp, "Initial score: %u\n", stage_data[i]->score * 10);
+		fprintf(fp, "Level: %u\n", stage_data[i]->shot_power + 1);
+		fprintf(fp, "X position: %.2f\n", stage_data[i]->pos_x / 128.0f);
+		fprintf(fp, "Y position: %.2f\n", stage_data[i]->pos_y / 128.0f);
+		fprintf(fp, "Continues used: %d\n", stage_data[i]->continues);
+		fprintf(fp, "Graze: %d\n", stage_data[i]->graze);
+		fprintf(fp, "Motivation: %.2f%%\n", stage_data[i]->motivation / 100.0f);
+		fprintf(fp, "Perfect freeze: %.2f%%\n", stage_data[i]->perfect_freeze / 100.0f);
+		fprintf(fp, "Freeze area: %.2f%%\n", stage_data[i]->freeze_area);
+
+		fprintf(fp, "\n= Time =   ========================= Actions ==========================\n");
+		th128_input_data_t *input_data = (th128_input_data_t *)(stage_data[i] + 1);
+		for (uint32_t j = 0; j < stage_data[i]->num_frames; j++) {
+			if (j % 60 == 0) {
+				fprintf(fp, "[%06d]   ", j / 60);
+			}
+			const uint8_t *action_char = reference_action_char(input_data[j]);
+			fwrite(action_char, 1, action_char[0] < 0x80 ? 1 : 3, fp);
+			if (j % 60 == 59) {
+				fprintf(fp, "\n");
+			}
+		}
+		if (stage_data[i]->num_frames % 60) {
+			fprintf(fp, "\n");
+		}
+
+		fprintf(fp, "\nFPS data:\n");
+		uint8_t *fps_data = (uint8_t *)(input_data + stage_data[i]->num_frames);
+		uint32_t fps_data_size = stage_data[i]->size - stage_data[i]->num_frames * 6;
+		for (uint32_t j = 0; j < fps_data_size; j++) {
+			fprintf(fp, "%02d%c", fps_data[j], j % 24 == 23 ? '\n' : ' ');
+		}
+		fprintf(fp, "\n\n\n");
+	}
+}
+
+
+typedef bool (*write_decoded_data_t)(uint8_t *decoded_data, uint32_t size, const char *out_file);
+
+// Output of th128_parse_replay_data or th128_write_columnar_data, kept in memory. Returns NULL if it failed.
+uint8_t *write_decoded_to_memory(write_decoded_data_t write, uint8_t *decoded_data, uint32_t size, uint64_t &output_size) {
+	memory_files_t files = {};
+	files.input_path = "";
+	set_memory_files(&files);
+	bool written = write(decoded_data, size, "replay.out");
+	set_memory_files(NULL);
+	if (!written || files.num_outputs != 1) {
+		free_memory_outputs(&files);
+		return NULL;
+	}
+	output_size = files.outputs[0].size;
+	delete[] files.outputs[0].path;
+	return files.outputs[0].data;
+}
+
+
+// Test that the text output is the same as the reference renderer's, also with random inputs, and that a stage
+// claiming more frames than fit in it is cut short instead of being read past its end
+void test_text_output(const uint8_t *decoded_data, uint32_t size) {
+	uint8_t *data = new uint8_t[size];
+	memcpy(data, decoded_data, size);
+	th128_stage_header_t *stages[TH128_MAX_STAGES];
+	uint32_t num_stages = th128_find_stages(data, size, stages, TH128_MAX_STAGES);
+
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			// every key and action combination, and the quit marker now and then
+			uint32_t seed = size;
+			for (uint32_t i = 0; i < num_stages; i++) {
+				uint16_t *keys = (uint16_t *)(stages[i] + 1);
+				for (uint32_t j = 0; j < stages[i]->num_frames * 3; j++) {
+					seed = seed * 1103515245 + 12345;
+					keys[j] = (seed >> 16) % 97 == 0 ? 0xffff : seed >> 16;
+				}
+			}
+		}
+		FILE *fp = tmpfile();
+		if (!fp) {
+			break;
+		}
+		reference_parse_replay_data(data, size, fp);
+		long expected_size = ftell(fp);
+		uint8_t *expected = new uint8_t[expected_size];
+		rewind(fp);
+		bool read = fread(expected, 1, expected_size, fp) == (size_t)expected_size;
+		fclose(fp);
+
+		uint64_t text_size;
+		uint8_t *text = write_decoded_to_memory(th128_parse_replay_data, data, size, text_size);
+		if (!read || !text || text_size != (uint64_t)expected_size || memcmp(text, expected, expected_size)) {
+			printf("!! TEXT OUTPUT DIFFERS FROM THE REFERENCE%s !!\n", pass ? " (random inputs)" : "");
+		}
+		delete[] text;
+		delete[] expected;
+	}
+
+	if (num_stages > 0) {
+		stages[0]->num_frames = stages[0]->size / sizeof(th128_input_data_t) + 1000;
+		uint64_t text_size;
+		uint8_t *text = write_decoded_to_memory(th128_parse_replay_data, data, size, text_size);
+		if (!text) {
+			printf("!! TEXT OUTPUT FAILED WITH TOO MANY FRAMES !!\n");
+		}
+		delete[] text;
+	}
+	delete[] data;
+}
+
+
+// Test that the columnar export follows its documented layout: the header, then the stage table, then the
+// holding, pressed and released columns and the FPS data of each stage in order, at offsets aligned to 8 bytes
+void test_columnar_output(const uint8_t *decoded_data, uint32_t size) {
+	uint8_t *data = new uint8_t[size];
+	memcpy(data, decoded_data, size);
+	th128_stage_header_t *stages[TH128_MAX_STAGES];
+	uint32_t num_stages = th128_find_stages(data, size, stages, TH128_MAX_STAGES);
+	const th128_replay_data_t *replay_data = (const th128_replay_data_t *)data;
+
+	uint64_t output_size;
+	uint8_t *output = write_decoded_to_memory(th128_write_columnar_data, data, size, output_size);
+	const th128_columnar_header_t *header = (const th128_columnar_header_t *)output;
+	uint64_t expected_offset = sizeof(th128_columnar_header_t) + num_stages * sizeof(th128_columnar_stage_t);
+	bool ok = output && output_size >= expected_offset && header->magic == TH128_COLUMNAR_MAGIC
+		&& header->version == TH128_COLUMNAR_VERSION && header->date == replay_data->date && header->score == replay_data->score
+		&& header->route == replay_data->route && header->rank == replay_data->rank && header->last_stage == replay_data->last_stage
+		&& header->num_stages == num_stages && header->stages_offset == sizeof(th128_columnar_header_t);
+
+	for (uint32_t i = 0; i < num_stages && ok; i++) {
+		const th128_columnar_stage_t &stage = ((const th128_columnar_stage_t *)(output + header->stages_offset))[i];
+		const th128_input_data_t *inputs = (const th128_input_data_t *)(stages[i] + 1);
+		uint32_t num_frames = stages[i]->num_frames;
+		uint64_t column_size = (num_frames * sizeof(uint16_t) + 7) / 8 * 8;
+		ok = stage.stage == stages[i]->stage && stage.seed == stages[i]->seed && stage.num_frames == num_frames
+			&& stage.score == stages[i]->score && stage.graze == stages[i]->graze
+			&& stage.fps_size == stages[i]->size - num_frames * sizeof(th128_input_data_t)
+			&& stage.holding_offset == expected_offset && stage.pressed_offset == expected_offset + column_size
+			&& stage.released_offset == expected_offset + 2 * column_size && stage.fps_offset == expected_offset + 3 * column_size
+			&& stage.fps_offset + stage.fps_size <= output_size;
+		if (!ok) {
+			break;
+		}
+		const uint16_t *holding = (const uint16_t *)(output + stage.holding_offset);
+		const uint16_t *pressed = (const uint16_t *)(output + stage.pressed_offset);
+		const uint16_t *released = (const uint16_t *)(output + stage.released_offset);
+		for (uint32_t j = 0; j < num_frames && ok; j++) {
+			ok = holding[j] == inputs[j].holding.raw && pressed[j] == inputs[j].pressed.raw && released[j] == inputs[j].released.raw;
+		}
+		ok = ok && !memcmp(output + stage.fps_offset, inputs + num_frames, stage.fps_size);
+		expected_offset = (stage.fps_offset + stage.fps_size + 7) / 8 * 8;
+	}
+	if (!ok || output_size != expected_offset) {
+		printf("!! COLUMNAR LAYOUT DIFFERS !!\n");
+	}
+	delete[] output;
+	delete[] data;
+}
+
+
 // Test that re-encoding a replay yields the same decoded data
 void th128_encode_decode_test(const char *file) {
-	// Read file
-	FILE *fp = fopen(file, "rb");
-	if (!fp) {
-		perror("Error");
+	// Open file
+	th128_replay_file_t replay;
+	th128_error_t error = th128_open_replay_file(file, &replay);
+	if (error != TH128_OK) {
+		th128_log_error(error, &replay);
 		return;
 	}
-
-	fseek(fp, 0L, SEEK_END);
-	uint32_t file_size = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
-	
-	uint8_t *file_data = new uint8_t[file_size];
-	fread(file_data, file_size, 1, fp);
-	fclose(fp);
-	
-	// Parse file header
-	th128_replay_header_t *header = (th128_replay_header_t *)file_data;
-	uint8_t *encoded_data = file_data + sizeof(th128_replay_header_t);
+	const th128_replay_header_t *header = replay.header;
+	const uint8_t *encoded_data = replay.encoded_data;
 	uint32_t compressed_size = header->compressed_data_size;
 	uint32_t uncompressed_size = header->uncompressed_data_size;
-	uint8_t *user_data = file_data + header->user_data_offset;
-	uint32_t user_data_size = file_size - sizeof(th128_replay_header_t) - compressed_size;
+	const uint8_t *user_data = replay.user_data;
+	uint32_t user_data_size = replay.user_data_size;
 
-	// Decode original data
-	uint8_t *decoded_data = th128_decode_replay_data(encoded_data, compressed_size, uncompressed_size);
+	// Decode original data, also with the streaming decoder
+	uint8_t *decrypted_data = new uint8_t[compressed_size];
+	uint8_t *decoded_data = th128_decode_replay_data(encoded_data, decrypted_data, compressed_size, uncompressed_size);
+	test_decode_stream(encoded_data, compressed_size, decoded_data, uncompressed_size);
+	test_replay_view(replay.file.data, replay.file.size, decoded_data);
+	test_input_counts(decoded_data, uncompressed_size);
+	test_text_output(decoded_data, uncompressed_size);
+	test_columnar_output(decoded_data, uncompressed_size);
+
+	// Re-compressing unmodified data with its original tokens must give back the original compressed data
+	uint32_t recompressed_size;
+	uint8_t *recompressed_data = recompress(decrypted_data, compressed_size, decoded_data, uncompressed_size, recompressed_size);
+	if (recompressed_size != compressed_size || memcmp(recompressed_data, decrypted_data, compressed_size)) {
+		printf("!! RECOMPRESSED DATA DIFFERS !!\n");
+	}
+	delete[] recompressed_data;
 
 	// Encode data
 	uint32_t new_encoded_data_size;
@@ -83,7 +600,7 @@ void th128_encode_decode_test(const char *file) {
 	uint8_t *new_file_data = new uint8_t[new_file_size];
 	uint8_t *curr_file_ptr = new_file_data;
 
-	memcpy(curr_file_ptr, file_data, sizeof(th128_replay_header_t));
+	memcpy(curr_file_ptr, header, sizeof(th128_replay_header_t));
 	curr_file_ptr += sizeof(th128_replay_header_t);
 	th128_replay_header_t *new_header = (th128_replay_header_t *)new_file_data;
 	new_header->compressed_data_size = new_encoded_data_size;
@@ -99,9 +616,10 @@ void th128_encode_decode_test(const char *file) {
 	write_file(file, ".reenc.rpy", new_file_data, new_file_size);
 
 	// Decode encoded data
-	uint8_t *new_decoded_data = th128_decode_replay_data(new_encoded_data, new_encoded_data_size, uncompressed_size);
+	uint8_t *new_decoded_data = th128_decode_replay_data(new_encoded_data, new_encoded_data, new_encoded_data_size, uncompressed_size);
 	if (new_decoded_data == NULL) {
-		delete[] file_data;
+		th128_close_replay_file(&replay);
+		delete[] decrypted_data;
 		delete[] decoded_data;
 		delete[] new_encoded_data;
 		delete[] new_file_data;
@@ -117,12 +635,15 @@ void th128_encode_decode_test(const char *file) {
 		write_file(file, ".reenc.raw", new_decoded_data, uncompressed_size);
 	} else {
 		printf("Data matches.\n");
-		printf("Original compressed data size: %d\n", compressed_size);
+		printf("Original compressed data size: %d (ratio %.4f)\n", compressed_size, (double)compressed_size / uncompressed_size);
 		printf("New compressed data size:      %d\n", new_encoded_data_size);
+		test_compression_levels(decoded_data, uncompressed_size, 1);
+		test_compression_levels(decoded_data, uncompressed_size, 4);
 	}
 
 	// Clean up
-	delete[] file_data;
+	th128_close_replay_file(&replay);
+	delete[] decrypted_data;
 	delete[] decoded_data;
 	delete[] new_encoded_data;
 	delete[] new_decoded_data;
@@ -130,21 +651,578 @@ void th128_encode_decode_test(const char *file) {
 }
 
 
+// Copies a file, returns false if it couldn't be read
+bool test_copy_file(const char *file, const char *copy, uint32_t extra_bytes) {
+	input_file_t input;
+	if (!open_input_file(file, &input)) {
+		return false;
+	}
+	uint8_t *data = new uint8_t[input.size + extra_bytes];
+	memcpy(data, input.data, input.size);
+	memset(data + input.size, 0, extra_bytes);
+	write_file(copy, "", data, input.size + extra_bytes);
+	delete[] data;
+	close_input_file(&input);
+	return true;
+}
+
+
+// Test that an index written with two replays can be read back and finds them, that an entry stops being found
+// once its file changes, and that indexing only one replay again keeps the entry of the other
+bool test_replay_index(const char *file_a, const char *file_b) {
+	const char *const copies[] = {"index_test_a.rpy", "index_test_b.rpy"};
+	const char *const index_path = "index_test.idx";
+	if (!test_copy_file(file_a, copies[0], 0) || !test_copy_file(file_b, copies[1], 0)) {
+		return false;
+	}
+
+	// the paths must be sorted when written
+	th128_index_entry_t entries[2];
+	char full_paths[2][TH128_INDEX_MAX_PATH];
+	char *paths[2] = {full_paths[1], full_paths[0]};
+	bool ok = true;
+	for (int i = 0; i < 2; i++) {
+		bool changed;
+		ok = ok && th128_index_replay_file(copies[1 - i], NULL, entries[i], paths[i], changed) && changed
+			&& entries[i].status != TH128_SCAN_ERROR;
+	}
+	th128_index_entry_t expected[2] = {entries[1], entries[0]};
+	ok = ok && th128_write_index(index_path, entries, paths, 2);
+
+	th128_index_t index;
+	if (!ok || !th128_open_index(index_path, &index)) {
+		printf("!! INDEX NOT WRITTEN !!\n");
+		remove(copies[0]);
+		remove(copies[1]);
+		remove(index_path);
+		return false;
+	}
+	for (int i = 0; i < 2 && ok; i++) {
+		const th128_index_entry_t *entry = th128_index_lookup(&index, copies[i]);
+		ok = index.num_entries == 2 && entry == &index.entries[i] && !strcmp(index.paths + entry->path_offset, full_paths[i])
+			&& !memcmp(&entry->file_size, &expected[i].file_size, sizeof(th128_index_entry_t) - sizeof(uint64_t));
+	}
+	if (!ok || th128_index_lookup(&index, file_a)) {
+		printf("!! INDEX LOOKUP FAILED !!\n");
+	}
+
+	// a replay that changed is no longer found, and indexing it again decodes it. The other one keeps its entry.
+	test_copy_file(file_a, copies[0], 16);
+	th128_index_entry_t new_entries[3];
+	char new_full_path[TH128_INDEX_MAX_PATH];
+	char *new_paths[3] = {new_full_path};
+	bool changed = false;
+	ok = !th128_index_lookup(&index, copies[0]) && th128_index_lookup(&index, copies[1])
+		&& th128_index_replay_file(copies[0], &index, new_entries[0], new_full_path, changed) && changed
+		&& new_entries[0].file_size == expected[0].file_size + 16;
+	uint32_t num_entries = ok ? th128_index_add_old_entries(&index, new_entries, new_paths, 1) : 0;
+	if (!ok || num_entries != 2 || strcmp(new_paths[1], full_paths[1])
+		|| memcmp(&new_entries[1].file_size, &expected[1].file_size, sizeof(th128_index_entry_t) - sizeof(uint64_t))) {
+		printf("!! STALE INDEX ENTRY NOT DETECTED !!\n");
+	}
+	for (uint32_t i = 1; i < num_entries; i++) {
+		delete[] new_paths[i];
+	}
+	th128_close_index(&index);
+
+	// rewriting a replay with the same contents keeps its entry without decoding it
+	if (th128_open_index(index_path, &index)) {
+		test_copy_file(file_b, copies[1], 0);
+		th128_index_entry_t entry;
+		char full_path[TH128_INDEX_MAX_PATH];
+		if (!th128_index_replay_file(copies[1], &index, entry, full_path, changed) || changed || entry.hash != expected[1].hash) {
+			printf("!! UNCHANGED REPLAY INDEXED AGAIN !!\n");
+		}
+		th128_close_index(&index);
+	}
+
+	remove(copies[0]);
+	remove(copies[1]);
+	remove(index_path);
+	printf("Replay index tested.\n");
+	return ok;
+}
+
+
+// Copy of a replay file with its decoded data changed by modify and encoded again, NULL if it can't be decoded
+uint8_t *test_modified_replay(const uint8_t *file_data, uint64_t file_size, void (*modify)(uint8_t *decoded_data), uint64_t &new_size) {
+	th128_replay_view_t view;
+	if (th128_view_replay(file_data, file_size, &view) != TH128_OK) {
+		return NULL;
+	}
+	uint32_t compressed_size = view.encoded_data.size;
+	uint32_t uncompressed_size = view.header->uncompressed_data_size;
+	uint8_t *decrypted_data = new uint8_t[compressed_size];
+	uint8_t *decoded_data = new uint8_t[uncompressed_size];
+	uint8_t *new_file_data = NULL;
+	if (th128_view_decode(&view, decrypted_data, compressed_size, decoded_data, uncompressed_size) == TH128_OK) {
+		modify(decoded_data);
+		uint32_t encoded_size;
+		uint8_t *encoded_data = th128_encode_replay_data(decoded_data, uncompressed_size, encoded_size);
+		uint32_t user_data_offset = sizeof(th128_replay_header_t) + encoded_size;
+		new_size = user_data_offset + view.user_data.size;
+		new_file_data = new uint8_t[new_size];
+		memcpy(new_file_data, view.header, sizeof(th128_replay_header_t));
+		th128_replay_header_t *new_header = (th128_replay_header_t *)new_file_data;
+		new_header->compressed_data_size = encoded_size;
+		new_header->user_data_offset = user_data_offset;
+		memcpy(new_file_data + sizeof(th128_replay_header_t), encoded_data, encoded_size);
+		memcpy(new_file_data + user_data_offset, view.user_data.data, view.user_data.size);
+		delete[] encoded_data;
+	}
+	delete[] decrypted_data;
+	delete[] decoded_data;
+	return new_file_data;
+}
+
+
+// A first stage far bigger than the data, with a second stage to look for after it
+void test_break_stages(uint8_t *decoded_data) {
+	th128_replay_data_t *replay_data = (th128_replay_data_t *)decoded_data;
+	replay_data->num_stages = 2;
+	((th128_stage_header_t *)(replay_data + 1))->size = 0x7ffffff0;
+}
+
+
+// Values that aren't in the name tables
+void test_break_names(uint8_t *decoded_data) {
+	th128_replay_data_t *replay_data = (th128_replay_data_t *)decoded_data;
+	replay_data->rank = 0x40000000;
+	replay_data->last_stage = 0x40000000;
+	replay_data->game_config.color_mode = 0xff;
+	replay_data->game_config.screen_mode = 0xff;
+	replay_data->game_config.frameskip = 0xff;
+	replay_data->game_config.input_latency = 0xff;
+	((th128_stage_header_t *)(replay_data + 1))->stage = 0;
+}
+
+
+// Fixes or decodes data given as stdin, returns the exit code of fix - or decode -. What's written goes to files.
+int test_stdio_command(bool fix, const uint8_t *data, uint64_t size, memory_files_t &files, th128_decode_format_t format = TH128_DECODE_RAW) {
+	files = {};
+	files.input_path = STDIO_PATH;
+	files.input_data = data;
+	files.input_size = size;
+	log_buffer_t log = {NULL, 0, 0};
+	log_set_buffer(&log);
+	set_memory_files(&files);
+	int result = fix ? th128_fix_replay_file(STDIO_PATH) : th128_decode_replay_file(STDIO_PATH, format) ? 0 : TH128_FIX_ERROR;
+	set_memory_files(NULL);
+	log_set_buffer(NULL);
+	delete[] log.data;
+	return result;
+}
+
+
+// Test the exit codes of fix - and that stdout gets exactly one replay unless the input is invalid: the fixed one,
+// or the input unchanged when its route was already correct. decode - writes only the decoded data.
+bool test_stdio_fix(const char *file) {
+	input_file_t input;
+	if (!open_input_file(file, &input)) {
+		return false;
+	}
+	memory_files_t files;
+	bool ok = true;
+	int result = test_stdio_command(true, input.data, input.size, files);
+	if (result == TH128_FIX_FIXED && files.num_outputs == 1) {
+		// the fixed replay is correct, so fixing it again copies it
+		memory_files_t fixed_files;
+		ok = test_stdio_command(true, files.outputs[0].data, files.outputs[0].size, fixed_files) == TH128_FIX_CORRECT
+			&& fixed_files.num_outputs == 1 && fixed_files.outputs[0].size == files.outputs[0].size
+			&& !memcmp(fixed_files.outputs[0].data, files.outputs[0].data, files.outputs[0].size);
+		free_memory_outputs(&fixed_files);
+	} else {
+		ok = result == TH128_FIX_CORRECT && files.num_outputs == 1 && files.outputs[0].size == input.size
+			&& !memcmp(files.outputs[0].data, input.data, input.size);
+	}
+	free_memory_outputs(&files);
+	if (!ok) {
+		printf("!! FIX - DIDN'T WRITE ONE REPLAY !!\n");
+	}
+
+	uint8_t *broken_data = new uint8_t[input.size];
+	memcpy(broken_data, input.data, input.size);
+	memset(broken_data, 0, 4);
+	if (test_stdio_command(true, broken_data, input.size, files) != TH128_FIX_ERROR || files.num_outputs != 0) {
+		printf("!! FIX - ACCEPTED AN INVALID REPLAY !!\n");
+		ok = false;
+	}
+	free_memory_outputs(&files);
+	delete[] broken_data;
+
+	// stages that don't fit in the data are an error, not something to read past the end of the data
+	uint64_t crafted_size;
+	uint8_t *crafted_data = test_modified_replay(input.data, input.size, test_break_stages, crafted_size);
+	if (!crafted_data || test_stdio_command(true, crafted_data, crafted_size, files) != TH128_FIX_ERROR || files.num_outputs != 0) {
+		printf("!! FIX - ACCEPTED BROKEN STAGES !!\n");
+		ok = false;
+	}
+	free_memory_outputs(&files);
+	delete[] crafted_data;
+
+	// values outside the name tables are shown as ?
+	crafted_data = test_modified_replay(input.data, input.size, test_break_names, crafted_size);
+	const char *const unknown_names[] = {"Rank: ?\n", "Last stage: ?\n", "Color mode: ?\n", "Screen mode: ?\n", "Frameskip: ?\n", "Input latency: ?\n", "Stage: ?\n"};
+	bool names_ok = crafted_data && test_stdio_command(false, crafted_data, crafted_size, files, TH128_DECODE_TEXT) == 0 && files.num_outputs == 1;
+	if (names_ok) {
+		char *text = new char[files.outputs[0].size + 1];
+		memcpy(text, files.outputs[0].data, files.outputs[0].size);
+		text[files.outputs[0].size] = '\0';
+		for (size_t i = 0; i < sizeof(unknown_names) / sizeof(*unknown_names) && names_ok; i++) {
+			names_ok = strstr(text, unknown_names[i]) != NULL;
+		}
+		delete[] text;
+	}
+	if (!names_ok) {
+		printf("!! DECODE - DIDN'T HANDLE UNKNOWN VALUES !!\n");
+		ok = false;
+	}
+	free_memory_outputs(&files);
+	delete[] crafted_data;
+
+	const th128_replay_header_t *header = (const th128_replay_header_t *)input.data;
+	if (test_stdio_command(false, input.data, input.size, files) != 0 || files.num_outputs != 1
+		|| files.outputs[0].size != header->uncompressed_data_size) {
+		printf("!! DECODE - DIDN'T WRITE THE DECODED DATA !!\n");
+		ok = false;
+	}
+	free_memory_outputs(&files);
+
+	close_input_file(&input);
+	printf("stdin and stdout tested.\n");
+	return ok;
+}
+
+
+// Test that a file skipped by its command doesn't count as failed in the stats, while one that just fails does
+bool test_skipped_stats() {
+	file_stats_t stats[2];
+	stats_begin_file(&stats[0]);
+	stats_skip_file();
+	stats_end_file(false);
+	stats_begin_file(&stats[1]);
+	stats_end_file(false);
+	bool ok = stats[0].num_failed == 0 && stats[0].num_skipped == 1 && stats[1].num_failed == 1 && stats[1].num_skipped == 0;
+	if (!ok) {
+		printf("!! SKIPPED FILE COUNTED AS FAILED !!\n");
+	}
+	printf("Skipped files tested.\n");
+	return ok;
+}
+
+
+// Test that a th10 replay, built here from a made up payload, gets its data decoded with the th10 layers, and that
+// the th128 commands tell which game it's from
+bool test_other_game() {
+	const char *file = "th10_test.rpy";
+	const uint32_t payload_size = 0x1234;
+	uint8_t *payload = new uint8_t[payload_size];
+	for (uint32_t i = 0; i < payload_size; i++) {
+		payload[i] = (i / 7) % 13 + i % 3;
+	}
+	uint32_t compressed_size;
+	uint8_t *compressed_data = compress(payload, payload_size, compressed_size);
+
+	// encrypting undoes the decrypt layers in reverse order
+	cipher_layer_t layers[GAME_CIPHER_LAYERS];
+	for (int i = 0; i < GAME_CIPHER_LAYERS; i++) {
+		layers[i] = game_th10.decrypt_layers[GAME_CIPHER_LAYERS - 1 - i];
+	}
+	cipher_plan_t *plan = new cipher_plan_t;
+	cipher_plan_init(plan, layers, GAME_CIPHER_LAYERS, true);
+	cipher_plan_apply(plan, compressed_data, compressed_size);
+	delete plan;
+
+	uint64_t file_size = game_th10.header_size + compressed_size;
+	uint8_t *file_data = new uint8_t[file_size]();
+	const uint32_t user_data_offset = (uint32_t)file_size;
+	memcpy(file_data, &game_th10.magic, sizeof(uint32_t));
+	memcpy(file_data + game_th10.user_data_offset_field, &user_data_offset, sizeof(uint32_t));
+	memcpy(file_data + game_th10.compressed_size_field, &compressed_size, sizeof(uint32_t));
+	memcpy(file_data + game_th10.uncompressed_size_field, &payload_size, sizeof(uint32_t));
+	memcpy(file_data + game_th10.header_size, compressed_data, compressed_size);
+	delete[] compressed_data;
+
+	memory_files_t files = {};
+	files.input_path = file;
+	files.input_data = file_data;
+	files.input_size = file_size;
+	log_buffer_t log = {NULL, 0, 0};
+	log_set_buffer(&log);
+	set_memory_files(&files);
+
+	bool ok = true;
+	if (!th128_decode_replay_file(file, TH128_DECODE_TEXT) || files.num_outputs != 1 || files.outputs[0].size != payload_size
+		|| memcmp(files.outputs[0].data, payload, payload_size)) {
+		printf("!! TH10 REPLAY DECODED WRONG !!\n");
+		ok = false;
+	}
+
+	th128_replay_file_t replay;
+	if (th128_open_replay_file(file, &replay) != TH128_ERROR_NOT_A_REPLAY || replay.other_game != &game_th10) {
+		printf("!! TH10 REPLAY NOT RECOGNIZED !!\n");
+		ok = false;
+	}
+
+	set_memory_files(NULL);
+	log_set_buffer(NULL);
+	delete[] log.data;
+	free_memory_outputs(&files);
+	delete[] file_data;
+	delete[] payload;
+	printf("Other games tested.\n");
+	return ok;
+}
+
+
+// Fills a ustar header block, with the size in octal or base-256
+void test_tar_header(uint8_t *block, const char *name, const char *prefix, char type, uint64_t size, bool base256) {
+	memset(block, 0, TAR_BLOCK_SIZE);
+	memcpy(block, name, strlen(name));
+	memcpy(block + 0x64, "0000644", 8);
+	block[0x9c] = type;
+	memcpy(block + 0x101, "ustar\0" "00", 8);
+	memcpy(block + 0x159, prefix, strlen(prefix));
+	if (base256) {
+		block[0x7c] = 0x80;
+		for (int i = 11; i > 0; i--, size >>= 8) {
+			block[0x7c + i] = size & 0xff;
+		}
+	} else {
+		snprintf((char *)block + 0x7c, 12, "%011llo", (unsigned long long)size);
+	}
+	memset(block + 0x94, ' ', 8);
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+		sum += block[i];
+	}
+	snprintf((char *)block + 0x94, 8, "%06o", sum);
+}
+
+
+// Writes an entry with a hand made header, padding the data to whole blocks
+void test_tar_add(FILE *fp, const char *name, const char *prefix, char type, const void *data, uint64_t size, bool base256) {
+	static const uint8_t padding[TAR_BLOCK_SIZE] = {};
+	uint8_t block[TAR_BLOCK_SIZE];
+	test_tar_header(block, name, prefix, type, size, base256);
+	fwrite(block, 1, TAR_BLOCK_SIZE, fp);
+	fwrite(data, 1, size, fp);
+	fwrite(padding, 1, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE, fp);
+}
+
+
+// Reads the next entry and checks its name and size, and its data unless data is NULL (then it's skipped)
+bool test_tar_next(FILE *fp, const char *name, const void *data, uint64_t size) {
+	tar_entry_t entry;
+	bool end;
+	if (!tar_read_header(fp, &entry, end) || end) {
+		return false;
+	}
+	bool ok = !strcmp(entry.name, name) && entry.size == size;
+	if (data) {
+		ok = tar_read_data(fp, &entry) && ok && !memcmp(entry.data, data, size);
+	} else {
+		ok = tar_skip_data(fp, &entry) && ok;
+	}
+	tar_free_entry(&entry);
+	return ok;
+}
+
+
+bool test_tar_fix(const char *file, void *context) {
+	(void)context;
+	return th128_fix_replay_file(file) == TH128_FIX_FIXED;
+}
+
+
+// Test that the tar reader finds the names of ustar prefixes, GNU long names and pax headers, ignoring pax records
+// with a broken length, reads base-256 sizes and skips data, and that fixing an archive with --pass-through copies
+// everything but the bugged replay, which is replaced by the fixed one, also after a replay with broken stages
+bool test_tar(const char *clean_file, const char *bugged_file) {
+	log_buffer_t log = {NULL, 0, 0};
+	log_set_buffer(&log);
+	uint8_t template_block[TAR_BLOCK_SIZE];
+	test_tar_header(template_block, "template", "", '0', 0, false);
+	tar_entry_t original = {template_block, TAR_BLOCK_SIZE, NULL, '0', NULL, 0};
+	uint8_t big_data[700];
+	for (uint32_t i = 0; i < sizeof(big_data); i++) {
+		big_data[i] = (uint8_t)(i * 7);
+	}
+	char long_name[151];
+	memset(long_name, 'n', 150);
+	long_name[150] = '\0';
+	const char pax_data[] = "26 path=pax/long/name.txt\n";
+	const char broken_pax_data[] = "1 path=broken/name.txt\n";
+
+	FILE *fp = tmpfile();
+	bool ok = fp != NULL;
+	if (ok) {
+		test_tar_add(fp, "a.txt", "some/dir", '0', "hello", 5, false);
+		test_tar_add(fp, "big.bin", "", '0', big_data, sizeof(big_data), true);
+		test_tar_add(fp, "skipped.bin", "", '0', big_data, sizeof(big_data), false);
+		tar_write_file(fp, &original, long_name, (const uint8_t *)"long", 4);
+		test_tar_add(fp, "PaxHeader", "", 'x', pax_data, strlen(pax_data), false);
+		test_tar_add(fp, "short.txt", "", '0', "pax", 3, false);
+		test_tar_add(fp, "PaxHeader", "", 'x', broken_pax_data, strlen(broken_pax_data), false);
+		test_tar_add(fp, "fallback.txt", "", '0', "", 0, false);
+		tar_write_end(fp);
+		rewind(fp);
+		tar_entry_t entry;
+		bool end = false;
+		ok = test_tar_next(fp, "some/dir/a.txt", "hello", 5) && test_tar_next(fp, "big.bin", big_data, sizeof(big_data))
+			&& test_tar_next(fp, "skipped.bin", NULL, sizeof(big_data)) && test_tar_next(fp, long_name, "long", 4)
+			&& test_tar_next(fp, "pax/long/name.txt", "pax", 3) && test_tar_next(fp, "fallback.txt", "", 0)
+			&& tar_read_header(fp, &entry, end) && end;
+		fclose(fp);
+	}
+	if (!ok) {
+		printf("!! TAR ENTRIES READ WRONG !!\n");
+	}
+
+	// skipping the data of a truncated entry fails
+	fp = tmpfile();
+	if (fp) {
+		test_tar_add(fp, "cut.bin", "", '0', big_data, sizeof(big_data), false);
+		fflush(fp);
+		rewind(fp);
+		uint8_t block[TAR_BLOCK_SIZE];
+		test_tar_header(block, "cut.bin", "", '0', 4096, false);
+		fwrite(block, 1, TAR_BLOCK_SIZE, fp);
+		rewind(fp);
+		if (test_tar_next(fp, "cut.bin", NULL, 4096)) {
+			printf("!! TRUNCATED TAR ENTRY SKIPPED !!\n");
+			ok = false;
+		}
+		fclose(fp);
+	}
+
+	// round trip with --pass-through
+	input_file_t clean, bugged;
+	if (!open_input_file(clean_file, &clean)) {
+		log_set_buffer(NULL);
+		delete[] log.data;
+		return false;
+	}
+	if (!open_input_file(bugged_file, &bugged)) {
+		close_input_file(&clean);
+		log_set_buffer(NULL);
+		delete[] log.data;
+		return false;
+	}
+	memory_files_t fixed_files;
+	int fix_result = test_stdio_command(true, bugged.data, bugged.size, fixed_files);
+	log_set_buffer(&log);
+	// a replay with broken stages fails on its own, the entries after it still come out
+	uint64_t corrupt_size = 0;
+	uint8_t *corrupt_data = test_modified_replay(bugged.data, bugged.size, test_break_stages, corrupt_size);
+	const char *const in_path = "tar_test.tar";
+	const char *const out_path = "tar_test_out.tar";
+	fp = fopen(in_path, "wb");
+	if (fp) {
+		tar_write_file(fp, &original, "readme.txt", (const uint8_t *)"read me", 7);
+		tar_write_file(fp, &original, "replays/clean.rpy", clean.data, clean.size);
+		tar_write_file(fp, &original, "replays/bugged.rpy", bugged.data, bugged.size);
+		tar_write_file(fp, &original, "replays/corrupt.rpy", corrupt_data, corrupt_size);
+		tar_write_file(fp, &original, "notes.txt", (const uint8_t *)"", 0);
+		tar_write_end(fp);
+		fclose(fp);
+	}
+	tar_options_t options = {in_path, out_path, true, 2};
+	bool run_ok = false;
+	uint32_t count = fp ? run_tar(options, test_tar_fix, NULL, false, run_ok) : 0;
+	fp = fopen(out_path, "rb");
+	bool round_trip_ok = fp && run_ok && count == 1 && fix_result == TH128_FIX_FIXED && fixed_files.num_outputs == 1 && corrupt_data;
+	if (round_trip_ok) {
+		tar_entry_t entry;
+		bool end = false;
+		round_trip_ok = test_tar_next(fp, "readme.txt", "read me", 7) && test_tar_next(fp, "replays/clean.rpy", clean.data, clean.size)
+			&& test_tar_next(fp, "replays/bugged.rpy.fixed.rpy", fixed_files.outputs[0].data, fixed_files.outputs[0].size)
+			&& test_tar_next(fp, "replays/corrupt.rpy", corrupt_data, corrupt_size) && test_tar_next(fp, "notes.txt", "", 0) && tar_read_header(fp, &entry, end) && end;
+	}
+	if (fp) {
+		fclose(fp);
+	}
+	if (!round_trip_ok) {
+		printf("!! TAR PASS-THROUGH ROUND TRIP FAILED !!\n");
+	}
+	free_memory_outputs(&fixed_files);
+	delete[] corrupt_data;
+	close_input_file(&clean);
+	close_input_file(&bugged);
+	remove(in_path);
+	remove(out_path);
+	log_set_buffer(NULL);
+	delete[] log.data;
+	printf("Tar archives tested.\n");
+	return ok && round_trip_ok;
+}
+
+
+#ifdef __linux__
+// Test that a replay isn't queued again while it's queued or running, that one that got events while running is
+// queued again once it's done, and that the workers' replays aren't mapped
+bool test_watch_queue(const char *file) {
+	watch_options_t options = {1, NULL, 0};
+	watch_t watch;
+	watch.options = &options;
+	watch.stopping = false;
+	std::deque<watch_task_t> pending;
+	bool ok = watch_is_replay("th128_01.rpy") && !watch_is_replay("th128_01.rpy.fixed.rpy") && !watch_is_replay("score.dat");
+
+	// events of a replay waiting for its debounce time are merged
+	watch_add_pending(pending, "dir", "a.rpy", 0);
+	watch_add_pending(pending, "dir", "a.rpy", 1);
+	watch_add_pending(pending, "dir", "b.rpy", 1);
+	ok = ok && pending.size() == 2;
+	watch_dispatch(&watch, pending);
+	ok = ok && pending.empty() && watch.tasks.size() == 2;
+
+	// a queued replay only gets its event time updated
+	watch_add_pending(pending, "dir", "a.rpy", 2);
+	watch_dispatch(&watch, pending);
+	ok = ok && watch.tasks.size() == 2 && watch.tasks[0].event_time == 2;
+
+	// a running replay is queued again, once, when its task is done
+	watch_task_t task;
+	ok = ok && watch_take_task(&watch, task) && !strcmp(task.path, "dir/a.rpy") && watch.running.size() == 1;
+	for (int i = 3; i <= 4; i++) {
+		watch_add_pending(pending, "dir", "a.rpy", i);
+		watch_dispatch(&watch, pending);
+	}
+	ok = ok && watch.tasks.size() == 1 && watch.again.size() == 1 && watch.again[0].event_time == 4;
+	watch_finish_task(&watch, task);
+	ok = ok && watch.running.empty() && watch.again.empty() && watch.tasks.size() == 2 && !strcmp(watch.tasks[1].path, "dir/a.rpy");
+
+	watch.stopping = true;
+	while (watch_take_task(&watch, task)) {
+		watch_finish_task(&watch, task);
+	}
+	ok = ok && watch.tasks.empty() && watch.running.empty();
+
+	set_input_mapping(false);
+	input_file_t input;
+	if (open_input_file(file, &input)) {
+		ok = ok && !input.mapped && input.size > 0;
+		close_input_file(&input);
+	}
+	set_input_mapping(true);
+
+	printf(ok ? "Watch queue tested.\n" : "!! WATCH QUEUE FAILED !!\n");
+	return ok;
+}
+#endif
+
+
 bool th128_decrypt_replay_file(const char *file) {
 	// Read file
-	FILE *fp = fopen(file, "rb");
-	if (!fp) {
-		perror("Error");
+	input_file_t input;
+	if (!open_input_file(file, &input)) {
 		return false;
 	}
-
-	fseek(fp, 0L, SEEK_END);
-	uint32_t file_size = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
-	
+	uint32_t file_size = input.size;
 	uint8_t *file_data = new uint8_t[file_size];
-	fread(file_data, file_size, 1, fp);
-	fclose(fp);
+	memcpy(file_data, input.data, file_size);
+	close_input_file(&input);
 	
 	// Parse file header
 	th128_replay_header_t *header = (th128_replay_header_t *)file_data;
@@ -211,6 +1289,19 @@ const char *const files[] = {
 
 
 int main() {
+	test_cipher_plans();
+	printf("\n");
+	test_replay_index(files[0], files[1]);
+	test_stdio_fix(files[0]);
+	test_stdio_fix(files[1]);
+	test_other_game();
+	test_skipped_stats();
+	test_tar(files[0], files[1]);
+#ifdef __linux__
+	test_watch_queue(files[0]);
+#endif
+	printf("\n");
+
 	for (size_t i = 0; i < sizeof(files) / sizeof(*files); i++) {
 		printf("Processing %s\n", files[i]);
 		// th128_fix_replay_file(files[i]);
@@ -0,0 +1,431 @@
+#include "th128_analyze.h"
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "th128_parse.h"
+#include "stats.h"
+#include "utils.h"
+
+
+/*
+	Input analysis:
+
+	Every count is a function of the key words of single frames, so they're counted without looking at the frames
+	around them. The quit marker is the exception: the game only writes it as the last frames of a stage, when a
+	replay of an unfinished game is saved, so it's taken off the end before counting the rest.
+
+	The inputs are 6 byte records, so 8 of them fill 3 vectors of 8 key words, and in each vector the words of
+	every field are always in the same lanes. Masking those lanes and OR-ing the 3 vectors together gives one
+	vector per field with the words of the 8 frames, in a different order for each field, which doesn't matter
+	for counting. The pressed and released words are split into their low and high bytes, so a compare and a
+	subtract count a key in both at once into 8-bit lane counters. The directions of 16 frames are packed into
+	bytes and counted in a second pass over a chunk of them: frames moving up, down, left and right at all and
+	diagonally, from which the 9 directions follow. The lane counters are added to the totals once per chunk,
+	before they can overflow.
+*/
+
+constexpr th128_direction_t movement_direction(const uint8_t *movement) {
+	return movement == char_codes::up ? TH128_DIRECTION_UP
+		: movement == char_codes::down ? TH128_DIRECTION_DOWN
+		: movement == char_codes::left ? TH128_DIRECTION_LEFT
+		: movement == char_codes::right ? TH128_DIRECTION_RIGHT
+		: movement == char_codes::up_left ? TH128_DIRECTION_UP_LEFT
+		: movement == char_codes::up_right ? TH128_DIRECTION_UP_RIGHT
+		: movement == char_codes::down_left ? TH128_DIRECTION_DOWN_LEFT
+		: movement == char_codes::down_right ? TH128_DIRECTION_DOWN_RIGHT
+		: TH128_DIRECTION_NONE;
+}
+
+// Direction of each combination of the up, down, left and right bits of th128_key_data_t
+struct direction_table_t {
+	uint8_t directions[16];
+
+	constexpr direction_table_t() : directions() {
+		for (uint32_t i = 0; i < 16; i++) {
+			directions[i] = movement_direction(char_codes::movement[i]);
+		}
+	}
+};
+
+constexpr direction_table_t direction_table;
+
+
+const uint16_t TH128_QUIT_MARKER = 0xffff;
+
+
+void th128_add_input_counts(th128_input_counts_t &sum, const th128_input_counts_t &counts) {
+	// every field is a uint32_t count
+	uint32_t *sum_fields = (uint32_t *)&sum;
+	const uint32_t *fields = (const uint32_t *)&counts;
+	for (uint32_t i = 0; i < sizeof(th128_input_counts_t) / sizeof(uint32_t); i++) {
+		sum_fields[i] += fields[i];
+	}
+}
+
+
+double th128_actions_per_minute(const th128_input_counts_t &counts) {
+	return counts.num_frames ? counts.actions * (double)TH128_FRAMES_PER_MINUTE / counts.num_frames : 0;
+}
+
+
+// Counts the quit marker at the end of the inputs, returns the amount of inputs before it
+uint32_t th128_count_quit_marker(const th128_input_data_t *inputs, uint32_t num_inputs, th128_input_counts_t &counts) {
+	while (num_inputs > 0 && inputs[num_inputs - 1].holding.raw == TH128_QUIT_MARKER) {
+		num_inputs--;
+		counts.quit_frames++;
+	}
+	return num_inputs;
+}
+
+
+void th128_count_inputs_tail(const th128_input_data_t *inputs, uint32_t num_inputs, th128_input_counts_t &counts) {
+	for (uint32_t i = 0; i < num_inputs; i++) {
+		uint32_t holding = inputs[i].holding.raw;
+		uint32_t pressed = inputs[i].pressed.raw;
+		uint32_t released = inputs[i].released.raw;
+		counts.bombs += (pressed >> 1) & 1;
+		counts.shot_presses += pressed & 1;
+		counts.shot_releases += released & 1;
+		counts.focus_presses += (pressed >> 3) & 1;
+		counts.focus_releases += (released >> 3) & 1;
+		counts.autoshoot_presses += (pressed >> 9) & 1;
+		counts.autoshoot_releases += (released >> 9) & 1;
+		counts.actions += __builtin_popcount(pressed & TH128_KEY_MASK);
+		counts.focus_frames += (holding >> 3) & 1;
+		counts.idle_frames += holding == 0;
+		counts.direction_frames[direction_table.directions[(holding >> 4) & 0xf]]++;
+	}
+	counts.num_frames += num_inputs;
+}
+
+
+// Adds the counts of the inputs to counts, one frame at a time. Used for the inputs the vectors don't cover,
+// and to check the vector code.
+void th128_count_inputs_scalar(const th128_input_data_t *inputs, uint32_t num_inputs, th128_input_counts_t &counts) {
+	num_inputs = th128_count_quit_marker(inputs, num_inputs, counts);
+	th128_count_inputs_tail(inputs, num_inputs, counts);
+}
+
+
+#ifdef __SSE2__
+// Inputs in the 3 vectors of a block, and blocks per step (their directions fill a vector of bytes)
+const uint32_t ANALYZE_BLOCK_INPUTS = 8;
+const uint32_t ANALYZE_STEP_INPUTS = ANALYZE_BLOCK_INPUTS * 2;
+// Steps before the 8-bit lane counters, which count once per block, could overflow
+const uint32_t ANALYZE_CHUNK_STEPS = 127;
+
+// Frames moving in each direction at all (left includes up-left and down-left) or diagonally, which is enough
+// to tell how many moved in each of the 9 directions
+enum analyze_part_t {
+	ANALYZE_PART_UP,
+	ANALYZE_PART_DOWN,
+	ANALYZE_PART_LEFT,
+	ANALYZE_PART_RIGHT,
+	ANALYZE_PART_UP_LEFT,
+	ANALYZE_PART_UP_RIGHT,
+	ANALYZE_PART_DOWN_LEFT,
+	ANALYZE_PART_DOWN_RIGHT,
+	NUM_ANALYZE_PARTS
+};
+
+
+// Opposite keys are resolved like in the game: left wins over right, and up wins over down only when also moving
+// sideways. Checks that this gives the same directions as the table.
+constexpr bool direction_rule_matches_table() {
+	for (uint32_t i = 0; i < 16; i++) {
+		bool left = i & 4;
+		bool right = (i & 8) && !left;
+		bool up = (i & 1) && !((i & 2) && !(i & 0xc));
+		bool down = (i & 2) && !up;
+		th128_direction_t direction = up ? (left ? TH128_DIRECTION_UP_LEFT : right ? TH128_DIRECTION_UP_RIGHT : TH128_DIRECTION_UP)
+			: down ? (left ? TH128_DIRECTION_DOWN_LEFT : right ? TH128_DIRECTION_DOWN_RIGHT : TH128_DIRECTION_DOWN)
+			: left ? TH128_DIRECTION_LEFT : right ? TH128_DIRECTION_RIGHT : TH128_DIRECTION_NONE;
+		if (direction_table.directions[i] != direction) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static_assert(direction_rule_matches_table(), "the vectors must resolve directions like the game");
+
+
+// Adds 1 to the 8-bit lanes of counter where the bit is set in keys
+inline void count_bits_epi8(__m128i &counter, __m128i keys, __m128i bits) {
+	counter = _mm_sub_epi8(counter, _mm_cmpeq_epi8(_mm_and_si128(keys, bits), bits));
+}
+
+
+// Bits set in the direction bits (4 to 7) of each 16-bit lane: 2 bits are added in each of 2 fields, then the fields
+inline __m128i popcount_directions_epi16(__m128i keys) {
+	const __m128i field_mask = _mm_set1_epi16(0x5);
+	const __m128i low_field = _mm_set1_epi16(0x3);
+	__m128i pairs = _mm_add_epi16(_mm_and_si128(_mm_srli_epi16(keys, 4), field_mask), _mm_and_si128(_mm_srli_epi16(keys, 5), field_mask));
+	return _mm_add_epi16(_mm_and_si128(pairs, low_field), _mm_srli_epi16(pairs, 2));
+}
+
+
+// Sum of the 8-bit lanes
+inline uint32_t sum_epu8(__m128i x) {
+	__m128i sums = _mm_sad_epu8(x, _mm_setzero_si128());
+	return _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+}
+
+
+// Sum of the 16-bit lanes
+inline uint32_t sum_epu16(__m128i x) {
+	const __m128i low_bytes = _mm_set1_epi16(0xff);
+	return sum_epu8(_mm_and_si128(x, low_bytes)) + (sum_epu8(_mm_srli_epi16(x, 8)) << 8);
+}
+
+
+// Counts the direction parts of the directions of a chunk (one byte per frame)
+inline void count_direction_parts(const __m128i *chunk_directions, uint32_t chunk_steps, uint32_t *part_totals) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i up_bit = _mm_set1_epi8(1);
+	const __m128i down_bit = _mm_set1_epi8(2);
+	const __m128i left_bit = _mm_set1_epi8(4);
+	const __m128i right_bit = _mm_set1_epi8(8);
+	const __m128i sideways_bits = _mm_set1_epi8(0xc);
+	__m128i counters[NUM_ANALYZE_PARTS];
+	for (uint32_t i = 0; i < NUM_ANALYZE_PARTS; i++) {
+		counters[i] = zero;
+	}
+	for (uint32_t step = 0; step < chunk_steps; step++) {
+		__m128i directions = chunk_directions[step];
+		__m128i up = _mm_cmpeq_epi8(_mm_and_si128(directions, up_bit), up_bit);
+		__m128i down = _mm_cmpeq_epi8(_mm_and_si128(directions, down_bit), down_bit);
+		__m128i left = _mm_cmpeq_epi8(_mm_and_si128(directions, left_bit), left_bit);
+		__m128i right = _mm_andnot_si128(left, _mm_cmpeq_epi8(_mm_and_si128(directions, right_bit), right_bit));
+		__m128i not_sideways = _mm_cmpeq_epi8(_mm_and_si128(directions, sideways_bits), zero);
+		up = _mm_andnot_si128(_mm_and_si128(down, not_sideways), up);
+		down = _mm_andnot_si128(up, down);
+		counters[ANALYZE_PART_UP] = _mm_sub_epi8(counters[ANALYZE_PART_UP], up);
+		counters[ANALYZE_PART_DOWN] = _mm_sub_epi8(counters[ANALYZE_PART_DOWN], down);
+		counters[ANALYZE_PART_LEFT] = _mm_sub_epi8(counters[ANALYZE_PART_LEFT], left);
+		counters[ANALYZE_PART_RIGHT] = _mm_sub_epi8(counters[ANALYZE_PART_RIGHT], right);
+		counters[ANALYZE_PART_UP_LEFT] = _mm_sub_epi8(counters[ANALYZE_PART_UP_LEFT], _mm_and_si128(up, left));
+		counters[ANALYZE_PART_UP_RIGHT] = _mm_sub_epi8(counters[ANALYZE_PART_UP_RIGHT], _mm_and_si128(up, right));
+		counters[ANALYZE_PART_DOWN_LEFT] = _mm_sub_epi8(counters[ANALYZE_PART_DOWN_LEFT], _mm_and_si128(down, left));
+		counters[ANALYZE_PART_DOWN_RIGHT] = _mm_sub_epi8(counters[ANALYZE_PART_DOWN_RIGHT], _mm_and_si128(down, right));
+	}
+	for (uint32_t i = 0; i < NUM_ANALYZE_PARTS; i++) {
+		part_totals[i] += sum_epu8(counters[i]);
+	}
+}
+
+
+// Splits a block of 8 inputs into the words of each field (holding, pressed, released). Lane l of the vector v
+// of a block holds a word of the field (8 * v + l) % 3, so each field is in the lanes of lane_masks[(field - 2 * v) % 3],
+// where lane_masks[k] has the lanes l with l % 3 == k.
+inline void load_block(const __m128i *vectors, const __m128i *lane_masks, __m128i *fields) {
+	__m128i a = _mm_loadu_si128(vectors);
+	__m128i b = _mm_loadu_si128(vectors + 1);
+	__m128i c = _mm_loadu_si128(vectors + 2);
+	for (uint32_t field = 0; field < 3; field++) {
+		fields[field] = _mm_or_si128(_mm_or_si128(_mm_and_si128(a, lane_masks[field]), _mm_and_si128(b, lane_masks[(field + 1) % 3])),
+			_mm_and_si128(c, lane_masks[(field + 2) % 3]));
+	}
+}
+
+
+// Counts whole steps of inputs, returns the amount of inputs counted
+uint32_t th128_count_inputs_sse2(const th128_input_data_t *inputs, uint32_t num_inputs, th128_input_counts_t &counts) {
+	__m128i lane_masks[3];
+	for (uint32_t k = 0; k < 3; k++) {
+		alignas(16) uint16_t lanes[8];
+		for (uint32_t lane = 0; lane < 8; lane++) {
+			lanes[lane] = lane % 3 == k ? 0xffff : 0;
+		}
+		lane_masks[k] = _mm_load_si128((const __m128i *)lanes);
+	}
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low_bytes = _mm_set1_epi16(0xff);
+	// bits in both bytes of a lane of the low or high bytes of the pressed and released keys
+	const __m128i shot_bits = _mm_set1_epi16(0x0101);
+	const __m128i bomb_bits = _mm_set1_epi16(0x0202);
+	const __m128i focus_bits = _mm_set1_epi16(0x0808);
+	const __m128i autoshoot_bits = _mm_set1_epi16(0x0202);
+	const __m128i direction_mask = _mm_set1_epi16(0xf);
+
+	uint32_t part_totals[NUM_ANALYZE_PARTS] = {};
+	// directions of the frames of each step of a chunk, one byte per frame
+	__m128i chunk_directions[ANALYZE_CHUNK_STEPS];
+	const __m128i *vectors = (const __m128i *)inputs;
+	uint32_t num_steps = num_inputs / ANALYZE_STEP_INPUTS;
+	for (uint32_t chunk_start = 0; chunk_start < num_steps; chunk_start += ANALYZE_CHUNK_STEPS) {
+		uint32_t chunk_steps = num_steps - chunk_start < ANALYZE_CHUNK_STEPS ? num_steps - chunk_start : ANALYZE_CHUNK_STEPS;
+		// presses in the low bytes and releases in the high bytes (bomb releases aren't used)
+		__m128i shot_counter = zero;
+		__m128i bomb_counter = zero;
+		__m128i focus_counter = zero;
+		__m128i autoshoot_counter = zero;
+		__m128i direction_presses_counter = zero;
+		__m128i focus_frames_counter = zero; // in the low bytes
+		__m128i idle_frames_counter = zero;
+
+		for (uint32_t step = 0; step < chunk_steps; step++) {
+			__m128i directions[2];
+			for (uint32_t block = 0; block < 2; block++) {
+				__m128i fields[3];
+				load_block(vectors, lane_masks, fields);
+				vectors += 3;
+				__m128i holding = fields[0];
+				__m128i pressed = fields[1];
+				__m128i released = fields[2];
+
+				// the same byte of pressed and released next to each other, to count both at once
+				__m128i low_keys = _mm_or_si128(_mm_and_si128(pressed, low_bytes), _mm_slli_epi16(released, 8));
+				__m128i high_keys = _mm_or_si128(_mm_srli_epi16(pressed, 8), _mm_andnot_si128(low_bytes, released));
+				count_bits_epi8(shot_counter, low_keys, shot_bits);
+				count_bits_epi8(bomb_counter, low_keys, bomb_bits);
+				count_bits_epi8(focus_counter, low_keys, focus_bits);
+				count_bits_epi8(autoshoot_counter, high_keys, autoshoot_bits);
+				direction_presses_counter = _mm_add_epi16(direction_presses_counter, popcount_directions_epi16(pressed));
+				count_bits_epi8(focus_frames_counter, holding, focus_bits);
+				idle_frames_counter = _mm_sub_epi16(idle_frames_counter, _mm_cmpeq_epi16(holding, zero));
+				directions[block] = _mm_and_si128(_mm_srli_epi16(holding, 4), direction_mask);
+			}
+			chunk_directions[step] = _mm_packus_epi16(directions[0], directions[1]);
+		}
+
+		uint32_t shot_presses = sum_epu8(_mm_and_si128(shot_counter, low_bytes));
+		uint32_t bombs = sum_epu8(_mm_and_si128(bomb_counter, low_bytes));
+		uint32_t focus_presses = sum_epu8(_mm_and_si128(focus_counter, low_bytes));
+		uint32_t autoshoot_presses = sum_epu8(_mm_and_si128(autoshoot_counter, low_bytes));
+		counts.shot_presses += shot_presses;
+		counts.shot_releases += sum_epu8(_mm_srli_epi16(shot_counter, 8));
+		counts.bombs += bombs;
+		counts.focus_presses += focus_presses;
+		counts.focus_releases += sum_epu8(_mm_srli_epi16(focus_counter, 8));
+		counts.autoshoot_presses += autoshoot_presses;
+		counts.autoshoot_releases += sum_epu8(_mm_srli_epi16(autoshoot_counter, 8));
+		counts.actions += shot_presses + bombs + focus_presses + autoshoot_presses + sum_epu16(direction_presses_counter);
+		counts.focus_frames += sum_epu8(_mm_and_si128(focus_frames_counter, low_bytes));
+		counts.idle_frames += sum_epu16(idle_frames_counter);
+
+		count_direction_parts(chunk_directions, chunk_steps, part_totals);
+	}
+
+	uint32_t num_counted = num_steps * ANALYZE_STEP_INPUTS;
+	uint32_t *direction_frames = counts.direction_frames;
+	uint32_t up_left = part_totals[ANALYZE_PART_UP_LEFT];
+	uint32_t up_right = part_totals[ANALYZE_PART_UP_RIGHT];
+	uint32_t down_left = part_totals[ANALYZE_PART_DOWN_LEFT];
+	uint32_t down_right = part_totals[ANALYZE_PART_DOWN_RIGHT];
+	uint32_t left = part_totals[ANALYZE_PART_LEFT] - up_left - down_left;
+	uint32_t right = part_totals[ANALYZE_PART_RIGHT] - up_right - down_right;
+	direction_frames[TH128_DIRECTION_UP_LEFT] += up_left;
+	direction_frames[TH128_DIRECTION_UP_RIGHT] += up_right;
+	direction_frames[TH128_DIRECTION_DOWN_LEFT] += down_left;
+	direction_frames[TH128_DIRECTION_DOWN_RIGHT] += down_right;
+	direction_frames[TH128_DIRECTION_UP] += part_totals[ANALYZE_PART_UP] - up_left - up_right;
+	direction_frames[TH128_DIRECTION_DOWN] += part_totals[ANALYZE_PART_DOWN] - down_left - down_right;
+	direction_frames[TH128_DIRECTION_LEFT] += left;
+	direction_frames[TH128_DIRECTION_RIGHT] += right;
+	direction_frames[TH128_DIRECTION_NONE] += num_counted - part_totals[ANALYZE_PART_UP] - part_totals[ANALYZE_PART_DOWN] - left - right;
+	counts.num_frames += num_counted;
+	return num_counted;
+}
+#endif
+
+
+// Adds the counts of the inputs of a stage to counts
+void th128_count_inputs(const th128_input_data_t *inputs, uint32_t num_inputs, th128_input_counts_t &counts) {
+	num_inputs = th128_count_quit_marker(inputs, num_inputs, counts);
+	uint32_t num_counted = 0;
+#ifdef __SSE2__
+	num_counted = th128_count_inputs_sse2(inputs, num_inputs, counts);
+#endif
+	th128_count_inputs_tail(inputs + num_counted, num_inputs - num_counted, counts);
+}
+
+
+void th128_analyze_replay_data(const th128_data_view_t *view, th128_analysis_t *analysis) {
+	memset(analysis, 0, sizeof(th128_analysis_t));
+	analysis->num_stages = view->num_stages;
+	for (uint32_t i = 0; i < view->num_stages; i++) {
+		const th128_stage_view_t &stage = view->stages[i];
+		analysis->stage_ids[i] = stage.header->stage;
+		th128_count_inputs(stage.inputs, stage.num_inputs, analysis->stages[i]);
+		th128_add_input_counts(analysis->total, analysis->stages[i]);
+	}
+}
+
+
+/*
+	Printing:
+
+	One row per stage and one for the whole replay, with the presses of each key and how much of the time focus
+	was held or no key was, followed by the share of the time spent moving in each direction.
+*/
+
+inline double percentage(uint32_t part, uint32_t whole) {
+	return whole ? part * 100.0 / whole : 0;
+}
+
+
+void th128_print_input_counts_header() {
+	log_printf("%-8s %8s %7s %6s %6s %6s %6s %8s %7s %5s\n", "", "Frames", "APM", "Bombs", "Shot", "Focus", "Auto", "Focused", "Idle", "Quit");
+}
+
+
+void th128_print_input_counts(const char *label, const th128_input_counts_t &counts) {
+	log_printf("%-8s %8u %7.1f %6u %6u %6u %6u %7.1f%% %6.1f%% %5u\n", label, counts.num_frames, th128_actions_per_minute(counts),
+		counts.bombs, counts.shot_presses, counts.focus_presses, counts.autoshoot_presses,
+		percentage(counts.focus_frames, counts.num_frames), percentage(counts.idle_frames, counts.num_frames), counts.quit_frames);
+}
+
+
+void th128_print_movement(const th128_input_counts_t &counts) {
+	log_printf("Movement:");
+	for (uint32_t i = 0; i < NUM_TH128_DIRECTIONS; i++) {
+		log_printf("%s %s %.1f%%", i ? "," : "", direction_names[i], percentage(counts.direction_frames[i], counts.num_frames));
+	}
+	log_printf("\n");
+}
+
+
+// Decodes a replay and prints the counts of its inputs, which are also returned in analysis
+bool th128_analyze_replay_file(const char *file, th128_analysis_t *analysis) {
+	th128_replay_file_t replay;
+	th128_error_t error = th128_open_replay_file(file, &replay);
+	if (error != TH128_OK) {
+		th128_log_error(error, &replay);
+		return false;
+	}
+	uint32_t compressed_size = replay.header->compressed_data_size;
+	uint32_t uncompressed_size = replay.header->uncompressed_data_size;
+
+	th128_workspace_t &workspace = th128_thread_workspace();
+	uint8_t *decrypted_data = workspace.decrypted_data.reserve(compressed_size);
+	uint8_t *decoded_data = workspace.decoded_data.reserve(uncompressed_size);
+	error = th128_decode_replay_data_to(replay.encoded_data, decrypted_data, compressed_size, decoded_data, uncompressed_size);
+	th128_close_replay_file(&replay);
+	if (error != TH128_OK) {
+		th128_log_error(error);
+		return false;
+	}
+
+	th128_data_view_t view;
+	error = th128_view_replay_data(decoded_data, uncompressed_size, &view);
+	if (error != TH128_OK) {
+		th128_log_error(error);
+		return false;
+	}
+	double start_time = stats_start();
+	th128_analyze_replay_data(&view, analysis);
+	stats_stop(STATS_ANALYZE, start_time);
+
+	th128_print_input_counts_header();
+	for (uint32_t i = 0; i < analysis->num_stages; i++) {
+		uint16_t stage_id = analysis->stage_ids[i];
+		th128_print_input_counts(table_name(stages, stage_id), analysis->stages[i]);
+	}
+	th128_print_input_counts("Total", analysis->total);
+	th128_print_movement(analysis->total);
+	return true;
+}
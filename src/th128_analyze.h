@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "types.h"
+#include "th128_core.h"
+#include "th128_view.h"
+
+
+// Direction a frame moves in, the same way the game resolves opposite keys (see char_codes::movement)
+enum th128_direction_t {
+	TH128_DIRECTION_NONE,
+	TH128_DIRECTION_UP,
+	TH128_DIRECTION_DOWN,
+	TH128_DIRECTION_LEFT,
+	TH128_DIRECTION_RIGHT,
+	TH128_DIRECTION_UP_LEFT,
+	TH128_DIRECTION_UP_RIGHT,
+	TH128_DIRECTION_DOWN_LEFT,
+	TH128_DIRECTION_DOWN_RIGHT,
+	NUM_TH128_DIRECTIONS
+};
+
+const char *const direction_names[] = {"none", "up", "down", "left", "right", "up-left", "up-right", "down-left", "down-right"};
+
+// Frames per minute of game time, replays are played at 60 FPS
+const uint32_t TH128_FRAMES_PER_MINUTE = 60 * 60;
+
+// Keys of th128_key_data_t that can be set: shoot, bomb, focus, the 4 directions and autoshoot
+const uint16_t TH128_KEY_MASK = 0x2fb;
+
+// Counts over the inputs of one stage, or the sum of several
+struct th128_input_counts_t {
+	uint32_t num_frames; // without the quit marker
+	uint32_t quit_frames; // end of input marker (all keys held) after saving a replay of an unfinished game
+	uint32_t bombs;
+	uint32_t shot_presses;
+	uint32_t shot_releases;
+	uint32_t focus_presses;
+	uint32_t focus_releases;
+	uint32_t autoshoot_presses;
+	uint32_t autoshoot_releases;
+	uint32_t actions; // key presses of any key, including directions
+	uint32_t focus_frames; // focus held
+	uint32_t idle_frames; // no key held
+	uint32_t direction_frames[NUM_TH128_DIRECTIONS];
+};
+
+struct th128_analysis_t {
+	uint16_t stage_ids[TH128_MAX_STAGES]; // th128_stage_header_t::stage
+	th128_input_counts_t stages[TH128_MAX_STAGES];
+	uint32_t num_stages;
+	th128_input_counts_t total;
+};
+
+
+void th128_add_input_counts(th128_input_counts_t &sum, const th128_input_counts_t &counts);
+double th128_actions_per_minute(const th128_input_counts_t &counts);
+void th128_count_inputs_scalar(const th128_input_data_t *inputs, uint32_t num_inputs, th128_input_counts_t &counts);
+void th128_count_inputs(const th128_input_data_t *inputs, uint32_t num_inputs, th128_input_counts_t &counts);
+void th128_analyze_replay_data(const th128_data_view_t *view, th128_analysis_t *analysis);
+void th128_print_input_counts_header();
+void th128_print_input_counts(const char *label, const th128_input_counts_t &counts);
+void th128_print_movement(const th128_input_counts_t &counts);
+bool th128_analyze_replay_file(const char *file, th128_analysis_t *analysis);
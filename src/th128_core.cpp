@@ -1,9 +1,13 @@
 #include "th128_core.h"
 
 #include <stdio.h>
+#include <string.h>
 
 #include "encryption.h"
 #include "compression.h"
+#include "utils.h"
+#include "stats.h"
+#include "th128_view.h"
 
 
 /*
@@ -11,34 +15,270 @@
 */ 
 
 
-uint8_t *th128_decode_replay_data(uint8_t *encoded_data, uint32_t compressed_size, uint32_t uncompressed_size) {
-	printf("Decrypting replay data... ");
-	decrypt(encoded_data, compressed_size, 0x800, 0x5e, 0xe7);
-	decrypt(encoded_data, compressed_size, 0x80, 0x7d, 0x36);
-	printf("done.\n");
+// Both layers applied in a single pass, the plans are kept around since their tables only depend on the length
+void th128_decrypt_data(const uint8_t *encoded_data, uint8_t *decrypted_data, uint32_t length) {
+	game_decrypt_data<game_th128>(encoded_data, decrypted_data, length);
+}
 
-	printf("Decompressing replay data... ");
-	uint8_t *decoded_data = new uint8_t[uncompressed_size];
-	uint32_t decompressed_size = decompress(encoded_data, decoded_data, compressed_size);
+
+void th128_encrypt_data(uint8_t *data, uint32_t length) {
+	game_encrypt_data<game_th128>(data, length);
+}
+
+
+const char *const th128_error_messages[] = {
+	"no error",
+	"not a th128 replay",
+	"replay file is truncated",
+	"buffer is too small",
+	"compressed data doesn't decompress to the expected size",
+	"replay data is broken",
+	"user data starts inside the encoded data",
+	"file couldn't be read",
+};
+
+
+const char *th128_error_message(th128_error_t error) {
+	return error < NUM_TH128_ERRORS ? th128_error_messages[error] : "unknown error";
+}
+
+
+// Prints an error for the commands that process replay files, the functions here only return them. Pass the
+// replay when it couldn't be opened, to tell which game it's from.
+void th128_log_error(th128_error_t error, const th128_replay_file_t *replay) {
+	if (error == TH128_ERROR_READ) {
+		return;
+	}
+	if (error == TH128_ERROR_NOT_A_REPLAY && replay && replay->other_game) {
+		log_printf("Not a th128 replay (it's a %s replay).\n", replay->other_game->name);
+	} else if (error == TH128_ERROR_NOT_A_REPLAY) {
+		log_printf("Not a th128 replay.\n");
+	} else {
+		log_printf("Error: %s.\n", th128_error_message(error));
+	}
+}
+
+
+// Workspace of the current thread, its buffers are freed when the thread ends
+th128_workspace_t &th128_thread_workspace() {
+	static thread_local th128_workspace_t workspace;
+	return workspace;
+}
+
+
+// Decrypts the encoded data into decrypted_data (can be the same buffer), then decompresses it into decoded_data
+th128_error_t th128_decode_replay_data_to(const uint8_t *encoded_data, uint8_t *decrypted_data, uint32_t compressed_size, uint8_t *decoded_data, uint32_t uncompressed_size) {
+	double start_time = stats_start();
+	th128_decrypt_data(encoded_data, decrypted_data, compressed_size);
+	stats_stop(STATS_DECRYPT, start_time);
+
+	start_time = stats_start();
+	bool terminated;
+	uint32_t decompressed_size = decompress(decrypted_data, decoded_data, compressed_size, uncompressed_size, &terminated);
+	stats_stop(STATS_DECOMPRESS, start_time);
+	if (decompressed_size != DECOMPRESS_OVERFLOW && !terminated) {
+		return TH128_ERROR_TRUNCATED;
+	}
 	if (decompressed_size != uncompressed_size) {
-		printf("error: got %d bytes but expected %d.\n", decompressed_size, uncompressed_size);
+		return TH128_ERROR_BAD_COMPRESSED_DATA;
+	}
+	stats_count_decoded_tokens(decrypted_data, compressed_size);
+
+	return TH128_OK;
+}
+
+
+// Same as th128_decode_replay_data_to, but returns a new buffer with the decoded data
+uint8_t *th128_decode_replay_data(const uint8_t *encoded_data, uint8_t *decrypted_data, uint32_t compressed_size, uint32_t uncompressed_size) {
+	uint8_t *decoded_data = new uint8_t[uncompressed_size];
+	if (th128_decode_replay_data_to(encoded_data, decrypted_data, compressed_size, decoded_data, uncompressed_size) != TH128_OK) {
+		delete[] decoded_data;
 		return NULL;
 	}
-	printf("done.\n");
-	
 	return decoded_data;
 }
 
 
-uint8_t *th128_encode_replay_data(uint8_t *data, uint32_t size, uint32_t &compressed_size) {
-	printf("Compressing replay data... ");
-	uint8_t *compressed_data = compress(data, size, compressed_size);
-	printf("done.\n");
-	
-	printf("Encrypting replay data... ");
-	encrypt(compressed_data, compressed_size, 0x80, 0x7d, 0x36);
-	encrypt(compressed_data, compressed_size, 0x800, 0x5e, 0xe7);
-	printf("done.\n");
+// Opens a replay file and checks that its sections fit in it
+th128_error_t th128_open_replay_file(const char *file, th128_replay_file_t *replay) {
+	replay->other_game = NULL;
+	if (!open_input_file(file, &replay->file)) {
+		return TH128_ERROR_READ;
+	}
+	return th128_load_replay_file(replay);
+}
+
+
+// Same as th128_open_replay_file, for a replay->file that's already open. The file is closed if it's not a valid replay.
+th128_error_t th128_load_replay_file(th128_replay_file_t *replay) {
+	th128_replay_view_t view;
+	th128_error_t error = th128_view_replay(replay->file.data, replay->file.size, &view);
+	replay->other_game = NULL;
+	if (error == TH128_ERROR_NOT_A_REPLAY) {
+		const game_descriptor_t *game = sniff_game(replay->file.data, replay->file.size);
+		replay->other_game = game != &game_th128 ? game : NULL;
+	}
+	if (error != TH128_OK) {
+		close_input_file(&replay->file);
+		return error;
+	}
+
+	replay->header = view.header;
+	replay->encoded_data = view.encoded_data.data;
+	replay->user_data = view.user_data.data;
+	replay->user_data_size = view.user_data.size;
+	return TH128_OK;
+}
+
+
+void th128_close_replay_file(th128_replay_file_t *replay) {
+	close_input_file(&replay->file);
+}
+
+
+/*
+	Streaming decoder:
+
+	The encoded data can be given in pieces of any size. Bytes are gathered until a whole cipher block is
+	available (the tail, which depends on the data size, is handled as a single block), which is then
+	decrypted and passed on to the LZSS stream decoder. Decoded data goes to the output callback.
+*/
+void th128_decode_stream_init(th128_decode_stream_t *stream, uint32_t compressed_size, uint32_t uncompressed_size, decompress_output_t output, void *user_data) {
+	cipher_plan_init(&stream->plan, game_th128.decrypt_layers, GAME_CIPHER_LAYERS, false);
+	cipher_plan_set_length(&stream->plan, compressed_size);
+	stream->block_size = 0;
+	stream->received = 0;
+	stream->uncompressed_size = uncompressed_size;
+	decompress_stream_init(&stream->decompressor, uncompressed_size, output, user_data);
+}
+
+
+// Returns DECOMPRESS_DONE once all the data has been decoded, further data is ignored.
+// Data that doesn't decode to exactly the expected size is an error, decompressor.terminated tells whether the
+// data terminator was found.
+decompress_status_t th128_decode_stream_push(th128_decode_stream_t *stream, const uint8_t *encoded_data, uint32_t size) {
+	while (stream->decompressor.status == DECOMPRESS_MORE) {
+		uint32_t block_start = stream->received - stream->block_size;
+		bool is_tail = block_start >= stream->plan.tail_start;
+		uint32_t full_size = is_tail ? stream->plan.tail_length : stream->plan.block_size;
+
+		uint32_t copy_size = full_size - stream->block_size < size ? full_size - stream->block_size : size;
+		memcpy(stream->block + stream->block_size, encoded_data, copy_size);
+		stream->block_size += copy_size;
+		stream->received += copy_size;
+		encoded_data += copy_size;
+		size -= copy_size;
+		if (stream->block_size < full_size) {
+			break;
+		}
+
+		double start_time = stats_start();
+		if (is_tail) {
+			cipher_plan_apply_tail(&stream->plan, stream->block);
+		} else {
+			cipher_plan_apply_block(&stream->plan, stream->block);
+		}
+		stats_stop(STATS_DECRYPT, start_time);
+
+		start_time = stats_start();
+		decompress_stream_push(&stream->decompressor, stream->block, stream->block_size, is_tail);
+		stats_stop(STATS_DECOMPRESS, start_time);
+		stream->block_size = 0;
+	}
+
+	if (stream->decompressor.status == DECOMPRESS_DONE && stream->decompressor.curr_dst_byte != stream->uncompressed_size) {
+		stream->decompressor.status = DECOMPRESS_ERROR;
+	}
+	return stream->decompressor.status;
+}
+
+
+// Finds the header of each stage (see decoded data structure in th128_parse.cpp), stopping at max_stages
+// or at the first one that doesn't fit in the data. Returns the amount of stages found.
+uint32_t th128_find_stages(uint8_t *decoded_data, uint32_t size, th128_stage_header_t **stages, uint32_t max_stages) {
+	th128_replay_data_t *replay_data = (th128_replay_data_t *)decoded_data;
+	if (size < sizeof(th128_replay_data_t)) {
+		return 0;
+	}
+
+	uint32_t num_stages = replay_data->num_stages < max_stages ? replay_data->num_stages : max_stages;
+	uint32_t curr_offset = sizeof(th128_replay_data_t);
+	for (uint32_t i = 0; i < num_stages; i++) {
+		th128_stage_header_t *stage = (th128_stage_header_t *)(decoded_data + curr_offset);
+		if (size - curr_offset < sizeof(th128_stage_header_t) || size - curr_offset - sizeof(th128_stage_header_t) < stage->size) {
+			return i;
+		}
+		stages[i] = stage;
+		curr_offset += sizeof(th128_stage_header_t) + stage->size;
+	}
+	return num_stages;
+}
+
+
+// Finds the input data of each stage, which is made of one record per frame. Returns the amount of regions found.
+uint32_t th128_find_input_regions(uint8_t *decoded_data, uint32_t size, compression_record_region_t *regions) {
+	th128_stage_header_t *stages[TH128_MAX_STAGES];
+	uint32_t num_stages = th128_find_stages(decoded_data, size, stages, TH128_MAX_STAGES);
+	for (uint32_t i = 0; i < num_stages; i++) {
+		uint32_t input_size = stages[i]->num_frames * sizeof(th128_input_data_t);
+		regions[i].offset = ((uint8_t *)stages[i] - decoded_data) + sizeof(th128_stage_header_t);
+		regions[i].size = input_size < stages[i]->size ? input_size : stages[i]->size;
+		regions[i].record_size = sizeof(th128_input_data_t);
+	}
+	return num_stages;
+}
+
+
+void th128_encrypt_replay_data(uint8_t *compressed_data, uint32_t compressed_size) {
+	double start_time = stats_start();
+	th128_encrypt_data(compressed_data, compressed_size);
+	stats_stop(STATS_ENCRYPT, start_time);
+}
+
+
+// Encodes into a buffer of at least compress_bound(size) bytes, returns the encoded size
+uint32_t th128_encode_replay_data_to(uint8_t *data, uint32_t size, uint8_t *encoded_data, const compression_options_t &options) {
+	compression_options_t encode_options = options;
+	compression_record_region_t input_regions[TH128_MAX_STAGES];
+	if (options.level == COMPRESSION_RECORDS && options.record_regions == NULL) {
+		encode_options.record_regions = input_regions;
+		encode_options.num_record_regions = th128_find_input_regions(data, size, input_regions);
+	}
+
+	double start_time = stats_start();
+	uint32_t compressed_size = compress_to(data, size, encoded_data, encode_options);
+	stats_stop(STATS_COMPRESS, start_time);
+	stats_count_encoded_tokens(encoded_data, compressed_size);
+
+	th128_encrypt_replay_data(encoded_data, compressed_size);
+
+	return compressed_size;
+}
+
+
+// Same as th128_encode_replay_data_to, but reuses the tokens of the original compressed data (already decrypted).
+// The buffer must have at least recompress_bound(original_size, size) bytes.
+uint32_t th128_reencode_replay_data_to(uint8_t *original_data, uint32_t original_size, uint8_t *data, uint32_t size, uint8_t *encoded_data) {
+	double start_time = stats_start();
+	uint32_t compressed_size = recompress_to(original_data, original_size, data, size, encoded_data);
+	stats_stop(STATS_COMPRESS, start_time);
+	stats_count_encoded_tokens(encoded_data, compressed_size);
+
+	th128_encrypt_replay_data(encoded_data, compressed_size);
+
+	return compressed_size;
+}
+
+
+uint8_t *th128_encode_replay_data(uint8_t *data, uint32_t size, uint32_t &compressed_size, const compression_options_t &options) {
+	uint8_t *compressed_data = new uint8_t[compress_bound(size)];
+	compressed_size = th128_encode_replay_data_to(data, size, compressed_data, options);
+	return compressed_data;
+}
+
 
+uint8_t *th128_reencode_replay_data(uint8_t *original_data, uint32_t original_size, uint8_t *data, uint32_t size, uint32_t &compressed_size) {
+	uint8_t *compressed_data = new uint8_t[recompress_bound(original_size, size)];
+	compressed_size = th128_reencode_replay_data_to(original_data, original_size, data, size, compressed_data);
 	return compressed_data;
 }
@@ -2,6 +2,83 @@
 
 #include <stdint.h>
 
+#include "types.h"
+#include "encryption.h"
+#include "compression.h"
+#include "games.h"
+#include "utils.h"
 
-uint8_t *th128_decode_replay_data(uint8_t *encoded_data, uint32_t compressed_size, uint32_t uncompressed_size);
-uint8_t *th128_encode_replay_data(uint8_t *data, uint32_t size, uint32_t &compressed_size);
+
+// Max amount of stages in a replay (a full route)
+const uint32_t TH128_MAX_STAGES = 3;
+
+const uint32_t TH128_REPLAY_MAGIC = game_th128.magic;
+const uint32_t TH128_USER_MAGIC = 0x52455355; // 'USER', start of each user data section
+
+static_assert(sizeof(th128_replay_header_t) == game_th128.header_size, "th128 header doesn't match its descriptor");
+static_assert(sizeof(th128_stage_header_t) == game_th128.stage_header_size, "th128 stage header doesn't match its descriptor");
+static_assert(sizeof(th128_input_data_t) == game_th128.input_record_size, "th128 inputs don't match their descriptor");
+
+
+// Errors of the functions that decode replays, they don't print anything (see th128_log_error)
+enum th128_error_t {
+	TH128_OK,
+	TH128_ERROR_NOT_A_REPLAY, // too small for a header or wrong magic
+	TH128_ERROR_TRUNCATED, // the encoded or user data doesn't fit in the file, or the encoded data ends before its terminator
+	TH128_ERROR_BUFFER_TOO_SMALL, // a caller buffer can't hold the output
+	TH128_ERROR_BAD_COMPRESSED_DATA, // doesn't decompress to the size in the header
+	TH128_ERROR_BAD_REPLAY_DATA, // the decoded data is too small or its stages don't fit in it
+	TH128_ERROR_OVERLAPPING_DATA, // the user data offset is inside the header or the encoded data
+	TH128_ERROR_READ, // the file couldn't be read, open_input_file already printed why
+	NUM_TH128_ERRORS
+};
+
+// Replay file opened with th128_open_replay_file, the pointers point into the read-only file data
+struct th128_replay_file_t {
+	input_file_t file;
+	const th128_replay_header_t *header;
+	const uint8_t *encoded_data;
+	const uint8_t *user_data;
+	uint32_t user_data_size;
+	const game_descriptor_t *other_game; // set if the file isn't a th128 replay but one of another known game
+};
+
+
+// Decodes replay data given in pieces, keeping at most two cipher blocks and the LZSS history in memory
+struct th128_decode_stream_t {
+	cipher_plan_t plan;
+	uint8_t block[CIPHER_PLAN_MAX_BLOCK_SIZE * 2];
+	uint32_t block_size; // bytes currently in block
+	uint32_t received; // encoded bytes received so far
+	uint32_t uncompressed_size;
+	decompress_stream_t decompressor;
+};
+
+
+// Buffers reused for every replay a thread processes
+struct th128_workspace_t {
+	grow_buffer_t decrypted_data;
+	grow_buffer_t decoded_data;
+	grow_buffer_t output_data; // new replay file (header and encoded data)
+	grow_buffer_t user_data;
+	th128_decode_stream_t stream;
+};
+
+
+th128_workspace_t &th128_thread_workspace();
+void th128_decrypt_data(const uint8_t *encoded_data, uint8_t *decrypted_data, uint32_t length);
+uint32_t th128_find_stages(uint8_t *decoded_data, uint32_t size, th128_stage_header_t **stages, uint32_t max_stages);
+uint32_t th128_find_input_regions(uint8_t *decoded_data, uint32_t size, compression_record_region_t *regions);
+const char *th128_error_message(th128_error_t error);
+void th128_log_error(th128_error_t error, const th128_replay_file_t *replay = NULL);
+th128_error_t th128_open_replay_file(const char *file, th128_replay_file_t *replay);
+th128_error_t th128_load_replay_file(th128_replay_file_t *replay);
+void th128_close_replay_file(th128_replay_file_t *replay);
+uint8_t *th128_decode_replay_data(const uint8_t *encoded_data, uint8_t *decrypted_data, uint32_t compressed_size, uint32_t uncompressed_size);
+th128_error_t th128_decode_replay_data_to(const uint8_t *encoded_data, uint8_t *decrypted_data, uint32_t compressed_size, uint8_t *decoded_data, uint32_t uncompressed_size);
+void th128_decode_stream_init(th128_decode_stream_t *stream, uint32_t compressed_size, uint32_t uncompressed_size, decompress_output_t output, void *user_data);
+decompress_status_t th128_decode_stream_push(th128_decode_stream_t *stream, const uint8_t *encoded_data, uint32_t size);
+uint8_t *th128_encode_replay_data(uint8_t *data, uint32_t size, uint32_t &compressed_size, const compression_options_t &options = compression_options_t());
+uint8_t *th128_reencode_replay_data(uint8_t *original_data, uint32_t original_size, uint8_t *data, uint32_t size, uint32_t &compressed_size);
+uint32_t th128_encode_replay_data_to(uint8_t *data, uint32_t size, uint8_t *encoded_data, const compression_options_t &options = compression_options_t());
+uint32_t th128_reencode_replay_data_to(uint8_t *original_data, uint32_t original_size, uint8_t *data, uint32_t size, uint8_t *encoded_data);
@@ -6,7 +6,9 @@
 
 #include "types.h"
 #include "th128_core.h"
+#include "th128_view.h"
 #include "utils.h"
+#include "stats.h"
 
 
 // Transforms a stage to its route. If unrecognized, returns -1.
@@ -34,6 +36,19 @@ int stage2route(uint32_t stage) {
 	}
 }
 
+// Finds the route from the stages. If unrecognized, returns -1.
+// second_stage is only used if there's more than one stage.
+int th128_correct_route(const th128_replay_data_t *replay_data, const th128_stage_header_t *first_stage, const th128_stage_header_t *second_stage) {
+	if (replay_data->num_stages == 1) {
+		// If there's only one stage, grab the route from it
+		return stage2route(first_stage->stage);
+	} else {
+		// Otherwise, grab the route from the second stage
+		return stage2route(second_stage->stage);
+	}
+}
+
+
 /*
 Bug explanation:
 Every time you choose the second route, the route value increments by one.
@@ -43,38 +58,32 @@ Luckily, the stage values are correct so the proper route can be inferred from t
 
 Return: correct route, -1 if error, -2 if route is already correct
 */
-int find_correct_route(uint8_t *decoded_data) {
-	th128_replay_data_t *replay_data = (th128_replay_data_t *)decoded_data;
+int find_correct_route(const th128_data_view_t *view) {
+	const th128_replay_data_t *replay_data = view->replay_data;
 	
-	printf("Replay route: ");
+	log_printf("Replay route: ");
 	if (replay_data->route > 6) {
-		printf("Extra+%u (bugged)", replay_data->route - 6);
+		log_printf("Extra+%u (bugged)", replay_data->route - 6);
 	} else {
-		printf(routes[replay_data->route]);
+		log_printf("%s", routes[replay_data->route]);
 	}
-	printf("\n");
+	log_printf("\n");
 
-	// Find the correct route
-	int correct_route;
-	th128_stage_header_t *first_stage = (th128_stage_header_t *)(decoded_data + sizeof(th128_replay_data_t));
-
-	if (replay_data->num_stages == 1) {
-		// If there's only one stage, grab the route from it
-		correct_route = stage2route(first_stage->stage);
-	} else {
-		// Otherwise, grab the route from the second stage
-		th128_stage_header_t *second_stage = (th128_stage_header_t *)(((uint8_t *)first_stage) + sizeof(th128_stage_header_t) + first_stage->size);
-		correct_route = stage2route(second_stage->stage);
+	// Find the correct route, from the stages the view checked
+	int correct_route = -1;
+	if (view->num_stages > 0) {
+		const th128_stage_header_t *second_stage = view->num_stages > 1 ? view->stages[1].header : NULL;
+		correct_route = th128_correct_route(replay_data, view->stages[0].header, second_stage);
 	}
 
 	if (correct_route == -1) {
-		printf("Error finding the correct route.\n");
+		log_printf("Error finding the correct route.\n");
 		return -1;
 	} else if (replay_data->route == (uint32_t)correct_route) {
-		printf("Replay already has the correct route, no need to fix.\n");
+		log_printf("Replay already has the correct route, no need to fix.\n");
 		return -2;
 	} else {
-		printf("Correct route: %s\n", routes[correct_route]);
+		log_printf("Correct route: %s\n", routes[correct_route]);
 		return correct_route;
 	}
 }
@@ -96,90 +105,194 @@ void th128_fix_replay_data(uint8_t *decoded_data, uint32_t new_route) {
 void th128_fix_user_data(uint8_t *user_data, uint32_t new_route) {
 	char *replay_info = (char *)(user_data + sizeof(th128_user_data_header_t));
 	char *route_str = strstr(replay_info, "Route");
+	if (route_str == NULL) {
+		return;
+	}
 	route_str += 6; // skip over "Route "
 	memcpy(route_str, route_strs[new_route], 8); // route strings are always 8 chars long
 }
 
 
-bool th128_fix_replay_file(const char *file) {
-	// Read file
-	FILE *fp = fopen(file, "rb");
-	if (!fp) {
-		perror("Error");
-		return false;
+// If options is NULL, the original compressed data is patched instead of compressing it again
+th128_fix_result_t th128_fix_replay_file(const char *file, const compression_options_t *options) {
+	// Open file
+	th128_replay_file_t replay;
+	th128_error_t error = th128_open_replay_file(file, &replay);
+	if (error != TH128_OK) {
+		th128_log_error(error, &replay);
+		return TH128_FIX_ERROR;
 	}
+	const uint8_t *encoded_data = replay.encoded_data;
+	uint32_t compressed_size = replay.header->compressed_data_size;
+	uint32_t uncompressed_size = replay.header->uncompressed_data_size;
 
-	fseek(fp, 0L, SEEK_END);
-	uint32_t file_size = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
-	
-	uint8_t *file_data = new uint8_t[file_size];
-	fread(file_data, file_size, 1, fp);
-	fclose(fp);
-	
-	// Parse file header
-	th128_replay_header_t *header = (th128_replay_header_t *)file_data;
-	if (header->magic != 0x72383231) {
-		printf("Not a th128 replay.\n");
-		delete[] file_data;
-		return false;
-	}
-	uint8_t *encoded_data = file_data + sizeof(th128_replay_header_t);
-	uint32_t compressed_size = header->compressed_data_size;
-	uint32_t uncompressed_size = header->uncompressed_data_size;
-	uint8_t *user_data = file_data + header->user_data_offset;
-	uint32_t user_data_size = file_size - sizeof(th128_replay_header_t) - compressed_size;
-
-	// Decode data
-	uint8_t *decoded_data = th128_decode_replay_data(encoded_data, compressed_size, uncompressed_size);
-	if (decoded_data == NULL) {
-		delete[] file_data;
-		return false;
+	// Decode data, the decrypted data is kept to patch it later
+	th128_workspace_t &workspace = th128_thread_workspace();
+	uint8_t *decrypted_data = workspace.decrypted_data.reserve(compressed_size);
+	uint8_t *decoded_data = workspace.decoded_data.reserve(uncompressed_size);
+	error = th128_decode_replay_data_to(encoded_data, decrypted_data, compressed_size, decoded_data, uncompressed_size);
+	if (error != TH128_OK) {
+		th128_log_error(error);
+		th128_close_replay_file(&replay);
+		return TH128_FIX_ERROR;
+	}
+
+	// The stage sizes come from the file, they're checked before finding the stages
+	th128_data_view_t view;
+	error = th128_view_replay_data(decoded_data, uncompressed_size, &view);
+	if (error != TH128_OK) {
+		th128_log_error(error);
+		th128_close_replay_file(&replay);
+		return TH128_FIX_ERROR;
 	}
 
 	// Check route info, abort if correct
-	int correct_route = find_correct_route(decoded_data);
+	double start_time = stats_start();
+	int correct_route = find_correct_route(&view);
+	stats_stop(STATS_ROUTE, start_time);
 	if (correct_route < 0) {
-		delete[] file_data;
-		delete[] decoded_data;
-		return false;
+		// stdout always gets a replay, so piping replays through fix doesn't drop the correct ones
+		bool copied = true;
+		if (correct_route == -2 && !strcmp(file, STDIO_PATH)) {
+			const file_part_t part = {replay.file.data, replay.file.size};
+			copied = write_file_parts(file, "", &part, 1);
+		}
+		th128_close_replay_file(&replay);
+		return correct_route == -2 && copied ? TH128_FIX_CORRECT : TH128_FIX_ERROR;
 	}
 
-	// Fix route in replay and user data
+	// Fix route in replay and user data (a copy, the file data is read-only)
+	uint32_t user_data_size = replay.user_data_size;
+	// zero padded, so the strings in it are always terminated even if the user data is broken
+	uint32_t user_data_capacity = user_data_size + sizeof(th128_user_data_header_t) + 1;
+	uint8_t *user_data = workspace.user_data.reserve(user_data_capacity);
+	memcpy(user_data, replay.user_data, user_data_size);
+	memset(user_data + user_data_size, 0, user_data_capacity - user_data_size);
 	th128_fix_replay_data(decoded_data, correct_route);
 	th128_fix_user_data(user_data, correct_route);
-	printf("Fixed replay route.\n");
+	log_printf("Fixed replay route.\n");
 
-	// Encode data
+	// Encode data straight into the new file, after its header
+	uint32_t max_encoded_data_size = options ? compress_bound(uncompressed_size) : recompress_bound(compressed_size, uncompressed_size);
+	uint8_t *new_file_data = workspace.output_data.reserve(sizeof(th128_replay_header_t) + max_encoded_data_size);
+	uint8_t *new_encoded_data = new_file_data + sizeof(th128_replay_header_t);
 	uint32_t new_encoded_data_size;
-	uint8_t *new_encoded_data = th128_encode_replay_data(decoded_data, uncompressed_size, new_encoded_data_size);
-
-	// Build new file
-	uint32_t new_file_size = sizeof(th128_replay_header_t) + new_encoded_data_size + user_data_size;
-	uint32_t new_user_data_offset = sizeof(th128_replay_header_t) + new_encoded_data_size;
-	uint8_t *new_file_data = new uint8_t[new_file_size];
-	uint8_t *curr_file_ptr = new_file_data;
+	if (options) {
+		new_encoded_data_size = th128_encode_replay_data_to(decoded_data, uncompressed_size, new_encoded_data, *options);
+	} else {
+		new_encoded_data_size = th128_reencode_replay_data_to(decrypted_data, compressed_size, decoded_data, uncompressed_size, new_encoded_data);
+	}
 
-	memcpy(curr_file_ptr, file_data, sizeof(th128_replay_header_t));
-	curr_file_ptr += sizeof(th128_replay_header_t);
+	memcpy(new_file_data, replay.header, sizeof(th128_replay_header_t));
 	th128_replay_header_t *new_header = (th128_replay_header_t *)new_file_data;
 	new_header->compressed_data_size = new_encoded_data_size;
-	new_header->user_data_offset = new_user_data_offset;
-
-	memcpy(curr_file_ptr, new_encoded_data, new_encoded_data_size);
-	curr_file_ptr += new_encoded_data_size;
-
-	memcpy(curr_file_ptr, user_data, user_data_size);
-	curr_file_ptr += user_data_size;
+	new_header->user_data_offset = sizeof(th128_replay_header_t) + new_encoded_data_size;
 
 	// Write new file
-	write_file(file, ".fixed.rpy", new_file_data, new_file_size);
+	const file_part_t parts[] = {
+		{new_file_data, sizeof(th128_replay_header_t) + new_encoded_data_size},
+		{user_data, user_data_size}
+	};
+	bool written = write_file_parts(file, ".fixed.rpy", parts, 2);
 	
 	// Clean up
-	delete[] file_data;
-	delete[] decoded_data;
-	delete[] new_encoded_data;
-	delete[] new_file_data;
+	th128_close_replay_file(&replay);
+
+	return written ? TH128_FIX_FIXED : TH128_FIX_ERROR;
+}
+
+
+/*
+	Scanning:
+
+	Only the replay data and the headers of the first two stages are needed to know whether a replay is bugged.
+	The data is decoded through the streaming decoder, keeping only those headers: the data of the first stage
+	is decoded (there's no way to skip LZSS data) but not stored, and decoding stops right after the second
+	header, so the rest of the file is never decrypted (nor read from disk, since the file is memory-mapped).
+*/
+
+struct th128_scan_t {
+	uint8_t data[sizeof(th128_replay_data_t) + 2 * sizeof(th128_stage_header_t)];
+	uint32_t size; // bytes of data collected
+	uint64_t curr_byte; // position in the decoded data
+	uint64_t second_stage_offset;
+	bool complete;
+};
+
+
+bool th128_scan_output(const uint8_t *data, uint32_t size, void *user_data) {
+	th128_scan_t *scan = (th128_scan_t *)user_data;
+	const uint32_t first_part_size = sizeof(th128_replay_data_t) + sizeof(th128_stage_header_t);
+	uint64_t data_start = scan->curr_byte;
+	uint64_t data_end = data_start + size;
+	scan->curr_byte = data_end;
+
+	while (true) {
+		// next wanted range: the replay data and the first stage header, then the second stage header
+		uint64_t start, end;
+		if (scan->size < first_part_size) {
+			start = scan->size;
+			end = first_part_size;
+		} else {
+			start = scan->second_stage_offset + scan->size - first_part_size;
+			end = scan->second_stage_offset + sizeof(th128_stage_header_t);
+		}
+		if (start >= data_end) {
+			return true;
+		}
+		uint64_t copy_end = end < data_end ? end : data_end;
+		memcpy(scan->data + scan->size, data + (start - data_start), copy_end - start);
+		scan->size += copy_end - start;
+		if (copy_end < end) {
+			return true;
+		}
 
-	return true;
+		th128_replay_data_t *replay_data = (th128_replay_data_t *)scan->data;
+		th128_stage_header_t *first_stage = (th128_stage_header_t *)(scan->data + sizeof(th128_replay_data_t));
+		if (scan->size == sizeof(scan->data) || replay_data->num_stages == 1) {
+			scan->complete = true;
+			return false;
+		}
+		scan->second_stage_offset = first_part_size + (uint64_t)first_stage->size;
+	}
+}
+
+
+// Checks whether a replay has the wrong route, decoding only as much data as needed.
+// If bugged, correct_route gets the route the replay should have.
+th128_scan_result_t th128_scan_replay_file(const char *file, int &correct_route) {
+	th128_replay_file_t replay;
+	th128_error_t error = th128_open_replay_file(file, &replay);
+	if (error != TH128_OK) {
+		th128_log_error(error, &replay);
+		return TH128_SCAN_ERROR;
+	}
+
+	th128_scan_t scan;
+	scan.size = 0;
+	scan.curr_byte = 0;
+	scan.second_stage_offset = 0;
+	scan.complete = false;
+	th128_decode_stream_t *stream = &th128_thread_workspace().stream;
+	th128_decode_stream_init(stream, replay.header->compressed_data_size, replay.header->uncompressed_data_size, th128_scan_output, &scan);
+	// decoding stops as soon as the headers are found, so only the pages of the mapping that are needed get read
+	th128_decode_stream_push(stream, replay.encoded_data, replay.header->compressed_data_size);
+	th128_close_replay_file(&replay);
+
+	if (!scan.complete) {
+		log_printf("Error decoding the replay data.\n");
+		return TH128_SCAN_ERROR;
+	}
+
+	th128_replay_data_t *replay_data = (th128_replay_data_t *)scan.data;
+	th128_stage_header_t *first_stage = (th128_stage_header_t *)(scan.data + sizeof(th128_replay_data_t));
+	th128_stage_header_t *second_stage = (th128_stage_header_t *)(scan.data + sizeof(th128_replay_data_t) + sizeof(th128_stage_header_t));
+	double start_time = stats_start();
+	correct_route = th128_correct_route(replay_data, first_stage, second_stage);
+	stats_stop(STATS_ROUTE, start_time);
+	if (correct_route == -1) {
+		log_printf("Error finding the correct route.\n");
+		return TH128_SCAN_ERROR;
+	}
+	return replay_data->route == (uint32_t)correct_route ? TH128_SCAN_CLEAN : TH128_SCAN_BUGGED;
 }
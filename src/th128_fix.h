@@ -2,11 +2,30 @@
 
 #include <stdint.h>
 
+#include "types.h"
+#include "compression.h"
+
 
 // Route strings for user data
 const char *const route_strs[] = {"RouteA-1", "RouteA-2", "RouteB-1", "RouteB-2", "RouteC-1", "RouteC-2", "Extra   "};
 
 
+enum th128_scan_result_t {
+	TH128_SCAN_CLEAN,
+	TH128_SCAN_BUGGED,
+	TH128_SCAN_ERROR
+};
+
+// Also the exit code of fix when reading from stdin (a correct replay is copied to stdout unchanged)
+enum th128_fix_result_t {
+	TH128_FIX_FIXED,
+	TH128_FIX_CORRECT, // the replay already had the correct route
+	TH128_FIX_ERROR
+};
+
+
+int th128_correct_route(const th128_replay_data_t *replay_data, const th128_stage_header_t *first_stage, const th128_stage_header_t *second_stage);
 void th128_fix_replay_data(uint8_t *decoded_data, uint32_t new_route);
 void th128_fix_user_data(uint8_t *user_data, uint32_t new_route);
-bool th128_fix_replay_file(const char *file);
+th128_fix_result_t th128_fix_replay_file(const char *file, const compression_options_t *options = NULL);
+th128_scan_result_t th128_scan_replay_file(const char *file, int &correct_route);
@@ -0,0 +1,369 @@
+#include "th128_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "types.h"
+#include "th128_core.h"
+#include "th128_fix.h"
+#include "utils.h"
+
+
+/*
+	Index file structure:
+	th128_index_header_t                   (0x28 bytes)
+	th128_index_entry_t[num_entries]       (0x228 bytes each, sorted by path)
+	<paths>                                (null-terminated strings)
+
+	Entries are keyed by the absolute path of each replay. An entry is up to date while the size and modification
+	time of its file stay the same. When they change, the file is read again, and only decoded if its hash changed
+	as well (e.g. it was copied over with the same contents).
+*/
+static_assert(sizeof(th128_index_header_t) == 0x28, "unexpected index header size");
+static_assert(sizeof(th128_index_entry_t) == 0x228, "unexpected index entry size");
+
+
+// Opens an index for reading, checking that everything in it is within the file
+bool th128_open_index(const char *path, th128_index_t *index) {
+	if (!open_input_file(path, &index->file)) {
+		return false;
+	}
+
+	const th128_index_header_t *header = (const th128_index_header_t *)index->file.data;
+	uint64_t file_size = index->file.size;
+	if (file_size < sizeof(th128_index_header_t) || header->magic != TH128_INDEX_MAGIC || header->version != TH128_INDEX_VERSION
+		|| header->entry_size != sizeof(th128_index_entry_t)) {
+		log_printf("Error: %s is not a replay index, or was made by another version.\n", path);
+		close_input_file(&index->file);
+		return false;
+	}
+	uint64_t entries_size = (uint64_t)header->num_entries * sizeof(th128_index_entry_t);
+	if (header->entries_offset > file_size || entries_size > file_size - header->entries_offset
+		|| header->paths_offset > file_size || header->paths_size > file_size - header->paths_offset
+		|| header->entries_offset % 8 != 0) {
+		log_printf("Error: replay index %s is truncated.\n", path);
+		close_input_file(&index->file);
+		return false;
+	}
+
+	index->entries = (const th128_index_entry_t *)(index->file.data + header->entries_offset);
+	index->num_entries = header->num_entries;
+	index->paths = (const char *)(index->file.data + header->paths_offset);
+	index->paths_size = header->paths_size;
+	// paths must be terminated within the file
+	for (uint32_t i = 0; i < index->num_entries; i++) {
+		uint64_t path_offset = index->entries[i].path_offset;
+		if (path_offset >= index->paths_size || !memchr(index->paths + path_offset, '\0', index->paths_size - path_offset)) {
+			log_printf("Error: replay index %s is corrupted.\n", path);
+			close_input_file(&index->file);
+			return false;
+		}
+	}
+	return true;
+}
+
+
+void th128_close_index(th128_index_t *index) {
+	close_input_file(&index->file);
+	index->entries = NULL;
+	index->num_entries = 0;
+}
+
+
+// Absolute path of a file, full_path must have room for TH128_INDEX_MAX_PATH bytes
+bool th128_index_full_path(const char *file, char *full_path) {
+#ifdef _WIN32
+	return _fullpath(full_path, file, TH128_INDEX_MAX_PATH) != NULL;
+#else
+	char *path = realpath(file, NULL);
+	if (!path) {
+		return false;
+	}
+	size_t length = strlen(path);
+	if (length >= TH128_INDEX_MAX_PATH) {
+		free(path);
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	memcpy(full_path, path, length + 1);
+	free(path);
+	return true;
+#endif
+}
+
+
+bool index_file_stat(const char *path, uint64_t &size, int64_t &mtime) {
+	struct stat file_stat;
+	if (stat(path, &file_stat) != 0) {
+		return false;
+	}
+	size = file_stat.st_size;
+#ifdef _WIN32
+	mtime = (int64_t)file_stat.st_mtime * 1000000000;
+#else
+	mtime = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+
+
+bool th128_fixed_file_exists(const char *file) {
+	char fixed_path[TH128_INDEX_MAX_PATH + 16];
+	snprintf(fixed_path, sizeof(fixed_path), "%s.fixed.rpy", file);
+	struct stat file_stat;
+	return stat(fixed_path, &file_stat) == 0;
+}
+
+
+// Binary search by path, NULL if not found
+const th128_index_entry_t *th128_index_find(const th128_index_t *index, const char *full_path) {
+	uint32_t low = 0;
+	uint32_t high = index->num_entries;
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		int comparison = strcmp(index->paths + index->entries[middle].path_offset, full_path);
+		if (comparison == 0) {
+			return &index->entries[middle];
+		} else if (comparison < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return NULL;
+}
+
+
+// Entry of a replay, if it's in the index and its file hasn't changed since. NULL otherwise.
+const th128_index_entry_t *th128_index_lookup(const th128_index_t *index, const char *file) {
+	char full_path[TH128_INDEX_MAX_PATH];
+	uint64_t file_size;
+	int64_t mtime;
+	if (!th128_index_full_path(file, full_path) || !index_file_stat(full_path, file_size, mtime)) {
+		return NULL;
+	}
+	const th128_index_entry_t *entry = th128_index_find(index, full_path);
+	if (!entry || entry->file_size != file_size || entry->mtime != mtime) {
+		return NULL;
+	}
+	return entry;
+}
+
+
+// 64-bit FNV-1a
+uint64_t index_hash(const uint8_t *data, uint64_t size) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (uint64_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3;
+	}
+	return hash;
+}
+
+
+// Fills the replay fields of an entry from an opened replay, decoding it
+void index_decode_replay(th128_replay_file_t *replay, th128_index_entry_t &entry) {
+	entry.header = *replay->header;
+	uint32_t compressed_size = replay->header->compressed_data_size;
+	uint32_t uncompressed_size = replay->header->uncompressed_data_size;
+	th128_workspace_t &workspace = th128_thread_workspace();
+	uint8_t *decrypted_data = workspace.decrypted_data.reserve(compressed_size);
+	uint8_t *decoded_data = workspace.decoded_data.reserve(uncompressed_size);
+	th128_error_t error = th128_decode_replay_data_to(replay->encoded_data, decrypted_data, compressed_size, decoded_data, uncompressed_size);
+	if (error != TH128_OK) {
+		th128_log_error(error);
+		return;
+	}
+
+	th128_stage_header_t *stages[TH128_MAX_STAGES];
+	uint32_t num_stage_headers = th128_find_stages(decoded_data, uncompressed_size, stages, TH128_MAX_STAGES);
+	if (num_stage_headers == 0) {
+		log_printf("Error: replay data is truncated.\n");
+		return;
+	}
+	const th128_replay_data_t *replay_data = (const th128_replay_data_t *)decoded_data;
+	memcpy(entry.name, replay_data->name, sizeof(entry.name));
+	entry.score = replay_data->score;
+	entry.date = replay_data->date;
+	entry.route = replay_data->route;
+	entry.rank = replay_data->rank;
+	entry.last_stage = replay_data->last_stage;
+	entry.num_stages = replay_data->num_stages;
+	entry.num_stage_headers = num_stage_headers;
+	for (uint32_t i = 0; i < num_stage_headers; i++) {
+		entry.stages[i] = *stages[i];
+	}
+
+	if (replay_data->num_stages > 1 && num_stage_headers < 2) {
+		log_printf("Error: replay data is truncated.\n");
+		return;
+	}
+	entry.correct_route = th128_correct_route(replay_data, stages[0], num_stage_headers > 1 ? stages[1] : stages[0]);
+	if (entry.correct_route == -1) {
+		log_printf("Error finding the correct route.\n");
+		return;
+	}
+	entry.status = replay_data->route == (uint32_t)entry.correct_route ? TH128_SCAN_CLEAN : TH128_SCAN_BUGGED;
+}
+
+
+// Makes the index entry of a replay, reusing its entry in old_index (can be NULL) if the file didn't change.
+// full_path (TH128_INDEX_MAX_PATH bytes) gets the path the entry is for, and changed whether it had to be decoded.
+// Replays that can't be decoded still get an entry, with an error status.
+bool th128_index_replay_file(const char *file, const th128_index_t *old_index, th128_index_entry_t &entry, char *full_path, bool &changed) {
+	changed = false;
+	uint64_t file_size;
+	int64_t mtime;
+	if (!th128_index_full_path(file, full_path) || !index_file_stat(full_path, file_size, mtime)) {
+		log_perror("Error");
+		return false;
+	}
+	const th128_index_entry_t *old_entry = old_index ? th128_index_find(old_index, full_path) : NULL;
+	if (old_entry && old_entry->file_size == file_size && old_entry->mtime == mtime) {
+		entry = *old_entry;
+		entry.has_fixed = th128_fixed_file_exists(full_path);
+		log_printf("Unchanged.\n");
+		return true;
+	}
+
+	th128_replay_file_t replay;
+	if (!open_input_file(full_path, &replay.file)) {
+		return false;
+	}
+	uint64_t hash = index_hash(replay.file.data, replay.file.size);
+	if (old_entry && old_entry->file_size == replay.file.size && old_entry->hash == hash) {
+		close_input_file(&replay.file);
+		entry = *old_entry;
+		entry.mtime = mtime;
+		entry.has_fixed = th128_fixed_file_exists(full_path);
+		log_printf("Unchanged (same contents).\n");
+		return true;
+	}
+
+	changed = true;
+	memset(&entry, 0, sizeof(entry));
+	entry.file_size = replay.file.size;
+	entry.mtime = mtime;
+	entry.hash = hash;
+	entry.status = TH128_SCAN_ERROR;
+	entry.correct_route = -1;
+	entry.has_fixed = th128_fixed_file_exists(full_path);
+	th128_error_t error = th128_load_replay_file(&replay);
+	if (error == TH128_OK) {
+		index_decode_replay(&replay, entry);
+		th128_close_replay_file(&replay);
+	} else {
+		th128_log_error(error, &replay);
+	}
+
+	if (entry.status == TH128_SCAN_CLEAN) {
+		log_printf("Indexed: clean.\n");
+	} else if (entry.status == TH128_SCAN_BUGGED) {
+		log_printf("Indexed: bugged (correct route: %s).\n", routes[entry.correct_route]);
+	} else {
+		log_printf("Indexed: error.\n");
+	}
+	return true;
+}
+
+
+// Adds the entries of old_index whose paths aren't in paths yet after the others, so indexing some replays keeps
+// the entries of the rest. Entries of replays that don't exist anymore are left out. entries and paths must have
+// room for old_index->num_entries more, and the paths added are allocated with new[]. Returns the new amount of entries.
+uint32_t th128_index_add_old_entries(const th128_index_t *old_index, th128_index_entry_t *entries, char **paths, uint32_t num_entries) {
+	char **sorted_paths = new char *[num_entries];
+	memcpy(sorted_paths, paths, num_entries * sizeof(char *));
+	std::sort(sorted_paths, sorted_paths + num_entries, [](const char *a, const char *b) {
+		return strcmp(a, b) < 0;
+	});
+
+	uint32_t num_new_entries = num_entries;
+	for (uint32_t i = 0; i < old_index->num_entries; i++) {
+		const char *old_path = old_index->paths + old_index->entries[i].path_offset;
+		bool visited = std::binary_search(sorted_paths, sorted_paths + num_new_entries, old_path, [](const char *a, const char *b) {
+			return strcmp(a, b) < 0;
+		});
+		struct stat file_stat;
+		if (visited || stat(old_path, &file_stat) != 0) {
+			continue;
+		}
+		entries[num_entries] = old_index->entries[i];
+		paths[num_entries] = new char[strlen(old_path) + 1];
+		strcpy(paths[num_entries], old_path);
+		num_entries++;
+	}
+
+	delete[] sorted_paths;
+	return num_entries;
+}
+
+
+// Writes entries sorted by path, keeping the first of the ones with the same path. The path_offset of the entries
+// is overwritten.
+bool th128_write_index(const char *path, th128_index_entry_t *entries, char **paths, uint32_t num_entries) {
+	uint32_t *order = new uint32_t[num_entries];
+	for (uint32_t i = 0; i < num_entries; i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order, order + num_entries, [paths](uint32_t a, uint32_t b) {
+		return strcmp(paths[a], paths[b]) < 0;
+	});
+
+	th128_index_entry_t *sorted_entries = new th128_index_entry_t[num_entries];
+	uint32_t num_sorted = 0;
+	uint64_t paths_size = 0;
+	for (uint32_t i = 0; i < num_entries; i++) {
+		if (num_sorted > 0 && !strcmp(paths[order[i]], paths[order[i - 1]])) {
+			continue;
+		}
+		sorted_entries[num_sorted] = entries[order[i]];
+		sorted_entries[num_sorted].path_offset = paths_size;
+		paths_size += strlen(paths[order[i]]) + 1;
+		num_sorted++;
+	}
+	char *paths_data = new char[paths_size ? paths_size : 1];
+	for (uint32_t i = 0, j = 0; i < num_entries; i++) {
+		if (i > 0 && !strcmp(paths[order[i]], paths[order[i - 1]])) {
+			continue;
+		}
+		strcpy(paths_data + sorted_entries[j].path_offset, paths[order[i]]);
+		j++;
+	}
+
+	th128_index_header_t header;
+	header.magic = TH128_INDEX_MAGIC;
+	header.version = TH128_INDEX_VERSION;
+	header.num_entries = num_sorted;
+	header.entry_size = sizeof(th128_index_entry_t);
+	header.entries_offset = sizeof(th128_index_header_t);
+	header.paths_offset = header.entries_offset + (uint64_t)num_sorted * sizeof(th128_index_entry_t);
+	header.paths_size = paths_size;
+
+	// written next to the old index first, so it's replaced all at once
+	const file_part_t parts[] = {
+		{(const uint8_t *)&header, sizeof(header)},
+		{(const uint8_t *)sorted_entries, num_sorted * sizeof(th128_index_entry_t)},
+		{(const uint8_t *)paths_data, paths_size}
+	};
+	bool written = write_file_parts(path, ".tmp", parts, 3);
+	if (written) {
+		char *tmp_path = new char[strlen(path) + 5];
+		sprintf(tmp_path, "%s.tmp", path);
+#ifdef _WIN32
+		remove(path);
+#endif
+		if (rename(tmp_path, path) != 0) {
+			log_perror("Error");
+			written = false;
+		}
+		delete[] tmp_path;
+	}
+
+	delete[] order;
+	delete[] sorted_entries;
+	delete[] paths_data;
+	return written;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "types.h"
+#include "th128_core.h"
+#include "utils.h"
+
+
+/*
+	Index of replays, made by the index command and used by fix and scan to skip replays that are already known
+	to be clean or fixed. All values are little-endian, the file can be memory-mapped and used as is.
+*/
+const uint32_t TH128_INDEX_MAGIC = 0x58493854; // 'T8IX'
+const uint32_t TH128_INDEX_VERSION = 1;
+
+// Size: 0x28
+struct th128_index_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t entry_size; // sizeof(th128_index_entry_t)
+	uint64_t entries_offset; // th128_index_entry_t[num_entries], sorted by path
+	uint64_t paths_offset; // null-terminated paths of the entries
+	uint64_t paths_size;
+};
+
+// Size: 0x228
+struct th128_index_entry_t {
+	uint64_t path_offset; // from paths_offset, the absolute path of the replay
+	uint64_t file_size;
+	int64_t mtime; // nanoseconds since the Unix epoch
+	uint64_t hash; // FNV-1a of the whole file
+	uint32_t status; // th128_scan_result_t, the other fields are only valid if it's not TH128_SCAN_ERROR
+	int32_t correct_route;
+	uint32_t has_fixed; // whether the .fixed.rpy file existed when indexing
+	uint32_t num_stage_headers; // stored in stages
+	th128_replay_header_t header;
+	uint8_t name[8];
+	uint32_t score; // missing a trailing 0
+	uint64_t date; // Unix timestamp
+	uint32_t route;
+	uint32_t rank;
+	uint32_t last_stage;
+	uint32_t num_stages;
+	th128_stage_header_t stages[TH128_MAX_STAGES];
+};
+
+// Longest path an index can store
+const size_t TH128_INDEX_MAX_PATH = 4096;
+
+// Index opened with th128_open_index
+struct th128_index_t {
+	input_file_t file;
+	const th128_index_entry_t *entries;
+	uint32_t num_entries;
+	const char *paths;
+	uint64_t paths_size;
+};
+
+
+bool th128_open_index(const char *path, th128_index_t *index);
+void th128_close_index(th128_index_t *index);
+bool th128_index_full_path(const char *file, char *full_path);
+bool th128_fixed_file_exists(const char *file);
+const th128_index_entry_t *th128_index_find(const th128_index_t *index, const char *full_path);
+const th128_index_entry_t *th128_index_lookup(const th128_index_t *index, const char *file);
+bool th128_index_replay_file(const char *file, const th128_index_t *old_index, th128_index_entry_t &entry, char *full_path, bool &changed);
+uint32_t th128_index_add_old_entries(const th128_index_t *old_index, th128_index_entry_t *entries, char **paths, uint32_t num_entries);
+bool th128_write_index(const char *path, th128_index_entry_t *entries, char **paths, uint32_t num_entries);
@@ -2,49 +2,138 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <time.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "types.h"
+#include "games.h"
 #include "th128_core.h"
 #include "encryption.h"
 #include "utils.h"
+#include "stats.h"
 
 
-const uint8_t *get_action_char(th128_input_data_t input_data) {
-	// end of input, used when replay ends abruptly (save and quit)
-	if (input_data.holding.raw == 0xffff) {
-		return char_codes::quit;
-	}
-	
-	// print non-movement actions following some reasonable priority
-	if (input_data.pressed.bits.bomb) {
-		return char_codes::bomb;
-	}
+/*
+	Action characters:
 
-	if (input_data.pressed.bits.autoshoot) {
-		return char_codes::autoshoot_press;
+	The character of a frame only depends on which of the shoot, focus, autoshoot and bomb keys were pressed or
+	released on it, and on the direction being held, so those make up an index into a table with the UTF-8 bytes
+	of every character, built at compile time. When several actions happen on the same frame, the one with the
+	highest bit in the index is shown. The last entry is for the end of input, used when a replay ends abruptly
+	(save and quit), which has all keys held.
+*/
+const uint32_t ACTION_QUIT_INDEX = 1 << 11;
+
+struct action_char_t {
+	uint8_t bytes[3];
+	uint8_t length;
+};
+
+struct action_char_table_t {
+	action_char_t chars[ACTION_QUIT_INDEX + 1];
+
+	constexpr action_char_t make_char(const uint8_t *utf8_char) {
+		action_char_t action_char = {};
+		action_char.length = utf8_char[0] < 0x80 ? 1 : 3; // all characters are ASCII or 3 bytes long
+		for (int i = 0; i < action_char.length; i++) {
+			action_char.bytes[i] = utf8_char[i];
+		}
+		return action_char;
 	}
-	if (input_data.released.bits.autoshoot) {
-		return char_codes::autoshoot_release;
+
+	constexpr action_char_table_t() : chars() {
+		// from index bit 4 to 10, in increasing order of priority
+		const uint8_t *const actions[] = {
+			char_codes::shoot_release, char_codes::shoot_press,
+			char_codes::focus_release, char_codes::focus_press,
+			char_codes::autoshoot_release, char_codes::autoshoot_press,
+			char_codes::bomb
+		};
+		for (uint32_t i = 0; i < ACTION_QUIT_INDEX; i++) {
+			const uint8_t *utf8_char = char_codes::movement[i & 0xf];
+			for (int bit = 4; bit <= 10; bit++) {
+				if ((i >> bit) & 1) {
+					utf8_char = actions[bit - 4];
+				}
+			}
+			chars[i] = make_char(utf8_char);
+		}
+		chars[ACTION_QUIT_INDEX] = make_char(char_codes::quit);
 	}
+};
+
+constexpr action_char_table_t action_chars;
+
 
-	if (input_data.pressed.bits.focus) {
-		return char_codes::focus_press;
+inline uint32_t action_char_index(const th128_input_data_t &input_data) {
+	uint32_t holding = input_data.holding.raw;
+	if (holding == 0xffff) {
+		return ACTION_QUIT_INDEX;
 	}
-	if (input_data.released.bits.focus) {
-		return char_codes::focus_release;
+	uint32_t pressed = input_data.pressed.raw;
+	uint32_t released = input_data.released.raw;
+	return ((pressed >> 1) & 1) << 10 // bomb
+		| ((pressed >> 9) & 1) << 9 | ((released >> 9) & 1) << 8 // autoshoot
+		| ((pressed >> 3) & 1) << 7 | ((released >> 3) & 1) << 6 // focus
+		| (pressed & 1) << 5 | (released & 1) << 4 // shoot
+		| ((holding >> 4) & 0xf); // direction
+}
+
+
+/*
+	Text output:
+
+	The whole text is formatted into a single buffer, big enough for the worst case, then written at once.
+	Headers go through snprintf, while the per-frame data uses the table above and formats its numbers by hand.
+*/
+struct text_buffer_t {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+};
+
+// Most any header section can take, the longest lines are around 60 bytes plus numbers
+const size_t MAX_TEXT_HEADER_SIZE = 4096;
+
+
+void text_printf(text_buffer_t &text, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf((char *)text.data + text.size, text.capacity - text.size, format, args);
+	va_end(args);
+	if (length > 0) {
+		size_t remaining = text.capacity - text.size;
+		text.size += (size_t)length < remaining ? length : remaining - 1;
 	}
+}
 
-	if (input_data.pressed.bits.shoot) {
-		return char_codes::shoot_press;
+
+// Same as "%0*u"
+inline void text_append_uint(text_buffer_t &text, uint32_t value, int min_digits) {
+	char digits[10];
+	int num_digits = 0;
+	do {
+		digits[num_digits] = '0' + value % 10;
+		num_digits++;
+		value /= 10;
+	} while (value);
+	for (int i = num_digits; i < min_digits; i++) {
+		text.data[text.size] = '0';
+		text.size++;
 	}
-	if (input_data.released.bits.shoot) {
-		return char_codes::shoot_release;
+	while (num_digits > 0) {
+		num_digits--;
+		text.data[text.size] = digits[num_digits];
+		text.size++;
 	}
+}
 
-	// if only moving, print corresponding movement character
-	return char_codes::movement[(input_data.holding.raw >> 4) & 0xf];
+
+inline void text_append_string(text_buffer_t &text, const char *string, size_t length) {
+	memcpy(text.data + text.size, string, length);
+	text.size += length;
 }
 
 
@@ -64,130 +153,248 @@ const uint8_t *get_action_char(th128_input_data_t input_data) {
 	<actions data> (6 bytes per frame, total size = 6 * num_frames)
 	<fps data>     (remaining bytes, contains fps info, length appears to be ceil(num_frames / 2))
 */
-void th128_parse_replay_data(uint8_t *decoded_data, const char *out_file) {
-	printf("Parsing replay data... ");
+bool th128_parse_replay_data(uint8_t *decoded_data, uint32_t size, const char *out_file) {
+	double start_time = stats_start();
 
 	// Parse replay data
 	th128_replay_data_t *replay_data = (th128_replay_data_t*)decoded_data;
-	uint32_t num_stages = replay_data->num_stages;
 
-	th128_stage_header_t *stage_data[3];
-	uint8_t *curr_offset = decoded_data + sizeof(th128_replay_data_t);
+	th128_stage_header_t *stage_data[TH128_MAX_STAGES];
+	uint32_t num_stages = th128_find_stages(decoded_data, size, stage_data, TH128_MAX_STAGES);
+
+	// Frames whose input data fits in each stage, the rest of a corrupt one is left out
+	uint32_t stage_num_frames[TH128_MAX_STAGES];
 	for (uint32_t i = 0; i < num_stages; i++) {
-		stage_data[i] = (th128_stage_header_t *)curr_offset;
-		curr_offset += sizeof(th128_stage_header_t) + stage_data[i]->size;
+		stage_num_frames[i] = stage_data[i]->num_frames;
+		if (stage_num_frames[i] > stage_data[i]->size / sizeof(th128_input_data_t)) {
+			stage_num_frames[i] = stage_data[i]->size / sizeof(th128_input_data_t);
+		}
 	}
 
-	// Write data to file
-	FILE *fp = fopen(out_file, "wb");
+	// Worst case size: the headers, each frame as a 3-byte character plus its line's time, each FPS byte as 3 digits and a separator
+	size_t capacity = 2 * MAX_TEXT_HEADER_SIZE;
+	for (uint32_t i = 0; i < num_stages; i++) {
+		uint64_t num_frames = stage_num_frames[i];
+		capacity += MAX_TEXT_HEADER_SIZE + num_frames * 3 + (num_frames / 60 + 1) * 16 + (uint64_t)stage_data[i]->size * 4;
+	}
+	text_buffer_t text;
+	text.data = th128_thread_workspace().output_data.reserve(capacity);
+	text.size = 0;
+	text.capacity = capacity;
 	
 	/* Replay metadata */
-	fprintf(fp, "Replay data\n");
-	fprintf(fp, "-----------\n");
-	fprintf(fp, "Name: %.*s\n", 8, replay_data->name);
+	text_printf(text, "Replay data\n");
+	text_printf(text, "-----------\n");
+	text_printf(text, "Name: %.*s\n", 8, replay_data->name);
 	
 	// Format timestamp
 	time_t time = replay_data->date;
-	tm *utc_time = gmtime(&time);
+	tm utc_time;
+#ifdef _WIN32
+	gmtime_s(&utc_time, &time);
+#else
+	gmtime_r(&time, &utc_time);
+#endif
 	char date_str[256];
-	strftime(date_str, sizeof(date_str), "%Y-%m-%d %H:%M:%S (UTC)", utc_time);
-	fprintf(fp, "Date: %s\n", date_str);
+	strftime(date_str, sizeof(date_str), "%Y-%m-%d %H:%M:%S (UTC)", &utc_time);
+	text_printf(text, "Date: %s\n", date_str);
 	
-	fprintf(fp, "Score: %u\n", replay_data->score * 10);
-	fprintf(fp, "Slowdown rate: %.2f%%\n", replay_data->slowdown);
-	fprintf(fp, "Number of stages: %u\n", replay_data->num_stages);
+	text_printf(text, "Score: %u\n", replay_data->score * 10);
+	text_printf(text, "Slowdown rate: %.2f%%\n", replay_data->slowdown);
+	text_printf(text, "Number of stages: %u\n", replay_data->num_stages);
 
 	// Handle route bug
-	fprintf(fp, "Route: ");
+	text_printf(text, "Route: ");
 	uint32_t route = replay_data->route;
 	if (route > 6) {
-		fprintf(fp, "Extra+%u (bugged)", route - 6);
+		text_printf(text, "Extra+%u (bugged)", route - 6);
 	} else {
-		fprintf(fp, routes[route]);
+		text_printf(text, "%s", routes[route]);
 	}
-	fprintf(fp, "\n");
+	text_printf(text, "\n");
 
-	fprintf(fp, "Rank: %s\n", ranks[replay_data->rank]);
+	text_printf(text, "Rank: %s\n", table_name(ranks, replay_data->rank));
 	// No need to handle the route bug here, as attempting to save a replay with a last_stage > 0x17 crashes the game
-	fprintf(fp, "Last stage: %s\n", stages[replay_data->last_stage]);
-	fprintf(fp, "\n\n");
+	text_printf(text, "Last stage: %s\n", table_name(stages, replay_data->last_stage));
+	text_printf(text, "\n\n");
 
 	// Game config
-	fprintf(fp, "Game settings\n");
-	fprintf(fp, "-------------\n");
-	fprintf(fp, "Shot button: %02hu\n", replay_data->game_config.shot_button);
-	fprintf(fp, "Bomb button: %02hu\n", replay_data->game_config.bomb_button);
-	fprintf(fp, "Rapid button: %02hu\n", replay_data->game_config.rapid_button);
-	fprintf(fp, "Slow button: %02hu\n", replay_data->game_config.slow_button);
-	fprintf(fp, "Pause button: %02hu\n", replay_data->game_config.pause_button);
-	fprintf(fp, "Joypad sensitivity: %hu\n", replay_data->game_config.joypad_sensitivity);
-	fprintf(fp, "Color mode: %s\n", color_modes[replay_data->game_config.color_mode]);
-	fprintf(fp, "Screen mode: %s\n", screen_modes[replay_data->game_config.screen_mode]);
-	fprintf(fp, "Frameskip: %s\n", frameskip_modes[replay_data->game_config.frameskip]);
-	fprintf(fp, "BGM volume: %hu%%\n", replay_data->game_config.bgm_vol);
-	fprintf(fp, "SFX volume: %hu%%\n", replay_data->game_config.sfx_vol);
-	fprintf(fp, "Input latency: %s\n", input_latency_modes[replay_data->game_config.input_latency]);	
-	fprintf(fp, "Initial window X position: %u\n", replay_data->game_config.window_x);
-	fprintf(fp, "Initial window Y position: %u\n", replay_data->game_config.window_y);
-	fprintf(fp, "Always ask screen mode: %s\n", replay_data->game_config.flags.always_ask ? "enabled" : "disabled");
-	fprintf(fp, "Focus when firing: %s\n", replay_data->game_config.flags.focus_when_firing ? "enabled" : "disabled");
-	fprintf(fp, "Don't use DirectInput: %s\n", replay_data->game_config.flags.not_direct_input ? "enabled" : "disabled");
-	fprintf(fp, "\n\n");
+	text_printf(text, "Game settings\n");
+	text_printf(text, "-------------\n");
+	text_printf(text, "Shot button: %02hu\n", replay_data->game_config.shot_button);
+	text_printf(text, "Bomb button: %02hu\n", replay_data->game_config.bomb_button);
+	text_printf(text, "Rapid button: %02hu\n", replay_data->game_config.rapid_button);
+	text_printf(text, "Slow button: %02hu\n", replay_data->game_config.slow_button);
+	text_printf(text, "Pause button: %02hu\n", replay_data->game_config.pause_button);
+	text_printf(text, "Joypad sensitivity: %hu\n", replay_data->game_config.joypad_sensitivity);
+	text_printf(text, "Color mode: %s\n", table_name(color_modes, replay_data->game_config.color_mode));
+	text_printf(text, "Screen mode: %s\n", table_name(screen_modes, replay_data->game_config.screen_mode));
+	text_printf(text, "Frameskip: %s\n", table_name(frameskip_modes, replay_data->game_config.frameskip));
+	text_printf(text, "BGM volume: %hu%%\n", replay_data->game_config.bgm_vol);
+	text_printf(text, "SFX volume: %hu%%\n", replay_data->game_config.sfx_vol);
+	text_printf(text, "Input latency: %s\n", table_name(input_latency_modes, replay_data->game_config.input_latency));	
+	text_printf(text, "Initial window X position: %u\n", replay_data->game_config.window_x);
+	text_printf(text, "Initial window Y position: %u\n", replay_data->game_config.window_y);
+	text_printf(text, "Always ask screen mode: %s\n", replay_data->game_config.flags.always_ask ? "enabled" : "disabled");
+	text_printf(text, "Focus when firing: %s\n", replay_data->game_config.flags.focus_when_firing ? "enabled" : "disabled");
+	text_printf(text, "Don't use DirectInput: %s\n", replay_data->game_config.flags.not_direct_input ? "enabled" : "disabled");
+	text_printf(text, "\n\n");
 
 	/* Stage data */
 	for (uint32_t i = 0; i < num_stages; i++) {
-		fprintf(fp, "Stage %u data\n", i + 1);
-		fprintf(fp, "------------\n");
-
-		fprintf(fp, "Stage: %s\n", stages[stage_data[i]->stage]);
-		fprintf(fp, "RNG seed: %hu\n", stage_data[i]->seed);
-		fprintf(fp, "Number of frames: %u\n", stage_data[i]->num_frames);
-		fprintf(fp, "Initial score: %u\n", stage_data[i]->score * 10);
-		fprintf(fp, "Level: %u\n", stage_data[i]->shot_power + 1);
-		fprintf(fp, "X position: %.2f\n", stage_data[i]->pos_x / 128.0f);
-		fprintf(fp, "Y position: %.2f\n", stage_data[i]->pos_y / 128.0f);
-		fprintf(fp, "Continues used: %d\n", stage_data[i]->continues);
-		fprintf(fp, "Graze: %d\n", stage_data[i]->graze);
-		fprintf(fp, "Motivation: %.2f%%\n", stage_data[i]->motivation / 100.0f);
-		fprintf(fp, "Perfect freeze: %.2f%%\n", stage_data[i]->perfect_freeze / 100.0f);
-		fprintf(fp, "Freeze area: %.2f%%\n", stage_data[i]->freeze_area);
-
-		fprintf(fp, "\n= Time =   ========================= Actions ==========================\n");
+		text_printf(text, "Stage %u data\n", i + 1);
+		text_printf(text, "------------\n");
+
+		text_printf(text, "Stage: %s\n", table_name(stages, stage_data[i]->stage));
+		text_printf(text, "RNG seed: %hu\n", stage_data[i]->seed);
+		text_printf(text, "Number of frames: %u\n", stage_data[i]->num_frames);
+		text_printf(text, "Initial score: %u\n", stage_data[i]->score * 10);
+		text_printf(text, "Level: %u\n", stage_data[i]->shot_power + 1);
+		text_printf(text, "X position: %.2f\n", stage_data[i]->pos_x / 128.0f);
+		text_printf(text, "Y position: %.2f\n", stage_data[i]->pos_y / 128.0f);
+		text_printf(text, "Continues used: %d\n", stage_data[i]->continues);
+		text_printf(text, "Graze: %d\n", stage_data[i]->graze);
+		text_printf(text, "Motivation: %.2f%%\n", stage_data[i]->motivation / 100.0f);
+		text_printf(text, "Perfect freeze: %.2f%%\n", stage_data[i]->perfect_freeze / 100.0f);
+		text_printf(text, "Freeze area: %.2f%%\n", stage_data[i]->freeze_area);
+
+		text_printf(text, "\n= Time =   ========================= Actions ==========================\n");
 		th128_input_data_t *input_data = (th128_input_data_t *)(((uint8_t *)stage_data[i]) + sizeof(th128_stage_header_t));
-		uint8_t actions_str[241] = {0};
-		size_t actions_str_idx = 0;
-		for (uint32_t j = 0; j < stage_data[i]->num_frames; j++) {
+		uint32_t num_frames = stage_num_frames[i];
+		for (uint32_t j = 0; j < num_frames; j++) {
 			if (j % 60 == 0) {
-				fprintf(fp, "[%06d]   ", j / 60);
+				text.data[text.size] = '[';
+				text.size++;
+				text_append_uint(text, j / 60, 6);
+				text_append_string(text, "]   ", 4);
 			}
-			const uint8_t *action_char = get_action_char(input_data[j]);
-			append_utf8_char(actions_str, actions_str_idx, action_char);
+			// the 4th byte is overwritten by the next character or newline
+			memcpy(text.data + text.size, &action_chars.chars[action_char_index(input_data[j])], 4);
+			text.size += action_chars.chars[action_char_index(input_data[j])].length;
 			if (j % 60 == 59) {
-				fprintf(fp, "%s\n", actions_str);
-				memset(actions_str, 0, sizeof(actions_str));
-				actions_str_idx = 0;
+				text.data[text.size] = '\n';
+				text.size++;
 			}
 		}
-		if (stage_data[i]->num_frames % 60) {
-			fprintf(fp, "%s\n", (char *)actions_str);
+		if (num_frames % 60) {
+			text.data[text.size] = '\n';
+			text.size++;
 		}
 
-		fprintf(fp, "\nFPS data:\n");
-		uint8_t *fps_data = ((uint8_t *)input_data) + stage_data[i]->num_frames * 6;
-		uint32_t fps_data_size = stage_data[i]->size - stage_data[i]->num_frames * 6;
+		text_printf(text, "\nFPS data:\n");
+		uint8_t *fps_data = ((uint8_t *)input_data) + num_frames * 6;
+		uint32_t fps_data_size = stage_data[i]->size - num_frames * 6;
 		for (uint32_t j = 0; j < fps_data_size; j++) {
-			fprintf(fp, "%02d", fps_data[j]);
-			if (j % 24 == 23) {
-				fprintf(fp, "\n");
-			} else {
-				fprintf(fp, " ");
-			}
+			text_append_uint(text, fps_data[j], 2);
+			text.data[text.size] = j % 24 == 23 ? '\n' : ' ';
+			text.size++;
+		}
+		text_printf(text, "\n\n\n");
+	}
+	stats_stop(STATS_PARSE, start_time);
+
+	// Write data to file
+	const file_part_t part = {text.data, text.size};
+	return write_file_parts(out_file, "", &part, 1);
+}
+
+
+/*
+	Columnar data structure:
+	th128_columnar_header_t                    (0x30 bytes)
+	th128_columnar_stage_t[num_stages]         (0x58 bytes each)
+	<holding, pressed and released columns and FPS data of stage 1>
+	<same for stage 2>
+	...
+
+	Every value of the input records is kept (unlike in the text, which shows a single character per frame),
+	each in its own array, so a whole column can be read straight from a memory-mapped file. Columns start at
+	offsets aligned to 8 bytes, padded with zeros. Stages whose input data doesn't fit in their size keep only
+	the frames that do.
+*/
+static_assert(sizeof(th128_columnar_header_t) == 0x30, "unexpected columnar header size");
+static_assert(sizeof(th128_columnar_stage_t) == 0x58, "unexpected columnar stage size");
+
+
+inline uint64_t align8(uint64_t offset) {
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+
+bool th128_write_columnar_data(uint8_t *decoded_data, uint32_t size, const char *out_file) {
+	double start_time = stats_start();
+
+	th128_stage_header_t *stage_data[TH128_MAX_STAGES];
+	uint32_t num_stages = th128_find_stages(decoded_data, size, stage_data, TH128_MAX_STAGES);
+
+	// Lay out the stages
+	th128_columnar_stage_t columnar_stages[TH128_MAX_STAGES];
+	uint64_t curr_offset = sizeof(th128_columnar_header_t) + num_stages * sizeof(th128_columnar_stage_t);
+	for (uint32_t i = 0; i < num_stages; i++) {
+		const th128_stage_header_t *stage = stage_data[i];
+		uint32_t num_frames = stage->num_frames;
+		if (num_frames > stage->size / sizeof(th128_input_data_t)) {
+			num_frames = stage->size / sizeof(th128_input_data_t);
 		}
-		fprintf(fp, "\n\n\n");
+		th128_columnar_stage_t &columnar_stage = columnar_stages[i];
+		columnar_stage.stage = stage->stage;
+		columnar_stage.seed = stage->seed;
+		columnar_stage.num_frames = num_frames;
+		columnar_stage.score = stage->score;
+		columnar_stage.shot_power = stage->shot_power;
+		columnar_stage.max_piv = stage->max_piv;
+		columnar_stage.pos_x = stage->pos_x;
+		columnar_stage.pos_y = stage->pos_y;
+		columnar_stage.continues = stage->continues;
+		columnar_stage.graze = stage->graze;
+		columnar_stage.motivation = stage->motivation;
+		columnar_stage.perfect_freeze = stage->perfect_freeze;
+		columnar_stage.freeze_area = stage->freeze_area;
+		columnar_stage.fps_size = stage->size - num_frames * sizeof(th128_input_data_t);
+
+		uint64_t column_size = align8(num_frames * sizeof(uint16_t));
+		columnar_stage.holding_offset = curr_offset;
+		columnar_stage.pressed_offset = curr_offset + column_size;
+		columnar_stage.released_offset = curr_offset + 2 * column_size;
+		columnar_stage.fps_offset = curr_offset + 3 * column_size;
+		curr_offset = align8(columnar_stage.fps_offset + columnar_stage.fps_size);
 	}
-	fclose(fp);
 
-	printf("done.\n");
+	uint8_t *out_data = th128_thread_workspace().output_data.reserve(curr_offset);
+	memset(out_data, 0, curr_offset);
+
+	const th128_replay_data_t *replay_data = (const th128_replay_data_t *)decoded_data;
+	th128_columnar_header_t *header = (th128_columnar_header_t *)out_data;
+	header->magic = TH128_COLUMNAR_MAGIC;
+	header->version = TH128_COLUMNAR_VERSION;
+	header->date = replay_data->date;
+	header->score = replay_data->score;
+	header->route = replay_data->route;
+	header->rank = replay_data->rank;
+	header->last_stage = replay_data->last_stage;
+	header->slowdown = replay_data->slowdown;
+	header->num_stages = num_stages;
+	header->stages_offset = sizeof(th128_columnar_header_t);
+	memcpy(out_data + header->stages_offset, columnar_stages, num_stages * sizeof(th128_columnar_stage_t));
+
+	// Split the input records into columns
+	for (uint32_t i = 0; i < num_stages; i++) {
+		const th128_columnar_stage_t &stage = columnar_stages[i];
+		const th128_input_data_t *input_data = (const th128_input_data_t *)((uint8_t *)stage_data[i] + sizeof(th128_stage_header_t));
+		uint16_t *holding = (uint16_t *)(out_data + stage.holding_offset);
+		uint16_t *pressed = (uint16_t *)(out_data + stage.pressed_offset);
+		uint16_t *released = (uint16_t *)(out_data + stage.released_offset);
+		for (uint32_t j = 0; j < stage.num_frames; j++) {
+			holding[j] = input_data[j].holding.raw;
+			pressed[j] = input_data[j].pressed.raw;
+			released[j] = input_data[j].released.raw;
+		}
+		memcpy(out_data + stage.fps_offset, input_data + stage.num_frames, stage.fps_size);
+	}
+	stats_stop(STATS_PARSE, start_time);
+
+	const file_part_t part = {out_data, curr_offset};
+	return write_file_parts(out_file, "", &part, 1);
 }
 
 
@@ -199,46 +406,54 @@ void th128_parse_replay_data(uint8_t *decoded_data, const char *out_file) {
 
 	size of encoded data found at offset 0x1c of th128_replay_header_t
 */
-bool th128_decode_replay_file(const char *file) {
-	// Read file
-	FILE *fp = fopen(file, "rb");
-	if (!fp) {
-		perror("Error");
+bool th128_decode_replay_file(const char *file, th128_decode_format_t format) {
+	// Open file, replays of other games only get their data decoded
+	th128_replay_file_t replay;
+	if (!open_input_file(file, &replay.file)) {
 		return false;
 	}
-
-	fseek(fp, 0L, SEEK_END);
-	uint32_t file_size = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
-	
-	uint8_t *file_data = new unsigned char[file_size];
-	fread(file_data, file_size, 1, fp);
-	fclose(fp);
-	
-	// Parse file header
-	th128_replay_header_t *header = (th128_replay_header_t *)file_data;
-	uint8_t *encoded_data = file_data + sizeof(th128_replay_header_t);
-	uint32_t compressed_size = header->compressed_data_size;
-	uint32_t uncompressed_size = header->uncompressed_data_size;
+	const game_descriptor_t *game = sniff_game(replay.file.data, replay.file.size);
+	if (game && game != &game_th128) {
+		bool decoded = game_decode_replay_file(game, file, replay.file.data, replay.file.size);
+		close_input_file(&replay.file);
+		return decoded;
+	}
+	th128_error_t error = th128_load_replay_file(&replay);
+	if (error != TH128_OK) {
+		th128_log_error(error, &replay);
+		return false;
+	}
+	uint32_t compressed_size = replay.header->compressed_data_size;
+	uint32_t uncompressed_size = replay.header->uncompressed_data_size;
 
 	// Decode data and save it to RAW file
-	uint8_t *decoded_data = th128_decode_replay_data(encoded_data, compressed_size, uncompressed_size);
-	if (decoded_data == NULL) {
-		delete[] file_data;
+	th128_workspace_t &workspace = th128_thread_workspace();
+	uint8_t *decrypted_data = workspace.decrypted_data.reserve(compressed_size);
+	uint8_t *decoded_data = workspace.decoded_data.reserve(uncompressed_size);
+	error = th128_decode_replay_data_to(replay.encoded_data, decrypted_data, compressed_size, decoded_data, uncompressed_size);
+	th128_close_replay_file(&replay);
+	if (error != TH128_OK) {
+		th128_log_error(error);
 		return false;
 	}
-	write_file(file, ".raw", decoded_data, uncompressed_size);
+	// stdout only gets the output of the chosen format
+	bool to_stdout = !strcmp(file, STDIO_PATH);
+	if (format == TH128_DECODE_RAW || !to_stdout) {
+		const file_part_t part = {decoded_data, uncompressed_size};
+		bool written = write_file_parts(file, ".raw", &part, 1);
+		if (format == TH128_DECODE_RAW) {
+			return written;
+		}
+	}
 
-	// Parse decoded data and write to TXT file (UTF-8)
+	// Parse decoded data and write to TXT file (UTF-8), or export it as columns
 	char out_file[256];
-	sprintf(out_file, "%s.txt", file);
-	th128_parse_replay_data(decoded_data, out_file);
-
-	// Clean up
-	delete[] file_data;
-	delete[] decoded_data;
-
-	return true;
+	const char *suffix = format == TH128_DECODE_COLUMNAR ? ".cols" : ".txt";
+	snprintf(out_file, sizeof(out_file), "%s%s", file, to_stdout ? "" : suffix);
+	if (format == TH128_DECODE_COLUMNAR) {
+		return th128_write_columnar_data(decoded_data, uncompressed_size, out_file);
+	}
+	return th128_parse_replay_data(decoded_data, uncompressed_size, out_file);
 }
 
 
@@ -255,61 +470,45 @@ bool th128_decode_replay_file(const char *file) {
 */
 bool th128_parse_user_data(const char *file) {
 	// Open file
-	FILE *fp = fopen(file, "rb");
-	if (!fp) {
-		perror("Error");
-		return false;
-	}
-	printf("Parsing user data... ");
-
-	// Seek to user data section
-	fseek(fp, offsetof(th128_replay_header_t, user_data_offset), SEEK_SET);
-	uint32_t user_data_offset = 34;
-	fread(&user_data_offset, sizeof(uint32_t), 1, fp);
-	fseek(fp, user_data_offset, SEEK_SET);
-
-	// Check magic string
-	char user_str[5];
-	fscanf(fp, "%4s", user_str);
-	if (strcmp(user_str, "USER")) {
-		printf("ERROR: unexpected magic string at user data (offset = %u)\n", user_data_offset);
-		return false;
-	}
-	
-	// Read replay info
-	uint64_t replay_info_size;
-	fread(&replay_info_size, sizeof(uint64_t), 1, fp);
-	replay_info_size -= 0xc;  // remove magic and size
-	char *replay_info = new char[replay_info_size];
-	fread(replay_info, 1, replay_info_size, fp);
-
-	// Check magic string again
-	fscanf(fp, "%4s", user_str);
-	if (strcmp(user_str, "USER")) {
-		printf("ERROR: unexpected magic string at user comment (offset = %u)\n", user_data_offset);
-		delete[] replay_info;
+	input_file_t input;
+	if (!open_input_file(file, &input)) {
 		return false;
 	}
 
-	// Read user comment
-	uint64_t comment_size;
-	fread(&comment_size, sizeof(uint64_t), 1, fp);
-	comment_size -= 0xc;  // remove magic and size
-	char *user_comment = new char[comment_size];
-	fread(user_comment, 1, comment_size, fp);
+	// Find user data section
+	const th128_replay_header_t *header = (const th128_replay_header_t *)input.data;
+	uint32_t user_data_offset = input.size >= sizeof(th128_replay_header_t) ? header->user_data_offset : 0;
+
+	// Read both sections, checking their magic strings
+	const char *sections[2];
+	size_t section_sizes[2];
+	const char *const section_names[] = {"user data", "user comment"};
+	uint64_t curr_offset = user_data_offset;
+	for (int i = 0; i < 2; i++) {
+		const th128_user_data_header_t *section = (const th128_user_data_header_t *)(input.data + curr_offset);
+		if (curr_offset > input.size || input.size - curr_offset < sizeof(th128_user_data_header_t) || section->magic != TH128_USER_MAGIC) {
+			log_printf("ERROR: unexpected magic string at %s (offset = %u)\n", section_names[i], user_data_offset);
+			close_input_file(&input);
+			return false;
+		}
+		if (section->size < sizeof(th128_user_data_header_t) || section->size > input.size - curr_offset) {
+			log_printf("ERROR: %s doesn't fit in the file (offset = %u)\n", section_names[i], user_data_offset);
+			close_input_file(&input);
+			return false;
+		}
+		sections[i] = (const char *)section + sizeof(th128_user_data_header_t);
+		// strings end at their first null character
+		section_sizes[i] = strnlen(sections[i], section->size - sizeof(th128_user_data_header_t));
+		curr_offset += section->size;
+	}
 	
 	// Write file (Shift JIS encoded)
-	char file_user[256];
-	sprintf(file_user, "%s.user.txt", file);
-	FILE *fp_user = fopen(file_user, "wb");
-	fputs(replay_info, fp_user);
-	fputs(user_comment, fp_user);
-	fclose(fp_user);
-
-	// Clean up
-	delete[] replay_info;
-	delete[] user_comment;
-
-	printf("done.\n");
-	return true;
+	const file_part_t parts[] = {
+		{(const uint8_t *)sections[0], section_sizes[0]},
+		{(const uint8_t *)sections[1], section_sizes[1]}
+	};
+	bool written = write_file_parts(file, ".user.txt", parts, 2);
+
+	close_input_file(&input);
+	return written;
 }
@@ -5,28 +5,28 @@
 
 // utf-8 char codes
 namespace char_codes {
-    const uint8_t noop[] = {'.'};
-
-    const uint8_t left[] = {0xE2, 0x86, 0x90};
-    const uint8_t up[] = {0xE2, 0x86, 0x91};
-    const uint8_t right[] = {0xE2, 0x86, 0x92};
-    const uint8_t down[] = {0xE2, 0x86, 0x93};
-    const uint8_t up_left[] = {0xE2, 0x86, 0x96};
-    const uint8_t up_right[] = {0xE2, 0x86, 0x97};
-    const uint8_t down_right[] = {0xE2, 0x86, 0x98};
-    const uint8_t down_left[] = {0xE2, 0x86, 0x99};
-
-    const uint8_t bomb[] = {'B'};
-    const uint8_t focus_press[] = {'F'};
-    const uint8_t focus_release[] = {'f'};
-    const uint8_t shoot_press[] = {'S'};
-    const uint8_t shoot_release[] = {'s'};
-    const uint8_t autoshoot_press[] = {'A'};
-    const uint8_t autoshoot_release[] = {'a'};
-    const uint8_t quit[] = {'Q'};
+    constexpr uint8_t noop[] = {'.'};
+
+    constexpr uint8_t left[] = {0xE2, 0x86, 0x90};
+    constexpr uint8_t up[] = {0xE2, 0x86, 0x91};
+    constexpr uint8_t right[] = {0xE2, 0x86, 0x92};
+    constexpr uint8_t down[] = {0xE2, 0x86, 0x93};
+    constexpr uint8_t up_left[] = {0xE2, 0x86, 0x96};
+    constexpr uint8_t up_right[] = {0xE2, 0x86, 0x97};
+    constexpr uint8_t down_right[] = {0xE2, 0x86, 0x98};
+    constexpr uint8_t down_left[] = {0xE2, 0x86, 0x99};
+
+    constexpr uint8_t bomb[] = {'B'};
+    constexpr uint8_t focus_press[] = {'F'};
+    constexpr uint8_t focus_release[] = {'f'};
+    constexpr uint8_t shoot_press[] = {'S'};
+    constexpr uint8_t shoot_release[] = {'s'};
+    constexpr uint8_t autoshoot_press[] = {'A'};
+    constexpr uint8_t autoshoot_release[] = {'a'};
+    constexpr uint8_t quit[] = {'Q'};
 
     // direction inputs to movement mapping
-    const uint8_t *const movement[] = {
+    constexpr const uint8_t *movement[] = {
         noop, up, down, down,
         left, up_left, down_left, up_left,
         right, up_right, down_right, up_right,
@@ -42,6 +42,55 @@ const char *const frameskip_modes[] = {"None", "1/2", "1/3"};
 const char *const input_latency_modes[] = {"Stable", "Normal", "Automatic", "Fast"};
 
 
-void th128_parse_replay_data(uint8_t *decoded_data, const char *out_file);
-bool th128_decode_replay_file(const char *file);
+// Columnar export of the decoded data (see th128_write_columnar_data), all values are little-endian
+const uint32_t TH128_COLUMNAR_MAGIC = 0x4c433854; // 'T8CL'
+const uint32_t TH128_COLUMNAR_VERSION = 1;
+
+// Size: 0x30
+struct th128_columnar_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t date; // Unix timestamp
+	uint32_t score; // missing a trailing 0
+	uint32_t route; // bugged if > 6
+	uint32_t rank;
+	uint32_t last_stage;
+	float slowdown;
+	uint32_t num_stages;
+	uint64_t stages_offset; // offset of th128_columnar_stage_t[num_stages]
+};
+
+// Size: 0x58
+struct th128_columnar_stage_t {
+	uint32_t stage;
+	uint32_t seed;
+	uint32_t num_frames;
+	uint32_t score; // missing a trailing 0
+	uint32_t shot_power; // must add 1
+	uint32_t max_piv; // must divide by 100
+	int32_t pos_x; // subpixel (*128), origin is middle
+	int32_t pos_y; // subpixel (*128), origin is top
+	uint32_t continues;
+	uint32_t graze;
+	uint32_t motivation; // must divide by 100
+	uint32_t perfect_freeze; // must divide by 100
+	float freeze_area;
+	uint32_t fps_size; // bytes of FPS data
+	// offsets of the columns from the start of the file, each one aligned to 8 bytes
+	uint64_t holding_offset; // uint16_t[num_frames], th128_key_data_t
+	uint64_t pressed_offset; // uint16_t[num_frames]
+	uint64_t released_offset; // uint16_t[num_frames]
+	uint64_t fps_offset; // uint8_t[fps_size]
+};
+
+enum th128_decode_format_t {
+	TH128_DECODE_TEXT, // .txt
+	TH128_DECODE_COLUMNAR, // .cols
+	TH128_DECODE_RAW // only the .raw file that's written with the others
+};
+
+
+bool th128_parse_replay_data(uint8_t *decoded_data, uint32_t size, const char *out_file);
+bool th128_write_columnar_data(uint8_t *decoded_data, uint32_t size, const char *out_file);
+bool th128_decode_replay_file(const char *file, th128_decode_format_t format = TH128_DECODE_TEXT);
 bool th128_parse_user_data(const char *file);
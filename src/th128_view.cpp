@@ -0,0 +1,88 @@
+#include "th128_view.h"
+
+#include "compression.h"
+
+
+// Checks that the sections of a replay file fit in it without overlapping. The user sections are optional, a replay
+// with broken user data is still valid (num_user_sections tells how many were found).
+th128_error_t th128_view_replay(const uint8_t *file_data, uint64_t size, th128_replay_view_t *view) {
+	const th128_replay_header_t *header = (const th128_replay_header_t *)file_data;
+	if (size < sizeof(th128_replay_header_t) || header->magic != TH128_REPLAY_MAGIC) {
+		return TH128_ERROR_NOT_A_REPLAY;
+	}
+	if (header->compressed_data_size > size - sizeof(th128_replay_header_t) || header->user_data_offset > size) {
+		return TH128_ERROR_TRUNCATED;
+	}
+	if (header->user_data_offset < sizeof(th128_replay_header_t) + (uint64_t)header->compressed_data_size) {
+		return TH128_ERROR_OVERLAPPING_DATA;
+	}
+
+	view->header = header;
+	view->encoded_data = {file_data + sizeof(th128_replay_header_t), header->compressed_data_size};
+	view->user_data = {file_data + header->user_data_offset, (uint32_t)(size - header->user_data_offset)};
+	view->num_user_sections = 0;
+	uint64_t curr_offset = 0;
+	while (view->num_user_sections < TH128_MAX_USER_SECTIONS && view->user_data.size - curr_offset >= sizeof(th128_user_data_header_t)) {
+		const th128_user_data_header_t *section = (const th128_user_data_header_t *)(view->user_data.data + curr_offset);
+		if (section->magic != TH128_USER_MAGIC || section->size < sizeof(th128_user_data_header_t) || section->size > view->user_data.size - curr_offset) {
+			break;
+		}
+		view->user_sections[view->num_user_sections++] = {(const uint8_t *)(section + 1), (uint32_t)(section->size - sizeof(th128_user_data_header_t))};
+		curr_offset += section->size;
+	}
+	return TH128_OK;
+}
+
+
+// Finds the stages of the decoded data (see decoded data structure in th128_parse.cpp). Replays with more
+// stages than a full route, or whose stages don't fit in the data, are broken.
+th128_error_t th128_view_replay_data(const uint8_t *decoded_data, uint32_t size, th128_data_view_t *view) {
+	if (size < sizeof(th128_replay_data_t)) {
+		return TH128_ERROR_BAD_REPLAY_DATA;
+	}
+	view->replay_data = (const th128_replay_data_t *)decoded_data;
+	view->num_stages = 0;
+	if (view->replay_data->num_stages > TH128_MAX_STAGES) {
+		return TH128_ERROR_BAD_REPLAY_DATA;
+	}
+
+	uint32_t curr_offset = sizeof(th128_replay_data_t);
+	for (uint32_t i = 0; i < view->replay_data->num_stages; i++) {
+		const th128_stage_header_t *header = (const th128_stage_header_t *)(decoded_data + curr_offset);
+		if (size - curr_offset < sizeof(th128_stage_header_t) || size - curr_offset - sizeof(th128_stage_header_t) < header->size) {
+			return TH128_ERROR_BAD_REPLAY_DATA;
+		}
+		th128_stage_view_t &stage = view->stages[view->num_stages++];
+		stage.header = header;
+		stage.inputs = (const th128_input_data_t *)(header + 1);
+		uint32_t max_inputs = header->size / sizeof(th128_input_data_t);
+		stage.num_inputs = header->num_frames < max_inputs ? header->num_frames : max_inputs;
+		uint32_t inputs_size = stage.num_inputs * sizeof(th128_input_data_t);
+		stage.fps_data = {(const uint8_t *)stage.inputs + inputs_size, header->size - inputs_size};
+		curr_offset += sizeof(th128_stage_header_t) + header->size;
+	}
+	return TH128_OK;
+}
+
+
+// Decrypts the encoded data of a replay into decrypted_data (at least encoded_data.size bytes), then decompresses
+// it into decoded_data (at least header->uncompressed_data_size bytes)
+th128_error_t th128_view_decode(const th128_replay_view_t *view, uint8_t *decrypted_data, uint32_t decrypted_capacity, uint8_t *decoded_data, uint32_t decoded_capacity) {
+	uint32_t compressed_size = view->encoded_data.size;
+	uint32_t uncompressed_size = view->header->uncompressed_data_size;
+	if (decrypted_capacity < compressed_size || decoded_capacity < uncompressed_size) {
+		return TH128_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	return th128_decode_replay_data_to(view->encoded_data.data, decrypted_data, compressed_size, decoded_data, uncompressed_size);
+}
+
+
+// Compresses and encrypts decoded data into encoded_data, which needs at least compress_bound(size) bytes
+th128_error_t th128_view_encode(uint8_t *decoded_data, uint32_t size, uint8_t *encoded_data, uint32_t capacity, uint32_t &encoded_size, const compression_options_t &options) {
+	if (capacity < compress_bound(size)) {
+		return TH128_ERROR_BUFFER_TOO_SMALL;
+	}
+	encoded_size = th128_encode_replay_data_to(decoded_data, size, encoded_data, options);
+	return TH128_OK;
+}
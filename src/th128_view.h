@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "types.h"
+#include "compression.h"
+#include "th128_core.h"
+
+
+/*
+	Library layer:
+
+	Views point into data owned by the caller (e.g. a replay file already in memory) and are only valid as long
+	as it is. The offsets are checked once when making a view, after that its spans can be used as is. Nothing
+	here prints or allocates, errors are returned as codes (th128_error_t), so it can be called from any thread on any data.
+	The only buffers not given by the caller are the ones the compressor keeps per thread, which grow on the
+	first replays and are then reused, and the ones for each segment when compressing with several threads.
+*/
+
+// Bytes in data owned by someone else
+struct th128_span_t {
+	const uint8_t *data;
+	uint32_t size;
+};
+
+// Replay info and comment
+const uint32_t TH128_MAX_USER_SECTIONS = 2;
+
+// Replay file, see th128_view_replay
+struct th128_replay_view_t {
+	const th128_replay_header_t *header;
+	th128_span_t encoded_data;
+	th128_span_t user_data; // all of it, including the section headers
+	th128_span_t user_sections[TH128_MAX_USER_SECTIONS]; // contents of each USER section, without its header
+	uint32_t num_user_sections; // sections that fit in the user data, in order
+};
+
+struct th128_stage_view_t {
+	const th128_stage_header_t *header;
+	const th128_input_data_t *inputs; // one per frame
+	uint32_t num_inputs; // header->num_frames, or the inputs that fit in the stage data if fewer
+	th128_span_t fps_data; // rest of the stage data
+};
+
+// Decoded replay data, see th128_view_replay_data
+struct th128_data_view_t {
+	const th128_replay_data_t *replay_data;
+	th128_stage_view_t stages[TH128_MAX_STAGES];
+	uint32_t num_stages;
+};
+
+
+th128_error_t th128_view_replay(const uint8_t *file_data, uint64_t size, th128_replay_view_t *view);
+th128_error_t th128_view_replay_data(const uint8_t *decoded_data, uint32_t size, th128_data_view_t *view);
+th128_error_t th128_view_decode(const th128_replay_view_t *view, uint8_t *decrypted_data, uint32_t decrypted_capacity, uint8_t *decoded_data, uint32_t decoded_capacity);
+th128_error_t th128_view_encode(uint8_t *decoded_data, uint32_t size, uint8_t *encoded_data, uint32_t capacity, uint32_t &encoded_size, const compression_options_t &options = compression_options_t());
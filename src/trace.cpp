@@ -0,0 +1,139 @@
+#include "trace.h"
+
+#ifdef TH128_TRACE
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+#include "utils.h"
+
+
+/*
+	Tracing:
+
+	Each thread records its events into its own buffer, so recording never waits for other threads. A buffer is
+	added to a global list the first time its thread records an event, with a compare-and-swap, and stays alive
+	after its thread ends, until the trace is written. Events are only written once all the threads are done.
+
+	Events are complete events ("ph": "X"): name, start and duration, tagged with the file the thread was
+	processing. Times are in microseconds since tracing started.
+*/
+
+struct trace_event_t {
+	const char *name;
+	const char *file;
+	double start_time; // ms
+	double end_time; // ms
+};
+
+struct trace_buffer_t {
+	trace_event_t *events;
+	uint32_t size;
+	uint32_t capacity;
+	uint32_t thread_id;
+	trace_buffer_t *next;
+};
+
+
+bool trace_enabled = false;
+double trace_start_time;
+std::atomic<trace_buffer_t *> trace_buffers(NULL);
+std::atomic<uint32_t> trace_num_threads(0);
+
+thread_local trace_buffer_t *curr_trace_buffer = NULL;
+thread_local const char *curr_trace_file = NULL;
+
+
+void trace_start() {
+	trace_start_time = get_time_ms();
+	trace_enabled = true;
+}
+
+
+// Tags the events of the current thread with a file, until set to NULL
+void trace_set_file(const char *file) {
+	curr_trace_file = file;
+}
+
+
+trace_buffer_t *trace_thread_buffer() {
+	if (curr_trace_buffer) {
+		return curr_trace_buffer;
+	}
+	trace_buffer_t *buffer = new trace_buffer_t;
+	buffer->events = NULL;
+	buffer->size = 0;
+	buffer->capacity = 0;
+	buffer->thread_id = trace_num_threads++;
+	buffer->next = trace_buffers;
+	while (!trace_buffers.compare_exchange_weak(buffer->next, buffer)) {}
+	curr_trace_buffer = buffer;
+	return buffer;
+}
+
+
+// Records an event of the current thread, times come from get_time_ms
+void trace_event(const char *name, double start_time, double end_time) {
+	trace_buffer_t *buffer = trace_thread_buffer();
+	if (buffer->size == buffer->capacity) {
+		uint32_t new_capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+		trace_event_t *new_events = new trace_event_t[new_capacity];
+		memcpy(new_events, buffer->events, buffer->size * sizeof(trace_event_t));
+		delete[] buffer->events;
+		buffer->events = new_events;
+		buffer->capacity = new_capacity;
+	}
+	trace_event_t &event = buffer->events[buffer->size];
+	event.name = name;
+	event.file = curr_trace_file;
+	event.start_time = start_time;
+	event.end_time = end_time;
+	buffer->size++;
+}
+
+
+// Writes the events of all threads and frees them. Must be called once the threads are done.
+bool trace_write(const char *path) {
+	FILE *fp = fopen(path, "wb");
+	if (!fp) {
+		log_perror("Error");
+		return false;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	trace_buffer_t *buffer = trace_buffers.exchange(NULL);
+	while (buffer) {
+		fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+			first ? "" : ",\n", buffer->thread_id, buffer->thread_id);
+		first = false;
+		for (uint32_t i = 0; i < buffer->size; i++) {
+			const trace_event_t &event = buffer->events[i];
+			fprintf(fp, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"name\":", buffer->thread_id,
+				(event.start_time - trace_start_time) * 1000, (event.end_time - event.start_time) * 1000);
+			print_json_string(fp, event.name);
+			if (event.file) {
+				fprintf(fp, ",\"args\":{\"file\":");
+				print_json_string(fp, event.file);
+				fprintf(fp, "}");
+			}
+			fprintf(fp, "}");
+		}
+
+		trace_buffer_t *next = buffer->next;
+		delete[] buffer->events;
+		delete buffer;
+		buffer = next;
+	}
+	fprintf(fp, "\n]}\n");
+	curr_trace_buffer = NULL;
+
+	if (fclose(fp) != 0) {
+		log_perror("Error");
+		return false;
+	}
+	return true;
+}
+
+#endif
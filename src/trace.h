@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Timeline of what each thread did, written in the Chrome trace event format (loads in chrome://tracing and Perfetto).
+// Only compiled in when building with TRACE=1, otherwise none of this exists and the calls below are removed.
+#ifdef TH128_TRACE
+
+extern bool trace_enabled;
+
+
+void trace_start();
+void trace_set_file(const char *file);
+void trace_event(const char *name, double start_time, double end_time);
+bool trace_write(const char *path);
+
+#endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 
 // Prevent struct padding
@@ -142,3 +143,9 @@ const char *const stages[] = {
 	"C1 All", "C2 All", // 15 ~ 16
 	"Ex All", // 17
 };
+
+// Name of a value in one of the tables, "?" if the table doesn't have it (broken or crafted replays)
+template <size_t N>
+inline const char *table_name(const char *const (&names)[N], uint32_t value) {
+	return value < N && names[value] ? names[value] : "?";
+}
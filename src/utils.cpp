@@ -1,54 +1,346 @@
 #include "utils.h"
 
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <atomic>
+#include <chrono>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 
-void write_file(const char *path, const char *suffix, uint8_t *data, size_t data_length) {
-    size_t new_path_len = strlen(path) + strlen(suffix);
-    char *new_path = new char[new_path_len + 1];
-    sprintf(new_path, "%s%s", path, suffix);
+// Reads all of stdin, its size isn't known until the end so the buffer grows as needed
+bool read_stdin(input_file_t *file) {
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	size_t capacity = 0x10000;
+	size_t size = 0;
+	uint8_t *buffer = new uint8_t[capacity];
+	size_t bytes_read;
+	while ((bytes_read = fread(buffer + size, 1, capacity - size, stdin)) > 0) {
+		size += bytes_read;
+		if (size == capacity) {
+			uint8_t *new_buffer = new uint8_t[capacity * 2];
+			memcpy(new_buffer, buffer, size);
+			delete[] buffer;
+			buffer = new_buffer;
+			capacity *= 2;
+		}
+	}
+	if (ferror(stdin)) {
+		log_perror("Error");
+		delete[] buffer;
+		return false;
+	}
+	file->data = buffer;
+	file->size = size;
+	return true;
+}
 
-    FILE *fp = fopen(new_path, "wb");
-    fwrite(data, 1, data_length, fp);
-    fclose(fp);
 
-    delete[] new_path;
+// Whether the current thread maps the files it opens, see set_input_mapping
+thread_local bool curr_map_inputs = true;
+
+
+// Sets whether the current thread maps the files it opens or reads them into memory. Files that may be truncated
+// while in use must be read, as touching a page of a mapping past the new end of the file raises SIGBUS.
+void set_input_mapping(bool map) {
+	curr_map_inputs = map;
 }
 
 
-void append_utf8_char(uint8_t *string, size_t &idx, const uint8_t *utf8_char) {
-	uint8_t first_byte = *utf8_char;
-	int num_bytes;
-	if (first_byte < 0x80) {
-		num_bytes = 1;
-	} else if (first_byte < 0xc0) {
-		num_bytes = -1;
-	} else if (first_byte < 0xe0) {
-		num_bytes = 2;
-	} else if (first_byte < 0xf0) {
-		num_bytes = 3;
-	} else if (first_byte < 0xf8) {
-		num_bytes = 4;
-	} else {
-		num_bytes = -1;
+bool map_input_file(const char *path, input_file_t *file) {
+	file->data = NULL;
+	file->size = 0;
+	file->mapped = false;
+	file->borrowed = false;
+	if (!strcmp(path, STDIO_PATH)) {
+		return read_stdin(file);
 	}
 
-	if (num_bytes == -1) {
-		printf("Error: invalid UTF-8 first byte: 0x%02x\n", first_byte);
-		return;
+#ifdef _WIN32
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		log_perror("Error");
+		return false;
+	}
+	_fseeki64(fp, 0, SEEK_END);
+	int64_t size = _ftelli64(fp);
+	_fseeki64(fp, 0, SEEK_SET);
+	if (size < 0 || (uint64_t)size > SIZE_MAX) {
+		log_printf("Error: can't get the size of %s\n", path);
+		fclose(fp);
+		return false;
+	}
+	uint8_t *buffer = new uint8_t[size ? size : 1];
+	if (fread(buffer, 1, size, fp) != (size_t)size) {
+		log_printf("Error: couldn't read all of %s\n", path);
+		delete[] buffer;
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_perror("Error");
+		return false;
+	}
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0) {
+		log_perror("Error");
+		close(fd);
+		return false;
+	}
+	uint64_t size = file_stat.st_size;
+	if (size > SIZE_MAX) {
+		log_printf("Error: %s is too big\n", path);
+		close(fd);
+		return false;
 	}
 
-	for (int i = 1; i < num_bytes; i++) {
-		if (utf8_char[i] < 0x80 || utf8_char[i] >= 0xc0) {
-			printf("Error: invalid UTF-8 continuation byte: 0x%02x\n", utf8_char[i]);
-			return;
+	if (size > 0 && curr_map_inputs) {
+		void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			close(fd);
+			file->data = (const uint8_t *)data;
+			file->size = size;
+			file->mapped = true;
+			return true;
 		}
 	}
-	
-	for (int i = 0; i < num_bytes; i++) {
-		string[idx] = utf8_char[i];
-		idx++;
+
+	// can't be mapped (e.g. a pipe) or mapping is off, read it instead
+	uint8_t *buffer = new uint8_t[size ? size : 1];
+	uint64_t bytes_read = 0;
+	while (bytes_read < size) {
+		ssize_t result = read(fd, buffer + bytes_read, size - bytes_read);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			if (result < 0) {
+				log_perror("Error");
+			} else {
+				log_printf("Error: couldn't read all of %s\n", path);
+			}
+			delete[] buffer;
+			close(fd);
+			return false;
+		}
+		bytes_read += result;
 	}
+	close(fd);
+#endif
+
+	file->data = buffer;
+	file->size = size;
+	return true;
+}
+
+
+thread_local memory_files_t *curr_memory_files = NULL;
+
+// Set before any thread starts, so they're only read afterwards
+const utils_hooks_t *utils_hooks = NULL;
+
+
+// Sets the functions called when reading and writing files and allocating buffers, NULL for none
+void set_utils_hooks(const utils_hooks_t *hooks) {
+	utils_hooks = hooks;
+}
+
+
+inline double hook_io_start() {
+	return utils_hooks && utils_hooks->io_start ? utils_hooks->io_start() : 0;
+}
+
+
+inline void hook_read_done(double start_time, uint64_t size) {
+	if (utils_hooks && utils_hooks->read_done) {
+		utils_hooks->read_done(start_time, size);
+	}
+}
+
+
+inline void hook_write_done(double start_time, const file_part_t *parts, int num_parts) {
+	if (utils_hooks && utils_hooks->write_done) {
+		uint64_t size = 0;
+		for (int i = 0; i < num_parts; i++) {
+			size += parts[i].length;
+		}
+		utils_hooks->write_done(start_time, size);
+	}
+}
+
+
+// Sets the memory files of the current thread, NULL to use the disk
+void set_memory_files(memory_files_t *files) {
+	curr_memory_files = files;
+}
+
+
+void free_memory_outputs(memory_files_t *files) {
+	for (uint32_t i = 0; i < files->num_outputs; i++) {
+		delete[] files->outputs[i].path;
+		delete[] files->outputs[i].data;
+	}
+	files->num_outputs = 0;
+}
+
+
+// Maps a file read-only, or reads it whole if it can't be mapped or the thread doesn't map files
+bool open_input_file(const char *path, input_file_t *file) {
+	double start_time = hook_io_start();
+	if (curr_memory_files && !strcmp(path, curr_memory_files->input_path)) {
+		file->data = curr_memory_files->input_data;
+		file->size = curr_memory_files->input_size;
+		file->mapped = false;
+		file->borrowed = true;
+	} else if (!map_input_file(path, file)) {
+		return false;
+	}
+	hook_read_done(start_time, file->size);
+	return true;
+}
+
+
+void close_input_file(input_file_t *file) {
+#ifndef _WIN32
+	if (file->mapped) {
+		munmap((void *)file->data, file->size);
+	} else
+#endif
+	if (!file->borrowed) {
+		delete[] file->data;
+	}
+	file->data = NULL;
+	file->size = 0;
+	file->mapped = false;
+	file->borrowed = false;
+}
+
+
+void write_file(const char *path, const char *suffix, uint8_t *data, size_t data_length) {
+    const file_part_t part = {data, data_length};
+    write_file_parts(path, suffix, &part, 1);
+}
+
+
+// Joins the pieces into a new memory file of the current thread
+bool write_memory_file(char *path, const file_part_t *parts, int num_parts) {
+    memory_files_t *files = curr_memory_files;
+    if (files->num_outputs == MAX_MEMORY_OUTPUTS) {
+        log_printf("Error: too many output files for %s\n", files->input_path);
+        delete[] path;
+        return false;
+    }
+    uint64_t size = 0;
+    for (int i = 0; i < num_parts; i++) {
+        size += parts[i].length;
+    }
+    memory_file_t &file = files->outputs[files->num_outputs++];
+    file.path = path;
+    file.data = new uint8_t[size ? size : 1];
+    file.size = size;
+    uint8_t *curr_ptr = file.data;
+    for (int i = 0; i < num_parts; i++) {
+        memcpy(curr_ptr, parts[i].data, parts[i].length);
+        curr_ptr += parts[i].length;
+    }
+    return true;
+}
+
+
+// Writes several pieces of data to a single file, with one vectored write when available
+bool write_file_parts(const char *path, const char *suffix, const file_part_t *parts, int num_parts) {
+    double start_time = hook_io_start();
+    size_t new_path_len = strlen(path) + strlen(suffix);
+    char *new_path = new char[new_path_len + 1];
+    sprintf(new_path, "%s%s", path, suffix);
+    if (curr_memory_files) {
+        if (!write_memory_file(new_path, parts, num_parts)) {
+            return false;
+        }
+        hook_write_done(start_time, parts, num_parts);
+        return true;
+    }
+    // STDIO_PATH writes to stdout, whatever the suffix
+    bool to_stdout = !strcmp(path, STDIO_PATH);
+
+#ifdef _WIN32
+    FILE *fp = stdout;
+    if (to_stdout) {
+        _setmode(_fileno(stdout), _O_BINARY);
+    } else {
+        fp = fopen(new_path, "wb");
+    }
+    delete[] new_path;
+    if (!fp) {
+        log_perror("Error");
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < num_parts && ok; i++) {
+        ok = fwrite(parts[i].data, 1, parts[i].length, fp) == parts[i].length;
+    }
+    ok = (to_stdout ? fflush(fp) : fclose(fp)) == 0 && ok;
+#else
+    // anything printed before must come out first
+    fflush(stdout);
+    int fd = to_stdout ? STDOUT_FILENO : open(new_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    delete[] new_path;
+    if (fd < 0) {
+        log_perror("Error");
+        return false;
+    }
+    struct iovec *iov = new struct iovec[num_parts];
+    for (int i = 0; i < num_parts; i++) {
+        iov[i].iov_base = (void *)parts[i].data;
+        iov[i].iov_len = parts[i].length;
+    }
+    // writev may write less than asked, continue from where it stopped
+    bool ok = true;
+    int curr_part = 0;
+    while (curr_part < num_parts) {
+        ssize_t written = writev(fd, iov + curr_part, num_parts - curr_part);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            ok = false;
+            break;
+        }
+        while (curr_part < num_parts && (size_t)written >= iov[curr_part].iov_len) {
+            written -= iov[curr_part].iov_len;
+            curr_part++;
+        }
+        if (curr_part < num_parts) {
+            iov[curr_part].iov_base = (uint8_t *)iov[curr_part].iov_base + written;
+            iov[curr_part].iov_len -= written;
+        }
+    }
+    delete[] iov;
+    if (!to_stdout) {
+        ok = close(fd) == 0 && ok;
+    }
+#endif
+
+    if (!ok) {
+        log_perror("Error");
+        return false;
+    }
+    hook_write_done(start_time, parts, num_parts);
+    return true;
 }
 
 
@@ -61,3 +353,122 @@ void print_binary_array(FILE *stream, uint8_t *array, size_t length) {
 		fprintf(stream, " ");
 	}
 }
+
+
+// Prints a string as a JSON string, with quotes and escapes
+void print_json_string(FILE *stream, const char *string) {
+	fputc('"', stream);
+	for (const char *c = string; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(stream, "\\%c", *c);
+		} else if ((uint8_t)*c < 0x20) {
+			fprintf(stream, "\\u%04x", *c);
+		} else {
+			fputc(*c, stream);
+		}
+	}
+	fputc('"', stream);
+}
+
+
+// Total capacity of all grow buffers, and its peak
+std::atomic<size_t> grow_buffer_total_size(0);
+std::atomic<size_t> grow_buffer_max_size(0);
+
+
+grow_buffer_t::~grow_buffer_t() {
+	grow_buffer_total_size -= capacity;
+	delete[] data;
+}
+
+
+// Returns a buffer of at least size bytes
+uint8_t *grow_buffer_t::reserve(size_t size) {
+	if (data && size <= capacity) {
+		return data;
+	}
+
+	// grow a bit more than needed, so slightly bigger files don't make it grow again
+	size_t new_capacity = size + size / 8;
+	if (new_capacity < 256) {
+		new_capacity = 256;
+	}
+	delete[] data;
+	data = new uint8_t[new_capacity];
+	if (utils_hooks && utils_hooks->buffer_allocated) {
+		utils_hooks->buffer_allocated(new_capacity);
+	}
+
+	size_t total_size = grow_buffer_total_size += new_capacity - capacity;
+	size_t max_size = grow_buffer_max_size;
+	while (total_size > max_size && !grow_buffer_max_size.compare_exchange_weak(max_size, total_size)) {}
+	capacity = new_capacity;
+	return data;
+}
+
+
+// Peak of the memory used by all grow buffers at the same time
+size_t grow_buffer_peak_size() {
+	return grow_buffer_max_size;
+}
+
+
+// Monotonic time in milliseconds, for measuring durations
+double get_time_ms() {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+thread_local log_buffer_t *curr_log_buffer = NULL;
+FILE *log_stream = NULL; // stdout if NULL
+
+
+// Sets the log buffer of the current thread, NULL to print straight to the log stream
+void log_set_buffer(log_buffer_t *buffer) {
+	curr_log_buffer = buffer;
+}
+
+
+// Sets where logs without a buffer are printed for all threads, stdout by default
+void log_set_stream(FILE *stream) {
+	log_stream = stream;
+}
+
+
+void log_printf(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	if (!curr_log_buffer) {
+		vfprintf(log_stream ? log_stream : stdout, format, args);
+		va_end(args);
+		return;
+	}
+
+	va_list args_copy;
+	va_copy(args_copy, args);
+	int length = vsnprintf(NULL, 0, format, args_copy);
+	va_end(args_copy);
+	if (length > 0) {
+		log_buffer_t *buffer = curr_log_buffer;
+		if (buffer->size + length + 1 > buffer->capacity) {
+			size_t new_capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+			while (new_capacity < buffer->size + length + 1) {
+				new_capacity *= 2;
+			}
+			char *new_data = new char[new_capacity];
+			memcpy(new_data, buffer->data, buffer->size);
+			delete[] buffer->data;
+			buffer->data = new_data;
+			buffer->capacity = new_capacity;
+		}
+		vsnprintf(buffer->data + buffer->size, length + 1, format, args);
+		buffer->size += length;
+	}
+	va_end(args);
+}
+
+
+// Same as perror, but through the log
+void log_perror(const char *prefix) {
+	log_printf("%s: %s\n", prefix, strerror(errno));
+}
@@ -4,6 +4,94 @@
 #include <stdio.h>
 
 
+// Piece of data to write with write_file_parts
+struct file_part_t {
+	const uint8_t *data;
+	size_t length;
+};
+
+
+// Read-only contents of a whole file, memory-mapped when possible
+struct input_file_t {
+	const uint8_t *data;
+	uint64_t size;
+	bool mapped;
+	bool borrowed; // the data belongs to a memory file, it's not freed when closing
+};
+
+
+// Buffer that only grows, reused for many files so that processing stops allocating once it's big enough.
+// Its contents are not kept when it grows.
+struct grow_buffer_t {
+	uint8_t *data = NULL;
+	size_t capacity = 0;
+
+	grow_buffer_t() = default;
+	grow_buffer_t(const grow_buffer_t &) = delete;
+	grow_buffer_t &operator=(const grow_buffer_t &) = delete;
+	~grow_buffer_t();
+
+	uint8_t *reserve(size_t size);
+};
+
+
+// Console output of a thread goes to its log buffer when it has one, so files processed in parallel
+// don't mix their output
+struct log_buffer_t {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+
+// File written to memory, see memory_files_t
+struct memory_file_t {
+	char *path; // including the suffix
+	uint8_t *data;
+	uint64_t size;
+};
+
+// Most files written while processing one input in memory (decode writes two)
+const uint32_t MAX_MEMORY_OUTPUTS = 4;
+
+// Files of a thread that are in memory instead of on disk, e.g. the entries of an archive: opening input_path
+// gives input_data, and every file written is added to outputs
+struct memory_files_t {
+	const char *input_path;
+	const uint8_t *input_data;
+	uint64_t input_size;
+	memory_file_t outputs[MAX_MEMORY_OUTPUTS];
+	uint32_t num_outputs;
+};
+
+
+// Lets another module measure file reads and writes and grow buffer allocations without utils depending on it,
+// see stats_utils_hooks. Any of them can be NULL.
+struct utils_hooks_t {
+	double (*io_start)(); // start time of a read or write, given to read_done or write_done
+	void (*read_done)(double start_time, uint64_t size);
+	void (*write_done)(double start_time, uint64_t size);
+	void (*buffer_allocated)(size_t size); // new data of a grow buffer, including its first
+};
+
+
+// Path that stands for stdin when reading a file and for stdout when writing one
+const char *const STDIO_PATH = "-";
+
+
+void set_utils_hooks(const utils_hooks_t *hooks);
+void set_input_mapping(bool map);
+bool open_input_file(const char *path, input_file_t *file);
+void close_input_file(input_file_t *file);
+void set_memory_files(memory_files_t *files);
+void free_memory_outputs(memory_files_t *files);
 void write_file(const char *path, const char *suffix, uint8_t *data, size_t data_length);
-void append_utf8_char(uint8_t *string, size_t &idx, const uint8_t *utf8_char);
+bool write_file_parts(const char *path, const char *suffix, const file_part_t *parts, int num_parts);
 void print_binary_array(FILE *stream, uint8_t *array, size_t length);
+void print_json_string(FILE *stream, const char *string);
+double get_time_ms();
+size_t grow_buffer_peak_size();
+void log_set_buffer(log_buffer_t *buffer);
+void log_set_stream(FILE *stream);
+void log_printf(const char *format, ...);
+void log_perror(const char *prefix);
@@ -0,0 +1,313 @@
+#include "watch.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "th128_fix.h"
+#include "utils.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <thread>
+
+
+/*
+	Watch mode:
+
+	inotify reports every replay that was closed after being written (IN_CLOSE_WRITE) or moved into the folder
+	(IN_MOVED_TO). The game may write a replay more than once while saving it, so a replay is only processed
+	once it hasn't had any event for the debounce time. It's then scanned, and fixed if bugged, by a pool of
+	worker threads that live as long as the watch, so their buffers stay allocated between replays.
+
+	A replay that gets events while it's already queued only has its event time updated. While it's being
+	processed, it's queued again once its worker is done, so a replay is never processed by two workers at once.
+	Workers read replays instead of mapping them, since the game can rewrite a replay while it's being read.
+
+	Fixed replays (.fixed.rpy) are written to the same folder, and ignored when their own events arrive.
+	Latencies are measured from the last event of each replay, which is when the game finished saving it.
+*/
+
+volatile sig_atomic_t watch_stop_requested = 0;
+
+
+void watch_stop_handler(int) {
+	watch_stop_requested = 1;
+}
+
+
+// .rpy files other than the ones written by the fixer
+bool watch_is_replay(const char *name) {
+	size_t length = strlen(name);
+	return length > 4 && !strcmp(name + length - 4, ".rpy") && !(length > 10 && !strcmp(name + length - 10, ".fixed.rpy"));
+}
+
+
+void watch_process(watch_t *watch, const watch_task_t &task, log_buffer_t &log) {
+	double start_time = get_time_ms();
+	log.size = 0;
+	log_set_buffer(&log);
+	int correct_route;
+	th128_scan_result_t result = th128_scan_replay_file(task.path, correct_route);
+	bool fixed = false;
+	if (result == TH128_SCAN_BUGGED) {
+		fixed = th128_fix_replay_file(task.path, watch->options->compression_options) == TH128_FIX_FIXED;
+	}
+	log_set_buffer(NULL);
+	double end_time = get_time_ms();
+
+	watch->counts[result]++;
+	watch->num_fixed += fixed;
+	std::lock_guard<std::mutex> lock(watch->print_mutex);
+	// details are only shown when something went wrong
+	if (result == TH128_SCAN_ERROR || (result == TH128_SCAN_BUGGED && !fixed)) {
+		fwrite(log.data, 1, log.size, stdout);
+	}
+	if (result == TH128_SCAN_CLEAN) {
+		printf("%s: clean", task.path);
+	} else if (fixed) {
+		printf("%s: bugged, fixed with route %s", task.path, routes[correct_route]);
+	} else {
+		printf("%s: error", task.path);
+	}
+	printf(" (%.1f ms after the save, %.1f ms processing)\n", end_time - task.event_time, end_time - start_time);
+	fflush(stdout);
+}
+
+
+// Task of a replay in tasks, NULL if there's none
+watch_task_t *watch_find_task(std::deque<watch_task_t> &tasks, const char *path) {
+	for (watch_task_t &task : tasks) {
+		if (!strcmp(task.path, path)) {
+			return &task;
+		}
+	}
+	return NULL;
+}
+
+
+// Waits for a task and marks it as running. Returns false once stopping with no tasks left.
+bool watch_take_task(watch_t *watch, watch_task_t &task) {
+	std::unique_lock<std::mutex> lock(watch->mutex);
+	watch->condition.wait(lock, [watch] { return watch->stopping || !watch->tasks.empty(); });
+	if (watch->tasks.empty()) {
+		return false;
+	}
+	task = watch->tasks.front();
+	watch->tasks.pop_front();
+	watch->running.push_back(task);
+	return true;
+}
+
+
+// Frees a task once it's processed, and queues its replay again if it got events in the meantime
+void watch_finish_task(watch_t *watch, const watch_task_t &task) {
+	std::lock_guard<std::mutex> lock(watch->mutex);
+	for (size_t i = 0; i < watch->running.size(); i++) {
+		if (watch->running[i].path == task.path) {
+			watch->running.erase(watch->running.begin() + i);
+			break;
+		}
+	}
+	for (size_t i = 0; i < watch->again.size(); i++) {
+		if (!strcmp(watch->again[i].path, task.path)) {
+			watch->tasks.push_back(watch->again[i]);
+			watch->again.erase(watch->again.begin() + i);
+			watch->condition.notify_one();
+			break;
+		}
+	}
+	delete[] task.path;
+}
+
+
+void watch_worker(watch_t *watch) {
+	// the game may be rewriting a replay while it's read
+	set_input_mapping(false);
+	log_buffer_t log = {NULL, 0, 0};
+	watch_task_t task;
+	while (watch_take_task(watch, task)) {
+		watch_process(watch, task, log);
+		watch_finish_task(watch, task);
+	}
+	delete[] log.data;
+}
+
+
+// Queues a replay, unless it's already queued or running. Takes the path of the task. Expects watch->mutex to be held.
+void watch_queue_task(watch_t *watch, const watch_task_t &task) {
+	watch_task_t *same_task = watch_find_task(watch->tasks, task.path);
+	if (!same_task && watch_find_task(watch->running, task.path)) {
+		same_task = watch_find_task(watch->again, task.path);
+		if (!same_task) {
+			watch->again.push_back(task);
+			return;
+		}
+	}
+	if (same_task) {
+		same_task->event_time = task.event_time;
+		delete[] task.path;
+		return;
+	}
+	watch->tasks.push_back(task);
+	watch->condition.notify_one();
+}
+
+
+// Queues the replays that didn't get any event for the debounce time, returns the ms until the next one is due (-1 if none)
+int watch_dispatch(watch_t *watch, std::deque<watch_task_t> &pending) {
+	double now = get_time_ms();
+	double next_due = -1;
+	std::lock_guard<std::mutex> lock(watch->mutex);
+	for (size_t i = 0; i < pending.size();) {
+		double due_time = pending[i].event_time + watch->options->debounce_ms;
+		if (due_time <= now) {
+			watch_queue_task(watch, pending[i]);
+			pending.erase(pending.begin() + i);
+			continue;
+		}
+		if (next_due < 0 || due_time < next_due) {
+			next_due = due_time;
+		}
+		i++;
+	}
+	return next_due < 0 ? -1 : (int)(next_due - now) + 1;
+}
+
+
+// Adds a replay that just got an event, or restarts its debounce time if it's already waiting
+void watch_add_pending(std::deque<watch_task_t> &pending, const char *dir, const char *name, double event_time) {
+	size_t path_length = strlen(dir) + 1 + strlen(name);
+	char *path = new char[path_length + 1];
+	sprintf(path, "%s/%s", dir, name);
+	for (watch_task_t &task : pending) {
+		if (!strcmp(task.path, path)) {
+			task.event_time = event_time;
+			delete[] path;
+			return;
+		}
+	}
+	pending.push_back({path, event_time});
+}
+
+
+// Fixes the replays written to dir until interrupted (Ctrl+C). Returns false if the folder can't be watched.
+bool watch_directory(const char *dir, const watch_options_t &options) {
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) {
+		log_perror("Error");
+		return false;
+	}
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		log_perror("Error");
+		close(fd);
+		return false;
+	}
+
+	// the signals stay blocked except while waiting in ppoll, so one that arrives between checking
+	// watch_stop_requested and waiting isn't missed. The workers inherit the mask, so they never get them.
+	sigset_t stop_signals;
+	sigset_t wait_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+	sigdelset(&wait_mask, SIGINT);
+	sigdelset(&wait_mask, SIGTERM);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = watch_stop_handler;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	watch_t watch;
+	watch.options = &options;
+	watch.stopping = false;
+	for (int i = 0; i < 3; i++) {
+		watch.counts[i] = 0;
+	}
+	watch.num_fixed = 0;
+	uint32_t num_workers = options.num_jobs ? options.num_jobs : std::thread::hardware_concurrency();
+	if (num_workers == 0) {
+		num_workers = 1;
+	}
+	std::thread *workers = new std::thread[num_workers];
+	for (uint32_t i = 0; i < num_workers; i++) {
+		workers[i] = std::thread(watch_worker, &watch);
+	}
+
+	printf("Watching %s for new replays with %u workers, press Ctrl+C to stop.\n", dir, num_workers);
+	fflush(stdout);
+
+	alignas(struct inotify_event) char buffer[4096];
+	std::deque<watch_task_t> pending;
+	int timeout = -1;
+	while (!watch_stop_requested) {
+		struct pollfd poll_fd = {fd, POLLIN, 0};
+		struct timespec timeout_time = {timeout / 1000, (timeout % 1000) * 1000000L};
+		int ready = ppoll(&poll_fd, 1, timeout < 0 ? NULL : &timeout_time, &wait_mask);
+		if (ready < 0 && errno != EINTR) {
+			log_perror("Error");
+			break;
+		}
+		if (ready > 0) {
+			ssize_t length = read(fd, buffer, sizeof(buffer));
+			if (length < 0 && errno != EINTR && errno != EAGAIN) {
+				log_perror("Error");
+				break;
+			}
+			double event_time = get_time_ms();
+			bool folder_gone = false;
+			for (char *curr_ptr = buffer; length > 0 && curr_ptr < buffer + length;) {
+				const struct inotify_event *event = (const struct inotify_event *)curr_ptr;
+				curr_ptr += sizeof(struct inotify_event) + event->len;
+				if (event->mask & IN_Q_OVERFLOW) {
+					printf("WARNING: too many events at once, some replays may have been missed.\n");
+				}
+				if (event->mask & IN_IGNORED) {
+					folder_gone = true;
+				}
+				if (event->len > 0 && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && watch_is_replay(event->name)) {
+					watch_add_pending(pending, dir, event->name, event_time);
+				}
+			}
+			if (folder_gone) {
+				printf("%s is no longer there, stopping.\n", dir);
+				break;
+			}
+		}
+		timeout = watch_dispatch(&watch, pending);
+	}
+
+	// replays still waiting for their debounce time are dropped, the ones queued are finished
+	for (watch_task_t &task : pending) {
+		delete[] task.path;
+	}
+	{
+		std::lock_guard<std::mutex> lock(watch.mutex);
+		watch.stopping = true;
+	}
+	watch.condition.notify_all();
+	for (uint32_t i = 0; i < num_workers; i++) {
+		workers[i].join();
+	}
+	delete[] workers;
+	close(fd);
+	pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+
+	printf("\nStopped watching. Fixed %u replays (%u bugged, %u clean, %u errors).\n", (uint32_t)watch.num_fixed,
+		(uint32_t)watch.counts[TH128_SCAN_BUGGED], (uint32_t)watch.counts[TH128_SCAN_CLEAN], (uint32_t)watch.counts[TH128_SCAN_ERROR]);
+	return true;
+}
+
+#else
+
+bool watch_directory(const char *, const watch_options_t &) {
+	printf("Watching folders is only supported on Linux.\n");
+	return false;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "compression.h"
+
+#ifdef __linux__
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#endif
+
+
+struct watch_options_t {
+	uint32_t num_jobs; // worker threads, 0 = one per CPU core
+	const compression_options_t *compression_options; // NULL to patch replays
+	uint32_t debounce_ms; // time without writes before a replay is processed
+};
+
+
+#ifdef __linux__
+struct watch_task_t {
+	char *path;
+	double event_time; // last event of the replay
+};
+
+// There's at most one task per replay in tasks and running, so two workers never write the same fixed replay at once
+struct watch_t {
+	const watch_options_t *options;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<watch_task_t> tasks; // replays ready to be processed
+	std::deque<watch_task_t> running; // replays being processed
+	std::deque<watch_task_t> again; // running replays that got events since they started, queued again when done
+	bool stopping;
+	std::mutex print_mutex;
+	std::atomic<uint32_t> counts[3]; // indexed by th128_scan_result_t
+	std::atomic<uint32_t> num_fixed;
+};
+
+
+bool watch_is_replay(const char *name);
+bool watch_take_task(watch_t *watch, watch_task_t &task);
+void watch_finish_task(watch_t *watch, const watch_task_t &task);
+int watch_dispatch(watch_t *watch, std::deque<watch_task_t> &pending);
+void watch_add_pending(std::deque<watch_task_t> &pending, const char *dir, const char *name, double event_time);
+#endif
+
+bool watch_directory(const char *dir, const watch_options_t &options);